@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cliconfig.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+CliConfig::CliConfig()
+    : camera(0),
+      fps(20),
+      exposure(100),
+      gain(32),
+      excitation(1),
+      color(false),
+      codec(VideoCodec::FFV1),
+      container(VideoContainer::Matroska),
+      lossless(true),
+      sliceInterval(0),
+      externalTrigger(false),
+      preTriggerTime(0),
+      output("miniscope-recording"),
+      duration(0),
+      statsInterval(5),
+      processingThreads(0),
+      benchmarkKernels(false),
+      showHelp(false)
+{
+}
+
+static bool parseBool(const std::string &value, bool *result)
+{
+    const auto v = boost::algorithm::to_lower_copy(value);
+    if (v == "true" || v == "yes" || v == "on" || v == "1") {
+        *result = true;
+        return true;
+    }
+    if (v == "false" || v == "no" || v == "off" || v == "0") {
+        *result = false;
+        return true;
+    }
+    return false;
+}
+
+template<typename T>
+static bool parseNumber(const std::string &value, T *result)
+{
+    try {
+        *result = boost::lexical_cast<T>(value);
+    } catch (const boost::bad_lexical_cast &) {
+        return false;
+    }
+    return true;
+}
+
+static bool parseCodec(const std::string &value, VideoCodec *codec)
+{
+    const auto v = boost::algorithm::to_lower_copy(value);
+    if (v == "raw")
+        *codec = VideoCodec::Raw;
+    else if (v == "ffv1")
+        *codec = VideoCodec::FFV1;
+    else if (v == "av1")
+        *codec = VideoCodec::AV1;
+    else if (v == "vp9")
+        *codec = VideoCodec::VP9;
+    else if (v == "h265" || v == "hevc")
+        *codec = VideoCodec::H265;
+    else if (v == "mpeg4")
+        *codec = VideoCodec::MPEG4;
+    else
+        return false;
+    return true;
+}
+
+static bool parseCrop(const std::string &value, cv::Rect *crop)
+{
+    std::vector<std::string> parts;
+    boost::algorithm::split(parts, value, boost::algorithm::is_any_of(","));
+    if (parts.size() != 4)
+        return false;
+
+    int v[4];
+    for (size_t i = 0; i < 4; i++) {
+        if (!parseNumber(boost::algorithm::trim_copy(parts[i]), &v[i]) || v[i] < 0)
+            return false;
+    }
+    *crop = cv::Rect(v[0], v[1], v[2], v[3]);
+    return true;
+}
+
+static bool parseBinningMode(const std::string &value, BinningMode *mode)
+{
+    const auto v = boost::algorithm::to_lower_copy(value);
+    if (v == "mean")
+        *mode = BinningMode::Mean;
+    else if (v == "sum")
+        *mode = BinningMode::Sum;
+    else
+        return false;
+    return true;
+}
+
+static bool parseContainer(const std::string &value, VideoContainer *container)
+{
+    const auto v = boost::algorithm::to_lower_copy(value);
+    if (v == "mkv" || v == "matroska")
+        *container = VideoContainer::Matroska;
+    else if (v == "avi")
+        *container = VideoContainer::AVI;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Apply a single setting, given either on the command-line or in a config file.
+ */
+static bool applyOption(CliConfig *config, const std::string &key, const std::string &value, std::string *error)
+{
+    bool ok;
+
+    if (key == "camera")
+        ok = parseNumber(value, &config->camera);
+    else if (key == "fps")
+        ok = parseNumber(value, &config->fps);
+    else if (key == "exposure")
+        ok = parseNumber(value, &config->exposure);
+    else if (key == "gain")
+        ok = parseNumber(value, &config->gain);
+    else if (key == "excitation")
+        ok = parseNumber(value, &config->excitation);
+    else if (key == "color")
+        ok = parseBool(value, &config->color);
+    else if (key == "codec")
+        ok = parseCodec(value, &config->codec);
+    else if (key == "container")
+        ok = parseContainer(value, &config->container);
+    else if (key == "lossless")
+        ok = parseBool(value, &config->lossless);
+    else if (key == "slice-interval")
+        ok = parseNumber(value, &config->sliceInterval);
+    else if (key == "crop")
+        ok = parseCrop(value, &config->reduction.crop);
+    else if (key == "binning")
+        ok = parseNumber(value, &config->reduction.binning) &&
+             (config->reduction.binning == 1 || config->reduction.binning == 2 || config->reduction.binning == 4);
+    else if (key == "temporal-binning")
+        ok = parseNumber(value, &config->reduction.temporalBinning) && config->reduction.temporalBinning >= 1;
+    else if (key == "binning-mode")
+        ok = parseBinningMode(value, &config->reduction.binningMode);
+    else if (key == "deep-pixels")
+        ok = parseBool(value, &config->reduction.deepPixels);
+    else if (key == "trigger")
+        ok = parseBool(value, &config->externalTrigger);
+    else if (key == "pre-trigger")
+        ok = parseNumber(value, &config->preTriggerTime) && config->preTriggerTime >= 0 && config->preTriggerTime <= 10;
+    else if (key == "output") {
+        config->output = value;
+        ok = !value.empty();
+    } else if (key == "duration")
+        ok = parseNumber(value, &config->duration) && config->duration >= 0;
+    else if (key == "stats-interval")
+        ok = parseNumber(value, &config->statsInterval) && config->statsInterval >= 0;
+    else if (key == "processing-threads")
+        ok = parseNumber(value, &config->processingThreads);
+    else if (key == "trace") {
+        config->traceFile = value;
+        ok = true;
+    } else if (key == "control-socket") {
+        config->controlSocket = value;
+        ok = true;
+    } else if (key == "shared-ring") {
+        config->sharedRing = value;
+        ok = true;
+    } else if (key == "benchmark-kernels")
+        ok = parseBool(value, &config->benchmarkKernels);
+    else {
+        *error = boost::str(boost::format("Unknown option '%1%'") % key);
+        return false;
+    }
+
+    if (!ok)
+        *error = boost::str(boost::format("Invalid value '%1%' for option '%2%'") % value % key);
+    return ok;
+}
+
+bool loadCliConfigFile(const std::string &fname, CliConfig *config, std::string *error)
+{
+    std::ifstream file(fname);
+    if (!file.is_open()) {
+        *error = boost::str(boost::format("Unable to open config file '%1%'") % fname);
+        return false;
+    }
+
+    std::string line;
+    uint lineNo = 0;
+    while (std::getline(file, line)) {
+        lineNo++;
+        boost::algorithm::trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        const auto sep = line.find('=');
+        if (sep == std::string::npos) {
+            *error = boost::str(boost::format("%1%:%2%: Expected 'key = value'") % fname % lineNo);
+            return false;
+        }
+
+        const auto key = boost::algorithm::trim_copy(line.substr(0, sep));
+        const auto value = boost::algorithm::trim_copy(line.substr(sep + 1));
+        std::string optError;
+        if (!applyOption(config, key, value, &optError)) {
+            *error = boost::str(boost::format("%1%:%2%: %3%") % fname % lineNo % optError);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool parseCliArguments(int argc, char **argv, CliConfig *config, std::string *error)
+{
+    std::vector<std::pair<std::string, std::string>> options;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string arg(argv[i]);
+        if (arg == "-h" || arg == "--help") {
+            config->showHelp = true;
+            return true;
+        }
+        if (!boost::algorithm::starts_with(arg, "--") || arg.length() < 3) {
+            *error = boost::str(boost::format("Unexpected argument '%1%'") % arg);
+            return false;
+        }
+
+        std::string key;
+        std::string value;
+        const auto sep = arg.find('=');
+        if (sep != std::string::npos) {
+            key = arg.substr(2, sep - 2);
+            value = arg.substr(sep + 1);
+        } else {
+            key = arg.substr(2);
+            if (key == "color" || key == "lossless" || key == "trigger" || key == "deep-pixels" ||
+                key == "benchmark-kernels") {
+                // switches may be given without a value
+                value = "true";
+            } else if (boost::algorithm::starts_with(key, "no-")) {
+                key = key.substr(3);
+                value = "false";
+            } else if (i + 1 < argc) {
+                value = argv[++i];
+            } else {
+                *error = boost::str(boost::format("Option '--%1%' requires a value") % key);
+                return false;
+            }
+        }
+
+        options.push_back(std::make_pair(key, value));
+    }
+
+    // load the config file first, so flags on the command-line override its values
+    for (const auto &opt : options) {
+        if (opt.first == "config") {
+            if (!loadCliConfigFile(opt.second, config, error))
+                return false;
+        }
+    }
+    for (const auto &opt : options) {
+        if (opt.first == "config")
+            continue;
+        if (!applyOption(config, opt.first, opt.second, error))
+            return false;
+    }
+
+    return true;
+}
+
+void printCliUsage(const char *progName)
+{
+    std::cout << "Usage: " << progName << " [OPTIONS]\n"
+              << "Record from a Miniscope without a graphical interface.\n\n"
+              << "Options:\n"
+              << "  --config=FILE          read 'key = value' settings from FILE, using the option names below\n"
+              << "  --camera=ID            camera device ID (default: 0)\n"
+              << "  --fps=N                frames per second, 0 to let the camera run freely and record\n"
+              << "                         at the measured rate (default: 20)\n"
+              << "  --exposure=VALUE       exposure (default: 100)\n"
+              << "  --gain=VALUE           gain (default: 32)\n"
+              << "  --excitation=VALUE     excitation LED intensity (default: 1)\n"
+              << "  --color                record color frames\n"
+              << "  --codec=CODEC          raw, ffv1, av1, vp9, h265 or mpeg4 (default: ffv1)\n"
+              << "  --container=TYPE       mkv or avi (default: mkv)\n"
+              << "  --[no-]lossless        use lossless compression (default: on)\n"
+              << "  --slice-interval=MIN   start a new file every MIN minutes, 0 to disable (default: 0)\n"
+              << "  --crop=X,Y,W,H         only record this region of the frame\n"
+              << "  --binning=N            record the sum or mean of NxN pixels, 1, 2 or 4 (default: 1)\n"
+              << "  --temporal-binning=N   record the sum or mean of N consecutive frames, at 1/N of the\n"
+              << "                         frame rate (default: 1)\n"
+              << "  --binning-mode=MODE    mean or sum (default: mean)\n"
+              << "  --deep-pixels          record 16-bit grayscale frames (needs the ffv1 or raw codec)\n"
+              << "  --trigger              start and stop recording on the external trigger input\n"
+              << "  --pre-trigger=SEC      seconds of frames to keep before a trigger, up to 10 (default: 0)\n"
+              << "  --output=NAME          base name of the recorded video (default: miniscope-recording)\n"
+              << "  --duration=SEC         stop after SEC seconds, 0 to run until interrupted (default: 0)\n"
+              << "  --stats-interval=SEC   print a stats line every SEC seconds, 0 to disable (default: 5)\n"
+              << "  --processing-threads=N process the rows of frames on N threads, including the\n"
+              << "                         capture thread, 0 for automatic (default: 0)\n"
+              << "  --trace=FILE           write a trace of the acquisition pipeline to FILE\n"
+              << "  --control-socket=PATH  accept commands on a Unix domain socket at PATH; recording\n"
+              << "                         is then only started and stopped through the socket\n"
+              << "  --shared-ring=NAME     publish raw frames into the shared-memory ring NAME\n"
+              << "  --benchmark-kernels    measure the throughput of the pixel processing kernels\n"
+              << "                         for every instruction set this CPU supports, and how row-parallel\n"
+              << "                         processing of large frames scales with threads, then exit\n"
+              << "  -h, --help             show this help\n\n"
+              << "Exit status is 0 if all frames were recorded, 2 if frames were dropped\n"
+              << "or missed by the camera, and 1 on errors.\n";
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLICONFIG_H
+#define CLICONFIG_H
+
+#include <string>
+#include "miniscope.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief Settings of a headless acquisition run.
+ */
+struct CliConfig
+{
+    CliConfig();
+
+    int camera;
+    uint fps;
+    double exposure;
+    double gain;
+    double excitation;
+    bool color;
+
+    VideoCodec codec;
+    VideoContainer container;
+    bool lossless;
+    uint sliceInterval;         // minutes, 0 for no slicing
+    FrameReduction reduction;   // crop and binning of the recorded frames
+
+    bool externalTrigger;
+    double preTriggerTime;      // seconds
+
+    std::string output;
+    double duration;            // seconds, 0 to run until a signal is received
+    double statsInterval;       // seconds, 0 to disable stats lines
+    uint processingThreads;     // 0 for automatic
+    std::string traceFile;
+    std::string controlSocket;  // path of the control socket, empty to disable it
+    std::string sharedRing;     // name of the shared-memory frame ring, empty to disable it
+
+    bool benchmarkKernels;      // measure the pixel kernels instead of recording
+    bool showHelp;
+};
+
+#pragma GCC diagnostic pop
+
+bool loadCliConfigFile(const std::string &fname, CliConfig *config, std::string *error);
+bool parseCliArguments(int argc, char **argv, CliConfig *config, std::string *error);
+void printCliUsage(const char *progName);
+
+#endif // CLICONFIG_H
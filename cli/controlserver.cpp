@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "controlserver.h"
+
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// don't let a client that never sends a newline make us buffer forever
+static const size_t MAX_LINE_LENGTH = 4096;
+
+// events are dropped if the server thread can not keep up with them
+static const size_t MAX_PENDING_EVENTS = 1024;
+
+// clients that stop reading are disconnected once this much output is waiting for them
+static const size_t MAX_CLIENT_OUTPUT = 256 * 1024;
+
+static const char *controlName(CameraControl control)
+{
+    switch (control) {
+    case CameraControl::Exposure:
+        return "exposure";
+    case CameraControl::Gain:
+        return "gain";
+    case CameraControl::Excitation:
+        return "excitation";
+    }
+    return "unknown";
+}
+
+ControlServer::ControlServer(MiniScope *scope)
+    : m_scope(scope),
+      m_listenFd(-1),
+      m_running(false),
+      m_shutdownRequested(false)
+{
+    m_wakeFds[0] = -1;
+    m_wakeFds[1] = -1;
+}
+
+ControlServer::~ControlServer()
+{
+    stop();
+}
+
+std::string ControlServer::lastError() const
+{
+    return m_lastError;
+}
+
+bool ControlServer::shutdownRequested() const
+{
+    return m_shutdownRequested;
+}
+
+void ControlServer::postMessage(const std::string &msg)
+{
+    postEvent("EVENT message " + msg);
+}
+
+/**
+ * Send an event to all clients, from any thread.
+ * Events are only queued while the server is running.
+ */
+void ControlServer::postEvent(const std::string &event)
+{
+    if (!m_running)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_eventMutex);
+        if (m_pendingEvents.size() >= MAX_PENDING_EVENTS)
+            return;
+        m_pendingEvents.push_back(event);
+    }
+    wakeup();
+}
+
+/**
+ * Queue a line for sending to a client. A client that has too much output
+ * waiting already is marked for disconnection instead.
+ */
+void ControlServer::sendLine(Client &client, const std::string &line)
+{
+    if (client.closing)
+        return;
+    if (client.outBuffer.length() + line.length() + 1 > MAX_CLIENT_OUTPUT) {
+        client.closing = true;
+        return;
+    }
+    client.outBuffer.append(line);
+    client.outBuffer.push_back('\n');
+}
+
+#ifdef _WIN32
+
+bool ControlServer::start(const std::string &socketPath)
+{
+    m_socketPath = socketPath;
+    m_lastError = "The control socket is not supported on this platform.";
+    return false;
+}
+
+void ControlServer::stop()
+{
+}
+
+void ControlServer::wakeup()
+{
+}
+
+bool ControlServer::flushClient(Client &)
+{
+    return false;
+}
+
+#else
+
+bool ControlServer::start(const std::string &socketPath)
+{
+    stop();
+    m_socketPath = socketPath;
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.length() >= sizeof(addr.sun_path)) {
+        m_lastError = boost::str(boost::format("Invalid control socket path '%1%'") % socketPath);
+        return false;
+    }
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+    m_listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_listenFd < 0) {
+        m_lastError = boost::str(boost::format("Unable to create control socket: %1%") % strerror(errno));
+        return false;
+    }
+
+    // a socket left behind by a previous run would make bind() fail
+    unlink(socketPath.c_str());
+    if (bind(m_listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(m_listenFd, 8) != 0) {
+        m_lastError = boost::str(boost::format("Unable to listen on control socket '%1%': %2%") % socketPath % strerror(errno));
+        close(m_listenFd);
+        m_listenFd = -1;
+        return false;
+    }
+
+    if (pipe(m_wakeFds) != 0) {
+        m_lastError = boost::str(boost::format("Unable to create wakeup pipe: %1%") % strerror(errno));
+        close(m_listenFd);
+        m_listenFd = -1;
+        unlink(socketPath.c_str());
+        return false;
+    }
+    fcntl(m_wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(m_wakeFds[1], F_SETFL, O_NONBLOCK);
+
+    // the callback runs on the capture thread, so we only queue the event there
+    m_scope->setOnControlApplied([this](CameraControl control, double value, size_t frameNo) {
+        postEvent(boost::str(boost::format("EVENT applied %1% %2% frame=%3%")
+                             % controlName(control) % value % frameNo));
+    });
+
+    m_running = true;
+    m_thread = std::thread(&ControlServer::serve, this);
+    return true;
+}
+
+void ControlServer::stop()
+{
+    if (m_thread.joinable()) {
+        m_running = false;
+        wakeup();
+        m_thread.join();
+        m_scope->setOnControlApplied(nullptr);
+    }
+
+    for (auto &client : m_clients)
+        close(client.fd);
+    m_clients.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_eventMutex);
+        m_pendingEvents.clear();
+    }
+
+    if (m_listenFd >= 0) {
+        close(m_listenFd);
+        m_listenFd = -1;
+        unlink(m_socketPath.c_str());
+    }
+    for (auto &fd : m_wakeFds) {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+}
+
+void ControlServer::wakeup()
+{
+    if (m_wakeFds[1] < 0)
+        return;
+    const char c = 0;
+    // a full pipe already guarantees a wakeup, so errors can be ignored
+    if (write(m_wakeFds[1], &c, 1) < 0)
+        return;
+}
+
+/**
+ * Send as much of the output waiting for a client as its socket takes without
+ * blocking. Returns false if the connection failed.
+ */
+bool ControlServer::flushClient(Client &client)
+{
+    size_t written = 0;
+    while (written < client.outBuffer.length()) {
+        const auto ret = send(client.fd, client.outBuffer.c_str() + written,
+                              client.outBuffer.length() - written, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
+        }
+        written += static_cast<size_t>(ret);
+    }
+    client.outBuffer.erase(0, written);
+    return true;
+}
+
+void ControlServer::acceptClient()
+{
+    // a client that stops reading must not block us, so we never wait for its socket
+    const auto fd = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+
+    Client client;
+    client.fd = fd;
+    client.closing = false;
+    client.statsInterval = 0;
+    m_clients.push_back(client);
+}
+
+bool ControlServer::readClient(Client &client)
+{
+    char buf[512];
+    const auto ret = recv(client.fd, buf, sizeof(buf), 0);
+    if (ret <= 0)
+        return ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK);
+
+    client.inBuffer.append(buf, static_cast<size_t>(ret));
+    size_t pos;
+    while ((pos = client.inBuffer.find('\n')) != std::string::npos) {
+        const auto line = boost::algorithm::trim_copy(client.inBuffer.substr(0, pos));
+        client.inBuffer.erase(0, pos + 1);
+        if (!line.empty())
+            handleCommand(client, line);
+    }
+
+    if (client.inBuffer.length() > MAX_LINE_LENGTH) {
+        sendLine(client, "ERROR line too long");
+        flushClient(client);
+        return false;
+    }
+    return true;
+}
+
+void ControlServer::serve()
+{
+    while (m_running) {
+        std::vector<pollfd> fds;
+        fds.push_back({m_listenFd, POLLIN, 0});
+        fds.push_back({m_wakeFds[0], POLLIN, 0});
+        for (const auto &client : m_clients)
+            fds.push_back({client.fd, static_cast<short>(client.outBuffer.empty()? POLLIN : POLLIN | POLLOUT), 0});
+
+        // wake up in time for the next subscribed stats report
+        auto timeout = 1000;
+        const auto now = steady_hr_clock::now();
+        for (const auto &client : m_clients) {
+            if (client.statsInterval <= 0)
+                continue;
+            const auto due = std::chrono::duration_cast<std::chrono::milliseconds>(client.nextStats - now).count();
+            timeout = std::min(timeout, std::max(0, static_cast<int>(due)));
+        }
+
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+            break;
+        if (!m_running)
+            break;
+
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(m_wakeFds[0], buf, sizeof(buf)) > 0) {}
+        }
+
+        // handle client input before accepting, the pollfd indices must still match
+        std::vector<int> closedFds;
+        for (size_t i = 0; i < m_clients.size(); i++) {
+            if (fds[i + 2].revents == 0)
+                continue;
+            if (!readClient(m_clients[i]))
+                closedFds.push_back(m_clients[i].fd);
+        }
+        if (fds[0].revents & POLLIN)
+            acceptClient();
+
+        std::vector<std::string> events;
+        {
+            std::lock_guard<std::mutex> lock(m_eventMutex);
+            events.swap(m_pendingEvents);
+        }
+
+        const auto statsTime = steady_hr_clock::now();
+        std::string status;
+        for (auto &client : m_clients) {
+            for (const auto &event : events)
+                sendLine(client, event);
+
+            if (client.statsInterval > 0 && statsTime >= client.nextStats) {
+                if (status.empty())
+                    status = statusLine();
+                sendLine(client, status);
+                client.nextStats = statsTime + std::chrono::milliseconds(client.statsInterval);
+            }
+
+            if (client.closing || !flushClient(client))
+                closedFds.push_back(client.fd);
+        }
+
+        for (const auto fd : closedFds) {
+            const auto it = std::find_if(m_clients.begin(), m_clients.end(),
+                                         [fd](const Client &c) { return c.fd == fd; });
+            if (it == m_clients.end())
+                continue;
+            close(it->fd);
+            m_clients.erase(it);
+        }
+    }
+}
+
+#endif
+
+std::string ControlServer::statusLine() const
+{
+    size_t queueDepth = 0;
+    const auto stats = m_scope->stats();
+    for (const auto &gauge : stats.gauges) {
+        if (gauge.name == "encode_queue")
+            queueDepth = gauge.current;
+    }
+
+    return boost::str(boost::format("STATS running=%1% recording=%2% fps=%3$.2f recorded_ms=%4$.0f dropped=%5% gaps=%6% missed=%7% encode_queue=%8%")
+                      % m_scope->running()
+                      % m_scope->recording()
+                      % m_scope->measuredFps()
+                      % m_scope->lastRecordedFrameTime()
+                      % m_scope->droppedFramesCount()
+                      % m_scope->frameGapsCount()
+                      % m_scope->missedFramesCount()
+                      % queueDepth);
+}
+
+void ControlServer::handleCommand(Client &client, const std::string &line)
+{
+    std::vector<std::string> args;
+    boost::algorithm::split(args, line, boost::is_any_of(" \t"), boost::token_compress_on);
+    const auto cmd = boost::algorithm::to_lower_copy(args[0]);
+
+    if (cmd == "start") {
+        // frames grabbed from this moment on are recorded, so the reply tells the client
+        // exactly which point in time (on the monotonic clock) the recording begins at
+        const auto startTime = steady_hr_clock::now();
+        const auto fname = args.size() > 1 ? boost::algorithm::trim_copy(line.substr(args[0].length())) : m_scope->videoFilename();
+        if (!m_scope->startRecording(fname, startTime)) {
+            sendLine(client, "ERROR start " + m_scope->lastError());
+            return;
+        }
+        sendLine(client, boost::str(boost::format("OK start time_us=%1%")
+                                    % std::chrono::duration_cast<std::chrono::microseconds>(startTime.time_since_epoch()).count()));
+    } else if (cmd == "stop") {
+        const auto stopTime = steady_hr_clock::now();
+        m_scope->stopRecording(stopTime);
+        sendLine(client, boost::str(boost::format("OK stop time_us=%1%")
+                                    % std::chrono::duration_cast<std::chrono::microseconds>(stopTime.time_since_epoch()).count()));
+    } else if (cmd == "set") {
+        double value;
+        if (args.size() != 3) {
+            sendLine(client, "ERROR usage: set CONTROL VALUE");
+            return;
+        }
+        try {
+            value = boost::lexical_cast<double>(args[2]);
+        } catch (const boost::bad_lexical_cast &) {
+            sendLine(client, "ERROR invalid value " + args[2]);
+            return;
+        }
+
+        const auto control = boost::algorithm::to_lower_copy(args[1]);
+        if (control == "exposure")
+            m_scope->setExposure(value);
+        else if (control == "gain")
+            m_scope->setGain(value);
+        else if (control == "excitation")
+            m_scope->setExcitation(value);
+        else {
+            sendLine(client, "ERROR unknown control " + args[1]);
+            return;
+        }
+        sendLine(client, boost::str(boost::format("OK set %1% %2%") % control % value));
+    } else if (cmd == "status") {
+        sendLine(client, statusLine());
+    } else if (cmd == "subscribe") {
+        int interval = 1000;
+        if (args.size() > 1) {
+            try {
+                interval = boost::lexical_cast<int>(args[1]);
+            } catch (const boost::bad_lexical_cast &) {
+                interval = 0;
+            }
+            if (interval <= 0) {
+                sendLine(client, "ERROR invalid interval " + args[1]);
+                return;
+            }
+        }
+        client.statsInterval = interval;
+        client.nextStats = steady_hr_clock::now();
+        sendLine(client, boost::str(boost::format("OK subscribe %1%") % interval));
+    } else if (cmd == "unsubscribe") {
+        client.statsInterval = 0;
+        sendLine(client, "OK unsubscribe");
+    } else if (cmd == "shutdown") {
+        m_shutdownRequested = true;
+        sendLine(client, "OK shutdown");
+    } else {
+        sendLine(client, "ERROR unknown command " + args[0]);
+    }
+}
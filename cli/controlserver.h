@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTROLSERVER_H
+#define CONTROLSERVER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "miniscope.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief The ControlServer class
+ *
+ * Lets other programs on the same machine control a running acquisition through
+ * a Unix domain socket, using a line-based text protocol:
+ *
+ *   start [FILENAME]          start recording, acknowledged with the host timestamp
+ *                             the recording starts at
+ *   stop                      stop recording
+ *   set CONTROL VALUE         change exposure, gain or excitation; an event with the
+ *                             number of the first frame using the new value follows
+ *                             once the camera has applied it
+ *   status                    report the current acquisition state once
+ *   subscribe [INTERVAL]      report the acquisition state every INTERVAL
+ *                             milliseconds (default: 1000)
+ *   unsubscribe               stop sending state reports
+ *   shutdown                  end the acquisition run
+ *
+ * Replies start with "OK" or "ERROR", asynchronous messages with "EVENT" or "STATS".
+ */
+class ControlServer
+{
+public:
+    explicit ControlServer(MiniScope *scope);
+    ~ControlServer();
+
+    bool start(const std::string &socketPath);
+    void stop();
+
+    std::string lastError() const;
+    bool shutdownRequested() const;
+
+    void postMessage(const std::string &msg);
+    void postEvent(const std::string &event);
+
+private:
+    struct Client {
+        int fd;
+        std::string inBuffer;
+        std::string outBuffer;  // replies and events the client did not read yet
+        bool closing;           // disconnect the client, it stopped reading
+        int statsInterval;      // milliseconds, 0 if not subscribed
+        steady_hr_clock::time_point nextStats;
+    };
+
+    MiniScope *m_scope;
+    std::string m_socketPath;
+    std::string m_lastError;
+    int m_listenFd;
+    int m_wakeFds[2];
+    std::vector<Client> m_clients;
+
+    std::thread m_thread;
+    std::atomic_bool m_running;
+    std::atomic_bool m_shutdownRequested;
+
+    std::mutex m_eventMutex;
+    std::vector<std::string> m_pendingEvents;
+
+    void serve();
+    void wakeup();
+    void acceptClient();
+    bool readClient(Client &client);
+    bool flushClient(Client &client);
+    void handleCommand(Client &client, const std::string &line);
+    std::string statusLine() const;
+
+    static void sendLine(Client &client, const std::string &line);
+};
+
+#pragma GCC diagnostic pop
+
+#endif // CONTROLSERVER_H
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <csignal>
+#include <boost/format.hpp>
+
+#include "miniscope.h"
+#include "pixelkernels.h"
+#include "stripepool.h"
+#include "cliconfig.h"
+#include "controlserver.h"
+
+enum CliExitStatus {
+    CLI_EXIT_COMPLETE = 0,   /// all frames were recorded
+    CLI_EXIT_ERROR = 1,      /// acquisition could not be started or failed
+    CLI_EXIT_INCOMPLETE = 2  /// recording finished, but frames were dropped or missed
+};
+
+static std::atomic_bool g_stopRequested(false);
+
+static void handleStopSignal(int)
+{
+    g_stopRequested = true;
+}
+
+static void printStatsLine(MiniScope &scope, double elapsed)
+{
+    size_t queueCurrent = 0;
+    size_t queueMax = 0;
+    const auto stats = scope.stats();
+    for (const auto &gauge : stats.gauges) {
+        if (gauge.name == "encode_queue") {
+            queueCurrent = gauge.current;
+            queueMax = gauge.max;
+        }
+    }
+
+    std::cout << boost::format("[%8.1fs] fps %5.2f | recorded %8.1fs | dropped %u | gaps %u (missed %u) | encode queue %u (max %u)")
+                 % elapsed
+                 % scope.measuredFps()
+                 % (scope.lastRecordedFrameTime() / 1000.0)
+                 % scope.droppedFramesCount()
+                 % scope.frameGapsCount()
+                 % scope.missedFramesCount()
+                 % queueCurrent
+                 % queueMax
+              << std::endl;
+}
+
+static void printKernelBenchmark()
+{
+    std::cout << boost::format("%-26s %-10s %12s") % "Kernel" % "ISA" % "Mpixel/s" << "\n";
+    for (const auto &bench : benchmarkPixelKernels()) {
+        std::cout << boost::format("%-26s %-10s %12.1f%s")
+                     % bench.kernel
+                     % bench.isa
+                     % (bench.pixelsPerSecond / 1000000.0)
+                     % (bench.selected? " *" : "")
+                  << "\n";
+    }
+    std::cout << "Selected instruction set: " << selectedPixelKernelIsa() << "\n\n";
+
+    std::cout << boost::format("%-12s %8s %12s %8s") % "Frame size" % "Threads" % "Frames/s" % "Speedup" << "\n";
+    const int sizes[][2] = {{752, 480}, {1280, 1024}, {2048, 2048}};
+    for (const auto &size : sizes) {
+        const auto report = benchmarkStripeScaling(size[0], size[1], 8);
+        for (const auto &bench : report) {
+            std::cout << boost::format("%-12s %8u %12.1f %7.2fx")
+                         % boost::str(boost::format("%1%x%2%") % bench.width % bench.height)
+                         % bench.threads
+                         % bench.framesPerSecond
+                         % (bench.framesPerSecond / report.front().framesPerSecond)
+                      << "\n";
+        }
+    }
+    std::cout << std::flush;
+}
+
+/**
+ * Configure the scope, run it until we are done and report the result.
+ * Returns the exit code of the program.
+ */
+static int runAcquisition(MiniScope &scope, ControlServer &server, const CliConfig &config)
+{
+    // nobody looks at the display frames, so don't spend any time on creating them
+    scope.setDisplayEnabled(false);
+    scope.setStatsEnabled(config.statsInterval > 0);
+
+    scope.setScopeCamId(config.camera);
+    scope.setFps(config.fps);
+    scope.setUseColor(config.color);
+    scope.setVideoCodec(config.codec);
+    scope.setVideoContainer(config.container);
+    scope.setRecordLossless(config.lossless);
+    scope.setRecordingSliceInterval(config.sliceInterval);
+    scope.setRecordingReduction(config.reduction);
+    scope.setProcessingThreads(config.processingThreads);
+    scope.setExternalRecordTrigger(config.externalTrigger);
+    scope.setPreTriggerBufferTime(config.preTriggerTime);
+    scope.setVideoFilename(config.output);
+    if (!config.traceFile.empty())
+        scope.setTraceFile(config.traceFile);
+    scope.setSharedFrameRingName(config.sharedRing);
+
+    if (!scope.connect()) {
+        std::cerr << "Unable to connect to camera: " << scope.lastError() << std::endl;
+        return CLI_EXIT_ERROR;
+    }
+    scope.setExposure(config.exposure);
+    scope.setGain(config.gain);
+    scope.setExcitation(config.excitation);
+
+    if (!scope.run()) {
+        std::cerr << "Unable to start acquisition: " << scope.lastError() << std::endl;
+        scope.disconnect();
+        return CLI_EXIT_ERROR;
+    }
+
+    if (!config.controlSocket.empty()) {
+        if (!server.start(config.controlSocket)) {
+            std::cerr << server.lastError() << std::endl;
+            scope.stop();
+            scope.disconnect();
+            return CLI_EXIT_ERROR;
+        }
+    }
+
+    // with an external trigger or a control socket, recordings are started by someone else
+    if (!config.externalTrigger && config.controlSocket.empty()) {
+        if (!scope.startRecording(config.output)) {
+            std::cerr << "Unable to start recording: " << scope.lastError() << std::endl;
+            scope.disconnect();
+            return CLI_EXIT_ERROR;
+        }
+    }
+
+    const auto startTime = steady_hr_clock::now();
+    auto nextStatsTime = config.statsInterval;
+    bool failed = false;
+    while (!g_stopRequested && !server.shutdownRequested()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(steady_hr_clock::now() - startTime).count();
+        if (!scope.running()) {
+            failed = true;
+            break;
+        }
+        if (config.statsInterval > 0 && elapsed >= nextStatsTime) {
+            printStatsLine(scope, elapsed);
+            nextStatsTime += config.statsInterval;
+        }
+        if (config.duration > 0 && elapsed >= config.duration)
+            break;
+    }
+
+    server.stop();
+    scope.stop();
+    scope.disconnect();
+
+    if (failed) {
+        std::cerr << "Acquisition failed: " << scope.lastError() << std::endl;
+        return CLI_EXIT_ERROR;
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(steady_hr_clock::now() - startTime).count();
+    if (config.statsInterval > 0)
+        printStatsLine(scope, elapsed);
+
+    for (const auto &slice : scope.recordingSlices())
+        std::cout << boost::format("%1%: %2% frames, %3% gaps, %4% missed frames")
+                     % slice.fname % slice.framesCount % slice.gapsCount % slice.missedFramesCount
+                  << std::endl;
+
+    if (scope.droppedFramesCount() > 0 || scope.missedFramesCount() > 0) {
+        std::cerr << boost::format("Recording is incomplete: %1% frames dropped, %2% frames missed by the camera.")
+                     % scope.droppedFramesCount() % scope.missedFramesCount()
+                  << std::endl;
+        return CLI_EXIT_INCOMPLETE;
+    }
+
+    return CLI_EXIT_COMPLETE;
+}
+
+int main(int argc, char *argv[])
+{
+    CliConfig config;
+    std::string error;
+
+    if (!parseCliArguments(argc, argv, &config, &error)) {
+        std::cerr << error << std::endl;
+        std::cerr << "Run '" << argv[0] << " --help' to see a list of available options." << std::endl;
+        return CLI_EXIT_ERROR;
+    }
+    if (config.showHelp) {
+        printCliUsage(argv[0]);
+        return CLI_EXIT_COMPLETE;
+    }
+    if (config.benchmarkKernels) {
+        printKernelBenchmark();
+        return CLI_EXIT_COMPLETE;
+    }
+
+    std::signal(SIGINT, handleStopSignal);
+    std::signal(SIGTERM, handleStopSignal);
+
+    MiniScope scope;
+    ControlServer server(&scope);
+    scope.setOnMessage([&server](const std::string &msg) {
+        std::cerr << msg << std::endl;
+        server.postMessage(msg);
+    });
+
+    const auto ret = runAcquisition(scope, server, config);
+
+    // the server is destroyed before the scope, which still emits messages while it shuts down
+    scope.setOnMessage([](const std::string &msg) {
+        std::cerr << msg << std::endl;
+    });
+    return ret;
+}
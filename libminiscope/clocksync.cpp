@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clocksync.h"
+
+#include <cmath>
+#include <algorithm>
+
+/**
+ * Factor by which the weight of older samples decays with every new one.
+ * This results in the fit covering roughly the last 4000 frames.
+ */
+static const double FORGETTING_FACTOR = 0.99975;
+
+/**
+ * Number of samples we need before rejecting outliers and reporting a mapping.
+ */
+static const uint64_t MIN_SAMPLES = 32;
+
+/**
+ * Samples further off the current fit than this many standard deviations
+ * (but at least OUTLIER_MIN_MSEC) are ignored.
+ */
+static const double OUTLIER_SIGMAS = 4.0;
+static const double OUTLIER_MIN_MSEC = 1.0;
+
+/**
+ * Weight of a new residual in the estimate of the residual variance.
+ */
+static const double RESIDUAL_VAR_ALPHA = 0.01;
+
+/**
+ * Weight of a new value in the smoothed realtime clock offset.
+ */
+static const double REALTIME_OFFSET_ALPHA = 0.05;
+
+double ClockMapping::toMonotonic(double driverTimestamp) const
+{
+    return monotonicRef + (1.0 + drift) * (driverTimestamp - driverRef);
+}
+
+double ClockMapping::toRealtime(double driverTimestamp) const
+{
+    return toMonotonic(driverTimestamp) + realtimeOffset;
+}
+
+ClockSync::ClockSync()
+{
+    reset();
+}
+
+void ClockSync::reset()
+{
+    m_weight = 0;
+    m_meanX = 0;
+    m_meanY = 0;
+    m_covXX = 0;
+    m_covXY = 0;
+    m_residualVar = 0;
+    m_realtimeOffset = 0;
+    m_lastDriverTimestamp = 0;
+    m_samplesCount = 0;
+}
+
+/**
+ * Add a new pair of timestamps, all in milliseconds.
+ * Invalid driver timestamps (the driver reports 0 for some frames) are ignored,
+ * and a driver clock that jumps backwards (e.g. after the camera was reopened)
+ * restarts the estimation.
+ *
+ * @return true if the sample was used for the fit.
+ */
+bool ClockSync::addSample(double driverTimestamp, double monotonicTime, double realtimeTime)
+{
+    if (driverTimestamp <= 0)
+        return false;
+    if (driverTimestamp <= m_lastDriverTimestamp)
+        reset();
+    m_lastDriverTimestamp = driverTimestamp;
+
+    const auto realtimeOffset = realtimeTime - monotonicTime;
+    m_realtimeOffset = (m_samplesCount == 0)?
+                realtimeOffset : REALTIME_OFFSET_ALPHA * realtimeOffset + (1 - REALTIME_OFFSET_ALPHA) * m_realtimeOffset;
+
+    // we regress the monotonic time against the driver time, both relative to the
+    // current weighted means, which keeps the sums small and numerically stable
+    if (m_samplesCount >= MIN_SAMPLES) {
+        const auto residual = monotonicTime - mapping().toMonotonic(driverTimestamp);
+        const auto limit = std::max(OUTLIER_MIN_MSEC, OUTLIER_SIGMAS * std::sqrt(m_residualVar));
+        if (std::abs(residual) > limit)
+            return false;
+        m_residualVar = RESIDUAL_VAR_ALPHA * residual * residual + (1 - RESIDUAL_VAR_ALPHA) * m_residualVar;
+    }
+
+    m_weight = FORGETTING_FACTOR * m_weight + 1.0;
+    const auto dx = driverTimestamp - m_meanX;
+    const auto dy = monotonicTime - m_meanY;
+    m_meanX += dx / m_weight;
+    m_meanY += dy / m_weight;
+    m_covXX = FORGETTING_FACTOR * m_covXX + dx * (driverTimestamp - m_meanX);
+    m_covXY = FORGETTING_FACTOR * m_covXY + dx * (monotonicTime - m_meanY);
+    m_samplesCount++;
+
+    // start with a generous outlier limit, it quickly adapts to the actual jitter
+    if (m_samplesCount == MIN_SAMPLES)
+        m_residualVar = OUTLIER_MIN_MSEC * OUTLIER_MIN_MSEC;
+
+    return true;
+}
+
+ClockMapping ClockSync::mapping() const
+{
+    ClockMapping m;
+    m.valid = (m_samplesCount >= MIN_SAMPLES) && (m_covXX > 0);
+    m.driverRef = m_meanX;
+    m.monotonicRef = m_meanY;
+    m.drift = (m_covXX > 0)? m_covXY / m_covXX - 1.0 : 0.0;
+    m.realtimeOffset = m_realtimeOffset;
+    m.residualRms = std::sqrt(m_residualVar);
+    m.samplesCount = m_samplesCount;
+    return m;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <cstdint>
+
+/**
+ * @brief Mapping of driver timestamps to host clock times.
+ *
+ * A driver timestamp t (in milliseconds) corresponds to the monotonic host time
+ *   monotonicRef + (1 + drift) * (t - driverRef)
+ * and to the realtime (wall clock) host time of that value plus realtimeOffset.
+ * The offset includes the average latency between a frame being timestamped by
+ * the driver and us receiving it.
+ */
+struct ClockMapping
+{
+    bool valid;
+    double driverRef;       // in milliseconds
+    double monotonicRef;    // in milliseconds
+    double drift;           // relative rate difference of the host and driver clocks
+    double realtimeOffset;  // CLOCK_REALTIME minus CLOCK_MONOTONIC, in milliseconds
+    double residualRms;     // in milliseconds
+    uint64_t samplesCount;
+
+    double toMonotonic(double driverTimestamp) const;
+    double toRealtime(double driverTimestamp) const;
+};
+
+/**
+ * @brief The ClockSync class
+ *
+ * Estimates the offset and drift between the driver's frame timestamps and the
+ * host clocks with an exponentially weighted linear regression, which is updated
+ * incrementally with every frame. Samples delayed by scheduling hiccups are
+ * rejected, so the fit follows the lower envelope of the arrival times.
+ */
+class ClockSync
+{
+public:
+    ClockSync();
+
+    void reset();
+    bool addSample(double driverTimestamp, double monotonicTime, double realtimeTime);
+
+    ClockMapping mapping() const;
+
+private:
+    double m_weight;
+    double m_meanX;
+    double m_meanY;
+    double m_covXX;
+    double m_covXY;
+    double m_residualVar;
+    double m_realtimeOffset;
+    double m_lastDriverTimestamp;
+    uint64_t m_samplesCount;
+};
+
+#endif // CLOCKSYNC_H
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "displaykernels.h"
+
+#include <mutex>
+#include <algorithm>
+
+#include "pixelplane.h"
+#include "stripepool.h"
+
+DisplayKernel::DisplayKernel()
+    : rows(nullptr),
+      channels(0),
+      grayscale(false),
+      useAverage(false)
+{
+}
+
+DisplayKernel::operator bool() const
+{
+    return rows != nullptr;
+}
+
+void DisplayKernel::operator()(const cv::Mat &src, cv::Mat &dst,
+                               cv::Mat &average, const cv::Mat &baseline,
+                               const DisplayKernelParams &params, DisplayKernelResult *result,
+                               StripePool *pool) const
+{
+    const auto outChannels = grayscale? 1 : channels;
+
+    dst.create(src.rows, src.cols, CV_8UC(outChannels));
+    if (useAverage && ((average.size() != src.size()) || (average.type() != CV_32FC(outChannels))))
+        average = cv::Mat::zeros(src.rows, src.cols, CV_32FC(outChannels));
+
+    const auto srcPlane = pixelPlane<const uint8_t>(src);
+    const auto dstPlane = pixelPlane<uint8_t>(dst);
+    const auto averagePlane = pixelPlane<float>(average);
+    const auto baselinePlane = pixelPlane<const uint8_t>(baseline);
+
+    std::mutex resultMutex;
+    result->minValue = 255;
+    result->maxValue = 0;
+    runStripes(pool, src.rows, 16, [&](int begin, int end) {
+        DisplayKernelResult stripeResult;
+        rows(planeRows(srcPlane, begin, end), planeRows(dstPlane, begin, end),
+             planeRows(averagePlane, begin, end), planeRows(baselinePlane, begin, end),
+             params, &stripeResult);
+
+        std::lock_guard<std::mutex> lock(resultMutex);
+        result->minValue = std::min(result->minValue, stripeResult.minValue);
+        result->maxValue = std::max(result->maxValue, stripeResult.maxValue);
+    });
+}
+
+static int pixelBgMethod(BackgroundDiffMethod method)
+{
+    switch (method) {
+    case BackgroundDiffMethod::NONE:
+        return PIXEL_BG_NONE;
+    case BackgroundDiffMethod::SUBTRACTION:
+        return PIXEL_BG_SUBTRACTION;
+    case BackgroundDiffMethod::DIVISION:
+        return PIXEL_BG_DIVISION;
+    case BackgroundDiffMethod::PERCENTILE:
+        return PIXEL_BG_PERCENTILE;
+    }
+
+    return -1;
+}
+
+/**
+ * Select the display kernel for frames with the given number of channels (1 or 3),
+ * which is meant to happen once whenever the display settings change.
+ * Returns an invalid kernel for unsupported settings.
+ */
+DisplayKernel selectDisplayKernel(int channels, BackgroundDiffMethod method, bool grayscale)
+{
+    DisplayKernel kernel;
+    const auto bgMethod = pixelBgMethod(method);
+    if ((channels != 1 && channels != 3) || bgMethod < 0)
+        return kernel;
+
+    kernel.rows = pixelKernels().display[channels == 3][bgMethod][grayscale];
+    kernel.channels = channels;
+    kernel.grayscale = grayscale;
+    kernel.useAverage = method != BackgroundDiffMethod::PERCENTILE;
+    return kernel;
+}
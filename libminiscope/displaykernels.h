@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPLAYKERNELS_H
+#define DISPLAYKERNELS_H
+
+#include <opencv2/core.hpp>
+
+#include "miniscope.h"
+#include "pixelkernels.h"
+
+class StripePool;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief A display kernel turns an 8-bit camera frame into the displayed frame in a single pass.
+ *
+ * It updates the moving average background (stored in "average", which is (re)allocated
+ * as needed), applies the background difference (dividing by "baseline" for the percentile
+ * method) and then either masks the color channels or converts the frame to grayscale and
+ * maps it to the display range.
+ * The pixel loop itself comes from the kernels for the instruction set of this CPU,
+ * and runs on stripes of rows in parallel if a pool is given.
+ */
+struct DisplayKernel
+{
+    DisplayRowsKernel rows;
+    int channels;
+    bool grayscale;
+    bool useAverage;
+
+    DisplayKernel();
+
+    explicit operator bool() const;
+    void operator()(const cv::Mat &src, cv::Mat &dst,
+                    cv::Mat &average, const cv::Mat &baseline,
+                    const DisplayKernelParams &params, DisplayKernelResult *result,
+                    StripePool *pool = nullptr) const;
+};
+
+#pragma GCC diagnostic pop
+
+DisplayKernel selectDisplayKernel(int channels, BackgroundDiffMethod method, bool grayscale);
+
+#endif // DISPLAYKERNELS_H
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "encoderpool.h"
+
+#include <boost/format.hpp>
+
+#include "videowriter.h"
+#include "tracerecorder.h"
+
+/**
+ * Create a new pool with the given number of worker threads.
+ * If zero, one thread per CPU core is used.
+ */
+EncoderPool::EncoderPool(uint threadsCount)
+    : m_running(true),
+      m_schedulingGeneration(0),
+      m_schedulingInfo("default"),
+      m_framesEncoded(0),
+      m_pendingFrames(0)
+{
+    if (threadsCount == 0)
+        threadsCount = std::max(1u, std::thread::hardware_concurrency());
+
+    for (uint i = 0; i < threadsCount; i++)
+        m_threads.emplace_back(&EncoderPool::workerThread, this, i);
+}
+
+EncoderPool::~EncoderPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_workCond.notify_all();
+    for (auto &t : m_threads)
+        t.join();
+}
+
+uint EncoderPool::threadsCount() const
+{
+    return static_cast<uint>(m_threads.size());
+}
+
+/**
+ * Total number of frames encoded by this pool.
+ */
+uint64_t EncoderPool::framesEncoded() const
+{
+    return m_framesEncoded;
+}
+
+/**
+ * Number of frames waiting to be encoded, across all writers.
+ */
+size_t EncoderPool::pendingFrames() const
+{
+    return m_pendingFrames;
+}
+
+/**
+ * Notify the pool that a new frame was queued in the given writer.
+ */
+void EncoderPool::schedule(VideoWriter *writer)
+{
+    m_pendingFrames++;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_scheduled.insert(writer).second)
+            return; // already waiting for a worker, or being served right now
+        m_ready.push_back(writer);
+    }
+    m_workCond.notify_one();
+}
+
+/**
+ * Wait until all frames queued in the given writer have been encoded.
+ * The writer must not accept any new frames anymore when this is called.
+ */
+void EncoderPool::drain(VideoWriter *writer)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idleCond.wait(lock, [&] { return (m_scheduled.count(writer) == 0) && !writer->hasQueuedFrames(); });
+}
+
+/**
+ * Set CPU affinity, scheduling policy and I/O priority of all worker threads.
+ * Every worker applies them before encoding its next frame.
+ */
+void EncoderPool::setThreadScheduling(const ThreadSchedulingOptions &options)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_scheduling = options;
+    m_schedulingGeneration++;
+}
+
+/**
+ * Description of the scheduling settings the workers last applied.
+ */
+std::string EncoderPool::threadSchedulingInfo() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_schedulingInfo;
+}
+
+void EncoderPool::workerThread(uint index)
+{
+    TraceRecorder::setThreadName(boost::str(boost::format("encoder %1%") % index));
+    uint schedulingGeneration = 0;
+    while (true) {
+        VideoWriter *writer;
+        ThreadSchedulingOptions scheduling;
+        bool schedulingChanged;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_workCond.wait(lock, [&] { return !m_ready.empty() || !m_running; });
+
+            // we only stop once all pending frames have been encoded
+            if (m_ready.empty())
+                return;
+            writer = m_ready.front();
+            m_ready.pop_front();
+
+            schedulingChanged = schedulingGeneration != m_schedulingGeneration;
+            schedulingGeneration = m_schedulingGeneration;
+            scheduling = m_scheduling;
+        }
+
+        if (schedulingChanged) {
+            const auto info = applyThreadScheduling(scheduling);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_schedulingInfo = info;
+        }
+
+        if (writer->encodeQueuedFrame()) {
+            m_framesEncoded++;
+            m_pendingFrames--;
+        }
+
+        {
+            // checking the queue while holding our lock ensures we do not miss
+            // frames that were queued right after we encoded the last one
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (writer->hasQueuedFrames()) {
+                // go to the back of the line, to let other writers have their turn
+                m_ready.push_back(writer);
+                m_workCond.notify_one();
+            } else {
+                m_scheduled.erase(writer);
+                m_idleCond.notify_all();
+            }
+        }
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENCODERPOOL_H
+#define ENCODERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "threadscheduling.h"
+
+class VideoWriter;
+
+/**
+ * @brief The EncoderPool class
+ *
+ * A fixed set of worker threads encoding the queued frames of any number of
+ * video writers, instead of every writer running its own thread.
+ *
+ * Writers with pending frames are served round-robin, one frame at a time, so a
+ * writer with a large backlog can not starve the others. The frames of a single
+ * writer are always encoded one after another, never concurrently.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+class EncoderPool
+{
+public:
+    explicit EncoderPool(uint threadsCount = 0);
+    ~EncoderPool();
+
+    uint threadsCount() const;
+    uint64_t framesEncoded() const;
+    size_t pendingFrames() const;
+
+    void schedule(VideoWriter *writer);
+    void drain(VideoWriter *writer);
+
+    void setThreadScheduling(const ThreadSchedulingOptions &options);
+    std::string threadSchedulingInfo() const;
+
+private:
+    std::vector<std::thread> m_threads;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_workCond;
+    std::condition_variable m_idleCond;
+    std::deque<VideoWriter*> m_ready;
+    std::set<VideoWriter*> m_scheduled; // writers that are waiting or being served
+    bool m_running;
+
+    ThreadSchedulingOptions m_scheduling;
+    uint m_schedulingGeneration; // incremented whenever the options change
+    std::string m_schedulingInfo;
+
+    std::atomic<uint64_t> m_framesEncoded;
+    std::atomic<size_t> m_pendingFrames;
+
+    void workerThread(uint index);
+};
+#pragma GCC diagnostic pop
+
+#endif // ENCODERPOOL_H
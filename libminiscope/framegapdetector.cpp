@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framegapdetector.h"
+
+#include <cmath>
+#include <algorithm>
+
+/**
+ * Weight of a new interval in the running estimate of the frame period.
+ */
+static const double INTERVAL_ESTIMATE_ALPHA = 0.05;
+
+/**
+ * Largest ratio between consecutive long intervals for them to be taken
+ * as a new, slower frame period rather than lost frames.
+ */
+static const double NEW_PERIOD_MAX_SPREAD = 1.2;
+
+FrameGapDetector::FrameGapDetector()
+    : m_expectedInterval(0),
+      m_threshold(1.5)
+{
+    reset();
+}
+
+void FrameGapDetector::reset()
+{
+    m_estimatedInterval = 0;
+    m_lastDriverTimestamp = 0;
+    m_lastHostTimestamp = 0;
+    m_haveLast = false;
+    m_gapCount = 0;
+    m_missedFrames = 0;
+    m_longCount = 0;
+    m_longMissedFrames = 0;
+}
+
+/**
+ * Set the nominal interval between two frames in milliseconds.
+ * It is only used until we have an estimate of the actual interval from
+ * the frames seen so far, as cameras rarely run at exactly the requested rate.
+ * A changed interval discards that estimate.
+ */
+void FrameGapDetector::setExpectedInterval(double msec)
+{
+    if (msec == m_expectedInterval)
+        return;
+    m_expectedInterval = msec;
+    m_estimatedInterval = 0;
+    m_longCount = 0;
+    m_longMissedFrames = 0;
+}
+
+/**
+ * Set how many times longer than the expected one an interval must be to be
+ * considered a gap.
+ */
+void FrameGapDetector::setThreshold(double factor)
+{
+    if (factor < 1)
+        factor = 1;
+    m_threshold = factor;
+}
+
+/**
+ * Check a new frame for a gap before it.
+ * The driver timestamp is preferred, the host timestamp is only used if the driver
+ * did not provide a usable one. Both are in milliseconds.
+ *
+ * @return The estimated number of frames that were lost right before this one.
+ */
+unsigned int FrameGapDetector::check(double driverTimestamp, double hostTimestamp)
+{
+    double interval = -1;
+    if (m_haveLast) {
+        if ((m_lastDriverTimestamp > 0) && (driverTimestamp > m_lastDriverTimestamp))
+            interval = driverTimestamp - m_lastDriverTimestamp;
+        else
+            interval = hostTimestamp - m_lastHostTimestamp;
+    }
+    m_lastDriverTimestamp = driverTimestamp;
+    m_lastHostTimestamp = hostTimestamp;
+    m_haveLast = true;
+
+    if (interval <= 0)
+        return 0;
+
+    const auto expected = (m_estimatedInterval > 0)? m_estimatedInterval : m_expectedInterval;
+    if ((expected > 0) && (interval > expected * m_threshold)) {
+        m_longIntervals[m_longCount++] = interval;
+        if (m_longCount == m_longIntervals.size()) {
+            const auto range = std::minmax_element(m_longIntervals.begin(), m_longIntervals.end());
+            if (*range.second <= *range.first * NEW_PERIOD_MAX_SPREAD) {
+                // the camera runs slower now, so none of these were gaps
+                std::nth_element(m_longIntervals.begin(), m_longIntervals.begin() + m_longIntervals.size() / 2, m_longIntervals.end());
+                m_estimatedInterval = m_longIntervals[m_longIntervals.size() / 2];
+                m_gapCount -= m_longCount - 1;
+                m_missedFrames -= m_longMissedFrames;
+                m_longCount = 0;
+                m_longMissedFrames = 0;
+                return 0;
+            }
+            m_longCount = 0;
+            m_longMissedFrames = 0;
+        }
+
+        const auto missed = static_cast<unsigned int>(std::max(1.0, std::round(interval / expected) - 1));
+        m_gapCount++;
+        m_missedFrames += missed;
+        if (m_longCount > 0)
+            m_longMissedFrames += missed;
+        return missed;
+    }
+    m_longCount = 0;
+    m_longMissedFrames = 0;
+
+    // only regular intervals contribute to our estimate of the frame period
+    m_estimatedInterval = (m_estimatedInterval <= 0)?
+                interval : INTERVAL_ESTIMATE_ALPHA * interval + (1 - INTERVAL_ESTIMATE_ALPHA) * m_estimatedInterval;
+    return 0;
+}
+
+size_t FrameGapDetector::gapCount() const
+{
+    return m_gapCount;
+}
+
+size_t FrameGapDetector::missedFramesCount() const
+{
+    return m_missedFrames;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMEGAPDETECTOR_H
+#define FRAMEGAPDETECTOR_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief The FrameGapDetector class
+ *
+ * Detects frames that were lost silently (e.g. by the driver or USB stack)
+ * by looking for intervals between frame timestamps that are a lot longer
+ * than the expected frame period.
+ *
+ * If the camera slows down for good, the long intervals are all about the same,
+ * unlike those of lost frames. After a few of them in a row, their median is
+ * accepted as the new frame period, and the gaps counted for them are taken back.
+ * The frames they were reported for can not be changed anymore though.
+ */
+class FrameGapDetector
+{
+public:
+    FrameGapDetector();
+
+    void reset();
+
+    void setExpectedInterval(double msec);
+    void setThreshold(double factor);
+
+    unsigned int check(double driverTimestamp, double hostTimestamp);
+
+    size_t gapCount() const;
+    size_t missedFramesCount() const;
+
+private:
+    double m_expectedInterval;
+    double m_estimatedInterval;
+    double m_threshold;
+    double m_lastDriverTimestamp;
+    double m_lastHostTimestamp;
+    bool m_haveLast;
+    size_t m_gapCount;
+    size_t m_missedFrames;
+
+    std::array<double, 8> m_longIntervals; // consecutive intervals flagged as gaps
+    size_t m_longCount;
+    size_t m_longMissedFrames;             // frames reported missed for them
+};
+
+#endif // FRAMEGAPDETECTOR_H
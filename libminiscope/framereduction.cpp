@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framereduction.h"
+
+#include <vector>
+#include <cstdint>
+#include <opencv2/imgproc.hpp>
+
+#include "pixelplane.h"
+#include "stripepool.h"
+
+FrameReduction::FrameReduction()
+    : binning(1),
+      temporalBinning(1),
+      binningMode(BinningMode::Mean),
+      deepPixels(false)
+{
+}
+
+bool FrameReduction::isIdentity() const
+{
+    return crop.empty() && (binning <= 1) && (temporalBinning <= 1) && !deepPixels;
+}
+
+bool FrameReduction::isSpatialIdentity() const
+{
+    return crop.empty() && (binning <= 1) && !deepPixels;
+}
+
+bool FrameReduction::operator==(const FrameReduction &other) const
+{
+    return (crop == other.crop) &&
+           (binning == other.binning) &&
+           (temporalBinning == other.temporalBinning) &&
+           (binningMode == other.binningMode) &&
+           (deepPixels == other.deepPixels);
+}
+
+bool FrameReduction::operator!=(const FrameReduction &other) const
+{
+    return !(*this == other);
+}
+
+static int binningFactor(const FrameReduction &reduction)
+{
+    return (reduction.binning >= 4)? 4 : (reduction.binning >= 2)? 2 : 1;
+}
+
+/**
+ * The region of a frame of the given size that is actually used, which is
+ * always a multiple of the binning factor.
+ */
+static cv::Rect effectiveCrop(const FrameReduction &reduction, const cv::Size &frameSize)
+{
+    const cv::Rect frameRect(0, 0, frameSize.width, frameSize.height);
+    auto rect = reduction.crop.empty()? frameRect : (reduction.crop & frameRect);
+
+    const auto factor = binningFactor(reduction);
+    rect.width -= rect.width % factor;
+    rect.height -= rect.height % factor;
+    return rect;
+}
+
+cv::Size reducedFrameSize(const FrameReduction &reduction, const cv::Size &frameSize)
+{
+    const auto rect = effectiveCrop(reduction, frameSize);
+    const auto factor = binningFactor(reduction);
+    return cv::Size(rect.width / factor, rect.height / factor);
+}
+
+/**
+ * Crop and bin a frame. Frames with 16-bit output are converted to grayscale.
+ * In mean mode, 8-bit values are scaled to the full 16-bit range, so the
+ * fraction of the mean is kept as well.
+ */
+bool reduceFrame(const cv::Mat &src, cv::Mat &dst, const FrameReduction &reduction, StripePool *pool)
+{
+    if (src.empty() || (src.depth() != CV_8U && src.depth() != CV_16U))
+        return false;
+
+    const auto rect = effectiveCrop(reduction, src.size());
+    if (rect.empty())
+        return false;
+
+    cv::Mat input = src(rect);
+    if (reduction.deepPixels && input.channels() == 3) {
+        cv::Mat gray;
+        cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+        input = gray;
+    }
+
+    const auto factor = binningFactor(reduction);
+    const auto depth = reduction.deepPixels? CV_16U : input.depth();
+    const auto mean = reduction.binningMode == BinningMode::Mean;
+    const auto size = reducedFrameSize(reduction, src.size());
+
+    // 8-bit values are scaled up for 16-bit means, to keep their fraction
+    const uint32_t scale = (mean && input.depth() == CV_8U && depth == CV_16U)? 256 : 1;
+    const uint32_t maxValue = (depth == CV_16U)? 65535 : 255;
+
+    if (factor == 1) {
+        if (input.depth() == depth && scale == 1)
+            input.copyTo(dst);
+        else
+            input.convertTo(dst, CV_MAKETYPE(depth, input.channels()), scale);
+        return true;
+    }
+
+    dst.create(size, CV_MAKETYPE(depth, input.channels()));
+    const auto &kernels = pixelKernels();
+    const auto channels = input.channels();
+    const auto rowLength = static_cast<size_t>(input.cols * channels);
+    const auto srcDepth = input.depth();
+    runStripes(pool, dst.rows, 8, [&](int begin, int end) {
+        // every stripe sums up its rows on its own
+        std::vector<uint32_t> rowSum(rowLength);
+        const auto srcBegin = begin * factor;
+        const auto srcEnd = end * factor;
+        if (srcDepth == CV_8U) {
+            if (depth == CV_8U)
+                kernels.bin8u8u(planeRows(pixelPlane<const uint8_t>(input), srcBegin, srcEnd),
+                                planeRows(pixelPlane<uint8_t>(dst), begin, end),
+                                channels, factor, mean, scale, maxValue, rowSum.data());
+            else
+                kernels.bin8u16u(planeRows(pixelPlane<const uint8_t>(input), srcBegin, srcEnd),
+                                 planeRows(pixelPlane<uint16_t>(dst), begin, end),
+                                 channels, factor, mean, scale, maxValue, rowSum.data());
+        } else {
+            // sums of 16-bit pixels can not overflow, as at most 16 of them are added
+            kernels.bin16u16u(planeRows(pixelPlane<const uint16_t>(input), srcBegin, srcEnd),
+                              planeRows(pixelPlane<uint16_t>(dst), begin, end),
+                              channels, factor, mean, scale, maxValue, rowSum.data());
+        }
+    });
+
+    return true;
+}
+
+TemporalBinner::TemporalBinner()
+    : m_frames(1),
+      m_count(0),
+      m_mode(BinningMode::Mean),
+      m_timestampSum(0),
+      m_hostTimestampSum(0)
+{
+    m_meta = FrameMetadata();
+}
+
+/**
+ * Start over, combining the given number of frames from now on.
+ */
+void TemporalBinner::reset(uint frames, BinningMode mode)
+{
+    m_frames = (frames < 1)? 1 : frames;
+    m_mode = mode;
+    m_count = 0;
+    m_accumulator = cv::Mat();
+}
+
+/**
+ * Add a frame, and return true if it completed a binned frame.
+ * Frames of a different size or type than the previous ones start a new bin.
+ */
+bool TemporalBinner::add(const cv::Mat &frame, const FrameMetadata &meta, StripePool *pool)
+{
+    if (frame.depth() != CV_8U && frame.depth() != CV_16U)
+        return false;
+
+    if (m_frames == 1) {
+        m_result = frame;
+        m_meta = meta;
+        return true;
+    }
+
+    const auto accType = CV_32SC(frame.channels());
+    if ((m_count > 0) && ((frame.size() != m_accumulator.size()) || (accType != m_accumulator.type())))
+        m_count = 0;
+    if (m_count == 0) {
+        m_accumulator = cv::Mat::zeros(frame.rows, frame.cols, accType);
+        m_meta = meta;
+        m_meta.missedFrames = 0;
+        m_meta.flags = 0;
+        m_timestampSum = 0;
+        m_hostTimestampSum = 0;
+    }
+
+    const auto &kernels = pixelKernels();
+    const auto accPlane = pixelPlane<uint32_t>(m_accumulator);
+    runStripes(pool, frame.rows, 16, [&](int begin, int end) {
+        if (frame.depth() == CV_8U)
+            kernels.accumulate8u(planeRows(pixelPlane<const uint8_t>(frame), begin, end), planeRows(accPlane, begin, end));
+        else
+            kernels.accumulate16u(planeRows(pixelPlane<const uint16_t>(frame), begin, end), planeRows(accPlane, begin, end));
+    });
+    m_timestampSum += meta.timestamp;
+    m_hostTimestampSum += meta.hostTimestamp;
+    m_meta.missedFrames += meta.missedFrames;
+    m_meta.flags |= meta.flags;
+    m_count++;
+
+    if (m_count < m_frames)
+        return false;
+
+    // binned frames are queued for encoding, so every one gets its own buffer
+    const uint32_t divisor = (m_mode == BinningMode::Mean)? m_frames : 1;
+    m_result = cv::Mat(frame.size(), frame.type());
+    const auto sums = pixelPlane<const uint32_t>(m_accumulator);
+    runStripes(pool, frame.rows, 16, [&](int begin, int end) {
+        if (frame.depth() == CV_8U)
+            kernels.store8u(planeRows(sums, begin, end), planeRows(pixelPlane<uint8_t>(m_result), begin, end), divisor, 255);
+        else
+            kernels.store16u(planeRows(sums, begin, end), planeRows(pixelPlane<uint16_t>(m_result), begin, end), divisor, 65535);
+    });
+
+    m_meta.timestamp = m_timestampSum / m_count;
+    m_meta.hostTimestamp = m_hostTimestampSum / m_count;
+    m_count = 0;
+    return true;
+}
+
+/**
+ * The last completed binned frame.
+ */
+cv::Mat TemporalBinner::frame() const
+{
+    return m_result;
+}
+
+/**
+ * Metadata of the last completed binned frame, with the mean timestamps
+ * and the sequence number of the first of its frames.
+ */
+FrameMetadata TemporalBinner::metadata() const
+{
+    return m_meta;
+}
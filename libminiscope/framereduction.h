@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMEREDUCTION_H
+#define FRAMEREDUCTION_H
+
+#include <opencv2/core.hpp>
+
+#include "mstypes.h"
+
+class StripePool;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief The TemporalBinner class
+ *
+ * Sums or averages a fixed number of consecutive frames in an accumulator of
+ * 32-bit integers. The result has the type of the input frames, so sums of
+ * 8-bit frames should be made deep first to not saturate.
+ * The metadata of a binned frame has the mean timestamps of its frames.
+ */
+class TemporalBinner
+{
+public:
+    TemporalBinner();
+
+    void reset(uint frames, BinningMode mode);
+    bool add(const cv::Mat &frame, const FrameMetadata &meta, StripePool *pool = nullptr);
+
+    cv::Mat frame() const;
+    FrameMetadata metadata() const;
+
+private:
+    uint m_frames;
+    uint m_count;
+    BinningMode m_mode;
+
+    cv::Mat m_accumulator;
+    cv::Mat m_result;
+    FrameMetadata m_meta;
+    double m_timestampSum;
+    double m_hostTimestampSum;
+};
+
+#pragma GCC diagnostic pop
+
+cv::Size reducedFrameSize(const FrameReduction &reduction, const cv::Size &frameSize);
+bool reduceFrame(const cv::Mat &src, cv::Mat &dst, const FrameReduction &reduction, StripePool *pool = nullptr);
+
+#endif // FRAMEREDUCTION_H
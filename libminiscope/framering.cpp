@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framering.h"
+
+#include <cstring>
+#include <thread>
+#include <boost/format.hpp>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// slots start at cache line boundaries
+static const size_t SLOT_ALIGNMENT = 64;
+
+static std::string shmObjectName(const std::string &name)
+{
+    if (!name.empty() && name[0] == '/')
+        return name;
+    return "/" + name;
+}
+
+static uint8_t *slotAt(const FrameRingHeader *header, uint64_t index)
+{
+    const auto base = reinterpret_cast<uint8_t*>(const_cast<FrameRingHeader*>(header));
+    return base + header->headerSize + (index % header->slotCount) * header->slotSize;
+}
+
+FrameRingWriter::FrameRingWriter(const std::string &name, uint slotCount)
+    : m_name(shmObjectName(name)),
+      m_slotCount((slotCount < 2)? 2 : slotCount),
+      m_fd(-1),
+      m_mem(nullptr),
+      m_memSize(0),
+      m_header(nullptr),
+      m_framesCount(0)
+{
+}
+
+FrameRingWriter::~FrameRingWriter()
+{
+    close();
+}
+
+std::string FrameRingWriter::name() const
+{
+    return m_name;
+}
+
+uint64_t FrameRingWriter::framesCount() const
+{
+    return m_framesCount;
+}
+
+std::string FrameRingWriter::lastError() const
+{
+    return m_lastError;
+}
+
+FrameRingReader::FrameRingReader()
+    : m_fd(-1),
+      m_mem(nullptr),
+      m_memSize(0),
+      m_header(nullptr)
+{
+}
+
+FrameRingReader::~FrameRingReader()
+{
+    close();
+}
+
+bool FrameRingReader::isOpen() const
+{
+    return m_header != nullptr;
+}
+
+std::string FrameRingReader::lastError() const
+{
+    return m_lastError;
+}
+
+uint64_t FrameRingReader::writeCount() const
+{
+    if (m_header == nullptr)
+        return 0;
+    return m_header->writeCount.load(std::memory_order_acquire);
+}
+
+bool FrameRingReader::view(uint64_t index, FrameRingView *view) const
+{
+    if (m_header == nullptr || m_header->magic != FRAME_RING_MAGIC)
+        return false;
+
+    // the frame has not been published yet, or was already overwritten
+    const auto count = m_header->writeCount.load(std::memory_order_acquire);
+    if (index >= count || index + m_header->slotCount < count)
+        return false;
+
+    auto slotMem = slotAt(m_header, index);
+    const auto slot = reinterpret_cast<const FrameRingSlot*>(slotMem);
+    const auto seq = slot->seqlock.load(std::memory_order_acquire);
+    if ((seq & 1) || slot->index != index)
+        return false;
+
+    view->index = index;
+    view->seqlock = seq;
+    view->meta.sequence = slot->sequence;
+    view->meta.timestamp = slot->timestamp;
+    view->meta.hostTimestamp = slot->hostTimestamp;
+    view->meta.missedFrames = slot->missedFrames;
+    view->meta.flags = slot->flags;
+    if (slot->dataSize > m_header->dataCapacity)
+        return false;
+    view->image = cv::Mat(static_cast<int>(slot->height),
+                          static_cast<int>(slot->width),
+                          slot->type,
+                          slotMem + FRAME_RING_SLOT_HEADER_SIZE,
+                          slot->step);
+
+    return validate(*view);
+}
+
+bool FrameRingReader::validate(const FrameRingView &view) const
+{
+    if (m_header == nullptr)
+        return false;
+    const auto slot = reinterpret_cast<const FrameRingSlot*>(slotAt(m_header, view.index));
+
+    // make sure all reads of the slot happen before we check the sequence again
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot->seqlock.load(std::memory_order_relaxed) == view.seqlock;
+}
+
+bool FrameRingReader::readLatest(cv::Mat *frame, FrameMetadata *meta) const
+{
+    // a fast writer may overwrite the latest slot while we copy it, then we just
+    // try again with the frame that replaced it
+    for (uint attempt = 0; attempt < 4; attempt++) {
+        const auto count = writeCount();
+        if (count == 0)
+            return false;
+
+        FrameRingView v;
+        if (!view(count - 1, &v))
+            continue;
+        const auto copy = v.image.clone();
+        if (!validate(v))
+            continue;
+
+        *frame = copy;
+        if (meta != nullptr)
+            *meta = v.meta;
+        return true;
+    }
+
+    return false;
+}
+
+#ifdef _WIN32
+
+bool FrameRingWriter::create(size_t)
+{
+    m_lastError = "Shared-memory frame rings are not supported on this platform.";
+    return false;
+}
+
+bool FrameRingWriter::publish(const cv::Mat &, const FrameMetadata &)
+{
+    return create(0);
+}
+
+void FrameRingWriter::close()
+{
+}
+
+bool FrameRingReader::open(const std::string &)
+{
+    m_lastError = "Shared-memory frame rings are not supported on this platform.";
+    return false;
+}
+
+void FrameRingReader::close()
+{
+}
+
+bool FrameRingReader::waitForFrame(uint64_t, int)
+{
+    return false;
+}
+
+#else
+
+bool FrameRingWriter::create(size_t dataCapacity)
+{
+    close();
+
+    const auto slotSize = (FRAME_RING_SLOT_HEADER_SIZE + dataCapacity + SLOT_ALIGNMENT - 1) / SLOT_ALIGNMENT * SLOT_ALIGNMENT;
+    const auto memSize = FRAME_RING_HEADER_SIZE + slotSize * m_slotCount;
+
+    // remove stale rings of a crashed process, readers still mapping it are unaffected
+    shm_unlink(m_name.c_str());
+    m_fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (m_fd < 0) {
+        m_lastError = boost::str(boost::format("Unable to create shared memory '%1%': %2%") % m_name % strerror(errno));
+        return false;
+    }
+    if (ftruncate(m_fd, static_cast<off_t>(memSize)) != 0) {
+        m_lastError = boost::str(boost::format("Unable to resize shared memory '%1%': %2%") % m_name % strerror(errno));
+        close();
+        return false;
+    }
+
+    m_mem = mmap(nullptr, memSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (m_mem == MAP_FAILED) {
+        m_mem = nullptr;
+        m_lastError = boost::str(boost::format("Unable to map shared memory '%1%': %2%") % m_name % strerror(errno));
+        close();
+        return false;
+    }
+    m_memSize = memSize;
+
+    // the memory is zero-filled, so all slots start out unlocked
+    m_header = static_cast<FrameRingHeader*>(m_mem);
+    m_header->version = FRAME_RING_VERSION;
+    m_header->headerSize = FRAME_RING_HEADER_SIZE;
+    m_header->slotCount = m_slotCount;
+    m_header->slotSize = slotSize;
+    m_header->dataCapacity = dataCapacity;
+    m_header->writeCount.store(0, std::memory_order_relaxed);
+    m_header->notify.store(0, std::memory_order_relaxed);
+
+    // readers only trust a header with a valid magic value
+    std::atomic_thread_fence(std::memory_order_release);
+    m_header->magic = FRAME_RING_MAGIC;
+    m_framesCount = 0;
+
+    return true;
+}
+
+bool FrameRingWriter::publish(const cv::Mat &frame, const FrameMetadata &meta)
+{
+    const auto rowSize = static_cast<size_t>(frame.cols) * frame.elemSize();
+    const auto dataSize = rowSize * static_cast<size_t>(frame.rows);
+    if (m_header == nullptr || dataSize > m_header->dataCapacity) {
+        if (!create(dataSize))
+            return false;
+    }
+
+    auto slotMem = slotAt(m_header, m_framesCount);
+    auto slot = reinterpret_cast<FrameRingSlot*>(slotMem);
+
+    const auto seq = slot->seqlock.load(std::memory_order_relaxed);
+    slot->seqlock.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->index = m_framesCount;
+    slot->sequence = meta.sequence;
+    slot->timestamp = meta.timestamp;
+    slot->hostTimestamp = meta.hostTimestamp;
+    slot->missedFrames = meta.missedFrames;
+    slot->flags = meta.flags;
+    slot->width = static_cast<uint32_t>(frame.cols);
+    slot->height = static_cast<uint32_t>(frame.rows);
+    slot->type = frame.type();
+    slot->step = static_cast<uint32_t>(rowSize);
+    slot->dataSize = dataSize;
+
+    auto data = slotMem + FRAME_RING_SLOT_HEADER_SIZE;
+    if (frame.isContinuous()) {
+        memcpy(data, frame.data, dataSize);
+    } else {
+        for (int i = 0; i < frame.rows; i++)
+            memcpy(data + static_cast<size_t>(i) * rowSize, frame.ptr(i), rowSize);
+    }
+
+    slot->seqlock.store(seq + 2, std::memory_order_release);
+    m_framesCount++;
+    m_header->writeCount.store(m_framesCount, std::memory_order_release);
+    m_header->notify.fetch_add(1, std::memory_order_release);
+
+#ifdef __linux__
+    syscall(SYS_futex, &m_header->notify, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+
+    return true;
+}
+
+void FrameRingWriter::close()
+{
+    if (m_mem != nullptr) {
+        // tell readers which still have the ring mapped that it is gone
+        m_header->magic = 0;
+        m_header->notify.fetch_add(1, std::memory_order_release);
+#ifdef __linux__
+        syscall(SYS_futex, &m_header->notify, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+        munmap(m_mem, m_memSize);
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        shm_unlink(m_name.c_str());
+    }
+
+    m_mem = nullptr;
+    m_memSize = 0;
+    m_header = nullptr;
+    m_fd = -1;
+}
+
+bool FrameRingReader::open(const std::string &name)
+{
+    close();
+
+    const auto shmName = shmObjectName(name);
+    m_fd = shm_open(shmName.c_str(), O_RDONLY, 0);
+    if (m_fd < 0) {
+        m_lastError = boost::str(boost::format("Unable to open shared memory '%1%': %2%") % shmName % strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(m_fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(FrameRingHeader)) {
+        m_lastError = boost::str(boost::format("Shared memory '%1%' is not a frame ring.") % shmName);
+        close();
+        return false;
+    }
+
+    m_mem = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, m_fd, 0);
+    if (m_mem == MAP_FAILED) {
+        m_mem = nullptr;
+        m_lastError = boost::str(boost::format("Unable to map shared memory '%1%': %2%") % shmName % strerror(errno));
+        close();
+        return false;
+    }
+    m_memSize = static_cast<size_t>(st.st_size);
+
+    const auto header = static_cast<const FrameRingHeader*>(m_mem);
+    if (header->magic != FRAME_RING_MAGIC || header->version != FRAME_RING_VERSION
+            || header->slotCount == 0
+            || header->headerSize + header->slotCount * header->slotSize > m_memSize) {
+        m_lastError = boost::str(boost::format("Shared memory '%1%' is not a frame ring of a supported version.") % shmName);
+        close();
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    m_header = header;
+
+    return true;
+}
+
+void FrameRingReader::close()
+{
+    if (m_mem != nullptr)
+        munmap(m_mem, m_memSize);
+    if (m_fd >= 0)
+        ::close(m_fd);
+
+    m_mem = nullptr;
+    m_memSize = 0;
+    m_header = nullptr;
+    m_fd = -1;
+}
+
+bool FrameRingReader::waitForFrame(uint64_t writeCount, int timeoutMsec)
+{
+    if (m_header == nullptr)
+        return false;
+
+    const auto deadline = steady_hr_clock::now() + std::chrono::milliseconds(timeoutMsec);
+    while (true) {
+        const auto notify = m_header->notify.load(std::memory_order_acquire);
+        if (m_header->writeCount.load(std::memory_order_acquire) > writeCount)
+            return true;
+        // the writer has replaced or closed the ring
+        if (m_header->magic != FRAME_RING_MAGIC)
+            return false;
+
+        const auto remaining = deadline - steady_hr_clock::now();
+        if (remaining <= std::chrono::nanoseconds(0))
+            return false;
+
+#ifdef __linux__
+        const auto remainingNs = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+        struct timespec timeout;
+        timeout.tv_sec = static_cast<time_t>(remainingNs / 1000000000);
+        timeout.tv_nsec = static_cast<long>(remainingNs % 1000000000);
+        syscall(SYS_futex, &m_header->notify, FUTEX_WAIT, notify, &timeout, nullptr, 0);
+#else
+        (void) notify;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+    }
+}
+
+#endif
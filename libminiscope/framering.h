@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+#include "miniscope.h"
+
+/**
+ * Layout of a shared-memory frame ring
+ *
+ * The ring starts with a FrameRingHeader, followed by slotCount slots of slotSize bytes
+ * each, starting at headerSize. Every slot begins with a FrameRingSlot, the image data
+ * follows at FRAME_RING_SLOT_HEADER_SIZE bytes into the slot, with rows of step bytes.
+ * All values are stored in the byte order of the host.
+ *
+ * Frame n (counting from zero) is stored in slot n % slotCount. Each slot is guarded by a
+ * sequence lock: its seqlock value is odd while the slot is written to. A reader remembers
+ * the (even) seqlock value, reads the slot and then checks that the value is unchanged;
+ * otherwise the writer has overwritten the slot in the meantime and the data must be
+ * discarded. The writer never waits for readers.
+ *
+ * After a frame was published, writeCount is set to the number of frames published so far,
+ * the notify word is incremented and, on Linux, readers waiting on it with FUTEX_WAIT are
+ * woken up.
+ */
+
+#define FRAME_RING_MAGIC 0x5246534d   // "MSFR"
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_HEADER_SIZE 64
+#define FRAME_RING_SLOT_HEADER_SIZE 128
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared frame rings need lock-free 64-bit atomics");
+
+struct FrameRingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t slotCount;
+    uint64_t slotSize;
+    uint64_t dataCapacity;              // maximum image size of a slot, in bytes
+    std::atomic<uint64_t> writeCount;   // number of frames published so far
+    std::atomic<uint32_t> notify;       // futex word, incremented after every frame
+    uint32_t reserved[5];
+};
+
+struct FrameRingSlot
+{
+    std::atomic<uint64_t> seqlock;  // odd while the slot is being written
+    uint64_t index;                 // number of the frame in this ring
+    uint64_t sequence;              // frame number since the acquisition was started
+    double timestamp;               // driver timestamp, msec
+    double hostTimestamp;           // steady clock timestamp, msec
+    uint32_t missedFrames;
+    uint32_t flags;                 // FrameFlag values
+    uint32_t width;
+    uint32_t height;
+    int32_t type;                   // OpenCV type of the image, e.g. CV_8UC1
+    uint32_t step;                  // bytes per image row
+    uint64_t dataSize;
+    uint64_t reserved[6];
+};
+
+static_assert(sizeof(FrameRingHeader) == FRAME_RING_HEADER_SIZE, "Unexpected frame ring header size");
+static_assert(sizeof(FrameRingSlot) <= FRAME_RING_SLOT_HEADER_SIZE, "Unexpected frame ring slot header size");
+
+/**
+ * @brief A frame of a shared-memory ring, referenced without copying.
+ *
+ * The image points directly into the shared memory, so its contents are only
+ * guaranteed to be consistent if FrameRingReader::validate() succeeds after
+ * they were used.
+ */
+struct FrameRingView
+{
+    uint64_t index;
+    uint64_t seqlock;
+    FrameMetadata meta;
+    cv::Mat image;
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief The FrameRingWriter class
+ *
+ * Publishes frames into a named POSIX shared-memory ring. The ring is created
+ * with the first frame, and created again if the size of the frames grows.
+ */
+class FrameRingWriter
+{
+public:
+    explicit FrameRingWriter(const std::string &name, uint slotCount = 8);
+    ~FrameRingWriter();
+
+    bool publish(const cv::Mat &frame, const FrameMetadata &meta);
+    void close();
+
+    std::string name() const;
+    uint64_t framesCount() const;
+    std::string lastError() const;
+
+private:
+    std::string m_name;
+    uint m_slotCount;
+    std::string m_lastError;
+    int m_fd;
+    void *m_mem;
+    size_t m_memSize;
+    FrameRingHeader *m_header;
+    uint64_t m_framesCount;
+
+    bool create(size_t dataCapacity);
+};
+
+/**
+ * @brief The FrameRingReader class
+ *
+ * Maps a frame ring published by a MiniScope of another process (or of this one)
+ * read-only, to access its frames without copying them.
+ */
+class MS_LIB_EXPORT FrameRingReader
+{
+public:
+    FrameRingReader();
+    ~FrameRingReader();
+
+    bool open(const std::string &name);
+    void close();
+    bool isOpen() const;
+
+    uint64_t writeCount() const;
+    bool waitForFrame(uint64_t writeCount, int timeoutMsec);
+
+    bool view(uint64_t index, FrameRingView *view) const;
+    bool validate(const FrameRingView &view) const;
+    bool readLatest(cv::Mat *frame, FrameMetadata *meta) const;
+
+    std::string lastError() const;
+
+private:
+    std::string m_lastError;
+    int m_fd;
+    void *m_mem;
+    size_t m_memSize;
+    const FrameRingHeader *m_header;
+};
+
+#pragma GCC diagnostic pop
+
+#endif // FRAMERING_H
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "framesource.h"
+
+#include <thread>
+#include <cmath>
+#include <opencv2/imgproc.hpp>
+
+FrameSource::~FrameSource()
+{
+}
+
+CameraFrameSource::CameraFrameSource()
+{
+}
+
+bool CameraFrameSource::open(int id)
+{
+    return m_cam.open(id);
+}
+
+void CameraFrameSource::release()
+{
+    m_cam.release();
+}
+
+bool CameraFrameSource::isOpened() const
+{
+    return m_cam.isOpened();
+}
+
+bool CameraFrameSource::grab()
+{
+    return m_cam.grab();
+}
+
+bool CameraFrameSource::retrieve(cv::Mat &frame)
+{
+    return m_cam.retrieve(frame);
+}
+
+double CameraFrameSource::get(int propId) const
+{
+    return m_cam.get(propId);
+}
+
+bool CameraFrameSource::set(int propId, double value)
+{
+    return m_cam.set(propId, value);
+}
+
+SyntheticFrameSource::SyntheticFrameSource(int width, int height, double fps)
+    : m_width(width),
+      m_height(height),
+      m_fps(fps > 0? fps : 20),
+      m_dropProbability(0),
+      m_opened(false),
+      m_frameNo(0),
+      m_timestamp(0),
+      m_brightness(100),
+      m_gain(32)
+{
+}
+
+/**
+ * Set the probability of a frame being lost silently.
+ */
+void SyntheticFrameSource::setDropProbability(double probability)
+{
+    m_dropProbability = probability;
+}
+
+bool SyntheticFrameSource::open(int id)
+{
+    m_rng.seed(static_cast<unsigned int>(id) + 1);
+    m_startTime = steady_hr_clock::now();
+    m_nextFrameTime = m_startTime;
+    m_frameNo = 0;
+    m_timestamp = 0;
+
+    // noise is generated once, and only shifted around for every frame
+    m_noise = cv::Mat(m_height * 2, m_width * 2, CV_8UC1);
+    cv::randn(m_noise, cv::Scalar(8), cv::Scalar(6));
+    m_opened = true;
+    return true;
+}
+
+void SyntheticFrameSource::release()
+{
+    m_opened = false;
+    m_noise.release();
+}
+
+bool SyntheticFrameSource::isOpened() const
+{
+    return m_opened;
+}
+
+bool SyntheticFrameSource::grab()
+{
+    if (!m_opened)
+        return false;
+
+    // block until the next frame is "exposed", like a real camera driver would
+    const auto period = std::chrono::duration_cast<steady_hr_clock::duration>(std::chrono::duration<double>(1.0 / m_fps));
+    std::uniform_real_distribution<double> dropDist(0, 1);
+    do {
+        m_nextFrameTime += period;
+        m_frameNo++;
+    } while (dropDist(m_rng) < m_dropProbability);
+    std::this_thread::sleep_until(m_nextFrameTime);
+
+    m_timestamp = std::chrono::duration<double, std::milli>(m_nextFrameTime - m_startTime).count();
+    return true;
+}
+
+bool SyntheticFrameSource::retrieve(cv::Mat &frame)
+{
+    if (!m_opened)
+        return false;
+
+    const auto t = static_cast<double>(m_frameNo) / m_fps;
+    const auto level = m_brightness * m_gain / 64.0;
+    cv::Mat gray(m_height, m_width, CV_8UC1, cv::Scalar(std::min(255.0, level * 0.3)));
+
+    // a few cells slowly moving on a circle, blinking at different rates
+    for (int i = 0; i < 4; i++) {
+        const auto angle = t * 0.2 + i * CV_PI / 2;
+        const cv::Point center(static_cast<int>(m_width / 2 + std::cos(angle) * m_width / 4),
+                               static_cast<int>(m_height / 2 + std::sin(angle) * m_height / 4));
+        const auto intensity = std::min(255.0, level * (0.6 + 0.4 * std::sin(t * (1 + i))));
+        cv::circle(gray, center, 12, cv::Scalar(intensity), -1, cv::LINE_AA);
+    }
+
+    const auto offset = static_cast<int>(m_frameNo * 7919 % static_cast<uint64_t>(m_width * m_height));
+    const cv::Rect noiseRect(offset % m_width, (offset / m_width) % m_height, m_width, m_height);
+    cv::add(gray, m_noise(noiseRect), gray);
+
+    cv::cvtColor(gray, frame, cv::COLOR_GRAY2BGR);
+    return true;
+}
+
+double SyntheticFrameSource::get(int propId) const
+{
+    switch (propId) {
+    case cv::CAP_PROP_POS_MSEC:
+        return m_timestamp;
+    case cv::CAP_PROP_FRAME_WIDTH:
+        return m_width;
+    case cv::CAP_PROP_FRAME_HEIGHT:
+        return m_height;
+    case cv::CAP_PROP_FPS:
+        return m_fps;
+    case cv::CAP_PROP_BRIGHTNESS:
+        return m_brightness;
+    case cv::CAP_PROP_GAIN:
+        return m_gain;
+    default:
+        return 0;
+    }
+}
+
+bool SyntheticFrameSource::set(int propId, double value)
+{
+    switch (propId) {
+    case cv::CAP_PROP_BRIGHTNESS:
+        m_brightness = value;
+        break;
+    case cv::CAP_PROP_GAIN:
+        m_gain = value;
+        break;
+    default:
+        break;
+    }
+    return true;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <memory>
+#include <random>
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "msexport.h"
+#include "pipelinestats.h"
+
+/**
+ * @brief The FrameSource class
+ *
+ * Device that MiniScope acquires frames from. Properties use the OpenCV
+ * capture property IDs, which the Miniscope firmware reuses for its own settings.
+ */
+class MS_LIB_EXPORT FrameSource
+{
+public:
+    virtual ~FrameSource();
+
+    virtual bool open(int id) = 0;
+    virtual void release() = 0;
+    virtual bool isOpened() const = 0;
+
+    virtual bool grab() = 0;
+    virtual bool retrieve(cv::Mat &frame) = 0;
+
+    virtual double get(int propId) const = 0;
+    virtual bool set(int propId, double value) = 0;
+};
+
+/**
+ * @brief Frame source reading from a (Miniscope) camera via OpenCV.
+ */
+class MS_LIB_EXPORT CameraFrameSource : public FrameSource
+{
+public:
+    CameraFrameSource();
+
+    bool open(int id) override;
+    void release() override;
+    bool isOpened() const override;
+
+    bool grab() override;
+    bool retrieve(cv::Mat &frame) override;
+
+    double get(int propId) const override;
+    bool set(int propId, double value) override;
+
+private:
+    mutable cv::VideoCapture m_cam;
+};
+
+/**
+ * @brief The SyntheticFrameSource class
+ *
+ * Generates noisy frames with a few slowly moving bright spots at a fixed rate,
+ * so acquisition and recording can be tested without any hardware attached.
+ * Frames can be dropped at random, in which case the driver timestamp still
+ * advances like it would for a real camera losing frames.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+class MS_LIB_EXPORT SyntheticFrameSource : public FrameSource
+{
+public:
+    explicit SyntheticFrameSource(int width = 752, int height = 480, double fps = 20);
+
+    void setDropProbability(double probability);
+
+    bool open(int id) override;
+    void release() override;
+    bool isOpened() const override;
+
+    bool grab() override;
+    bool retrieve(cv::Mat &frame) override;
+
+    double get(int propId) const override;
+    bool set(int propId, double value) override;
+
+private:
+    int m_width;
+    int m_height;
+    double m_fps;
+    double m_dropProbability;
+    bool m_opened;
+
+    std::mt19937 m_rng;
+    steady_hr_clock::time_point m_startTime;
+    steady_hr_clock::time_point m_nextFrameTime;
+    uint64_t m_frameNo;
+    double m_timestamp;
+
+    double m_brightness;
+    double m_gain;
+
+    cv::Mat m_noise;
+};
+#pragma GCC diagnostic pop
+
+#endif // FRAMESOURCE_H
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "frameworker.h"
+
+#include "tracerecorder.h"
+
+FrameWorker::FrameWorker(const std::string &name)
+    : m_name(name),
+      m_running(false),
+      m_havePending(false),
+      m_processedCount(0),
+      m_skippedCount(0)
+{
+}
+
+FrameWorker::~FrameWorker()
+{
+    stop();
+}
+
+void FrameWorker::start(ProcessFunc func)
+{
+    stop();
+
+    m_func = func;
+    m_running = true;
+    m_havePending = false;
+    m_thread = std::thread(&FrameWorker::run, this, TraceRecorder::threadSession());
+}
+
+/**
+ * Stop the worker thread, after the frame currently being processed is done.
+ * A frame still waiting to be processed is discarded.
+ */
+void FrameWorker::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_running)
+            return;
+        m_running = false;
+        m_havePending = false;
+        m_pendingFrame = cv::Mat();
+    }
+    m_cond.notify_one();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+bool FrameWorker::running() const
+{
+    return m_thread.joinable();
+}
+
+/**
+ * Hand a frame to the worker. Returns false if a frame that was still waiting
+ * had to be skipped for it.
+ */
+bool FrameWorker::submit(const cv::Mat &frame, const FrameMetadata &meta)
+{
+    bool skipped;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_running)
+            return false;
+        skipped = m_havePending;
+        m_pendingFrame = frame;
+        m_pendingMeta = meta;
+        m_havePending = true;
+    }
+    m_cond.notify_one();
+
+    if (skipped)
+        m_skippedCount++;
+    return !skipped;
+}
+
+uint64_t FrameWorker::processedCount() const
+{
+    return m_processedCount;
+}
+
+uint64_t FrameWorker::skippedCount() const
+{
+    return m_skippedCount;
+}
+
+void FrameWorker::run(uint traceSession)
+{
+    TraceRecorder::setThreadSession(traceSession);
+    TraceRecorder::setThreadName(m_name);
+
+    while (true) {
+        cv::Mat frame;
+        FrameMetadata meta;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&] { return m_havePending || !m_running; });
+            if (!m_running)
+                break;
+            frame = m_pendingFrame;
+            meta = m_pendingMeta;
+            m_pendingFrame = cv::Mat();
+            m_havePending = false;
+        }
+
+        TRACE_SCOPE_ARG("process_frame", static_cast<int64_t>(meta.sequence));
+        m_func(frame, meta);
+        m_processedCount++;
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMEWORKER_H
+#define FRAMEWORKER_H
+
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <opencv2/core.hpp>
+
+#include "videowriter.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief The FrameWorker class
+ *
+ * Runs an analysis function on frames in a thread of its own, so the capture
+ * thread never has to wait for it.
+ *
+ * Only the most recently submitted frame is kept: if the function is still busy
+ * when a new frame arrives, a frame that was waiting is replaced (and counted as
+ * skipped), so the analysis always works on fresh data and never builds up a backlog.
+ * Frames are passed on without copying them, so they must not be modified after
+ * they were submitted.
+ */
+class FrameWorker
+{
+public:
+    using ProcessFunc = std::function<void(const cv::Mat&, const FrameMetadata&)>;
+
+    explicit FrameWorker(const std::string &name);
+    ~FrameWorker();
+
+    void start(ProcessFunc func);
+    void stop();
+    bool running() const;
+
+    bool submit(const cv::Mat &frame, const FrameMetadata &meta);
+
+    uint64_t processedCount() const;
+    uint64_t skippedCount() const;
+
+private:
+    std::string m_name;
+    ProcessFunc m_func;
+    std::thread m_thread;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_running;
+    bool m_havePending;
+    cv::Mat m_pendingFrame;
+    FrameMetadata m_pendingMeta;
+
+    std::atomic<uint64_t> m_processedCount;
+    std::atomic<uint64_t> m_skippedCount;
+
+    void run(uint traceSession);
+};
+
+#pragma GCC diagnostic pop
+
+#endif // FRAMEWORKER_H
@@ -23,6 +23,12 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <future>
+#include <tuple>
+#include <map>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <boost/circular_buffer.hpp>
 #include <boost/format.hpp>
 #include <opencv2/highgui.hpp>
@@ -33,12 +39,91 @@
 
 #include "definitions.h"
 #include "videowriter.h"
+#include "pipelinestats.h"
+#include "tracerecorder.h"
+#include "framegapdetector.h"
+#include "clocksync.h"
+#include "framesource.h"
+#include "framering.h"
+#include "frameworker.h"
+#include "roitraces.h"
+#include "motioncorrection.h"
+#include "summaryimages.h"
+#include "framereduction.h"
+#include "percentilebaseline.h"
+#include "displaykernels.h"
+#include "stripepool.h"
+
+/**
+ * @brief FPS_SMOOTHING_ALPHA
+ * Weight of the most recent frame interval in the exponential moving average
+ * we use to estimate the current framerate.
+ */
+static const double FPS_SMOOTHING_ALPHA = 0.1;
+
+/**
+ * @brief RECOVERY_RETRIES_BEFORE_REOPEN
+ * Number of times we simply try to grab a new frame after a failure,
+ * before closing and reopening the camera device.
+ */
+static const uint RECOVERY_RETRIES_BEFORE_REOPEN = 4;
+
+/**
+ * Initial and maximum time to wait between two attempts to recover
+ * from a camera failure. The wait time doubles with every failed attempt.
+ */
+static const auto RECOVERY_INITIAL_BACKOFF = std::chrono::milliseconds(5);
+static const auto RECOVERY_MAX_BACKOFF = std::chrono::milliseconds(1000);
+
+/**
+ * @brief RECOVERY_GIVE_UP_TIME
+ * Time after which we consider a camera outage to be permanent and stop acquisition.
+ */
+static const auto RECOVERY_GIVE_UP_TIME = std::chrono::seconds(20);
+
+/**
+ * @brief FRAME_GAP_THRESHOLD
+ * Factor by which a frame interval must exceed the expected one to count as a gap.
+ */
+static const double FRAME_GAP_THRESHOLD = 1.5;
 
-using steady_hr_clock =
-    std::conditional<std::chrono::high_resolution_clock::is_steady,
-                     std::chrono::high_resolution_clock,
-                     std::chrono::steady_clock
-                    >::type;
+/**
+ * @brief PRE_TRIGGER_MAX_TIME
+ * Longest time before an external trigger we keep frames of.
+ */
+static const double PRE_TRIGGER_MAX_TIME = 10.0;
+
+/**
+ * @brief PRE_TRIGGER_MAX_FRAMES
+ * Maximum number of frames we keep from before an external trigger. The whole ring
+ * is handed to the video writer at once when the trigger arrives, so this stays well
+ * below the size of the writer's frame queue (512 frames).
+ */
+static const size_t PRE_TRIGGER_MAX_FRAMES = 384;
+
+/**
+ * @brief MOTION_RECORD_MAX_DELAY
+ * Number of frames we hold back from recording at most while they wait for the
+ * motion estimate of their own. After that, the latest known shift is used.
+ */
+static const size_t MOTION_RECORD_MAX_DELAY = 16;
+
+/**
+ * @brief MOTION_SHIFT_HISTORY
+ * Number of recent motion estimates we keep for the frames waiting to be recorded.
+ */
+static const size_t MOTION_SHIFT_HISTORY = 64;
+
+/**
+ * Copy of a callback that may be replaced from another thread at any time.
+ * Calling the copy keeps what the callback captured alive until it returns.
+ */
+template<typename T>
+static T callbackCopy(std::mutex &mutex, const T &callback)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return callback;
+}
 
 #pragma GCC diagnostic ignored "-Wpadded"
 class MiniScopeData
@@ -53,9 +138,22 @@ public:
           failed(false),
           checkRecTrigger(false),
           droppedFramesCount(0),
-          useColor(false)
+          frameGapsCount(0),
+          missedFramesCount(0),
+          useColor(false),
+          grabTime("grab"),
+          retrieveTime("retrieve"),
+          processTime("display_processing"),
+          displayEnqueueTime("display_enqueue"),
+          recordEnqueueTime("record_enqueue"),
+          frameIntervalTime("frame_interval"),
+          frameJitterTime("frame_jitter"),
+          wakeupLatencyTime("wakeup_latency"),
+          roiTraceTime("roi_traces"),
+          displayQueueDepth("display_queue")
     {
         fps = 30;
+        cam = std::make_shared<CameraFrameSource>();
         frameRing = boost::circular_buffer<cv::Mat>(32);
         videoCodec = VideoCodec::FFV1;
         videoContainer = VideoContainer::Matroska;
@@ -71,12 +169,31 @@ public:
 
         recordingSliceInterval = 0; // don't slice
         bgAccumulateAlpha = 0.01;
+        bgPercentile = 8;
+        bgPercentileWindow = 30;
+        preTriggerBufferTime = 0; // don't keep frames from before an external trigger
+        recordRequestTime = 0;
+        recordStartAt = 0;
+        recordStopAt = 0;
+        recordStartLatency = 0;
+        statsEnabled = true;
+        displayEnabled = true;
+        traceSession = 0;
+        sharedFrameRingSlots = 8;
+        roiBaselineWindow = 30;
+        motionCorrection = false;
+        motionCorrectRecording = false;
+        summaryImagesEnabled = false;
+        summaryFrameStride = 1;
+        processingThreads = 0; // automatic
+        clockMapping = ClockMapping();
+        clockMapping.valid = false;
     }
 
     std::thread *thread;
     std::mutex mutex;
 
-    cv::VideoCapture cam;
+    std::shared_ptr<FrameSource> cam;
     int scopeCamId;
 
     double exposure;
@@ -91,6 +208,8 @@ public:
     int maxFluorDisplay;
 
     std::atomic<BackgroundDiffMethod> bgDiffMethod;
+    std::atomic<double> bgPercentile;
+    std::atomic<double> bgPercentileWindow; // seconds
     std::atomic<double> bgAccumulateAlpha;  // NOTE: Double may not actually be atomic
 
     bool connected;
@@ -98,15 +217,32 @@ public:
     std::atomic_bool recording;
     std::atomic_bool failed;
     std::atomic_bool checkRecTrigger;
+    std::atomic<double> preTriggerBufferTime; // in seconds
 
     std::atomic<size_t> droppedFramesCount;
+    std::atomic<size_t> frameGapsCount;
+    std::atomic<size_t> missedFramesCount;
+
+    std::mutex clockMutex;
+    ClockMapping clockMapping;
     std::atomic_uint currentFPS;
+    std::atomic<double> measuredFps;
     std::atomic<double> lastRecordedFrameTime; // this is in milliseconds (and is not atomic for arithmetic)
+    std::atomic<int64_t> recordRequestTime; // steady clock time in nanoseconds
+    std::atomic<int64_t> recordStartAt; // first frame time to record, steady clock nanoseconds (0 for none)
+    std::atomic<int64_t> recordStopAt;  // first frame time not to record anymore (0 for none)
+    std::atomic<double> recordStartLatency; // in milliseconds
     double firstFrameTime;
 
     boost::circular_buffer<cv::Mat> frameRing;
 
-    std::function<void (std::string)> onMessageCallback;
+    std::mutex callbackMutex; // guards all callbacks
+    std::function<void (const std::string&)> onMessageCallback;
+
+    std::mutex controlMutex;
+    std::map<CameraControl, double> pendingControls; // latest requested value per control
+    std::function<void (CameraControl, double, size_t)> onControlAppliedCallback;
+    std::function<void (const cv::Mat&, const FrameMetadata&)> onFrameCallback;
 
     bool useColor;
     bool showRed;
@@ -119,6 +255,57 @@ public:
     uint recordingSliceInterval;
 
     std::string lastError;
+
+    std::shared_ptr<VideoWriter> activeWriter; // only accessed atomically
+    std::shared_ptr<EncoderPool> encoderPool;
+
+    ThreadSchedulingOptions captureScheduling;
+    ThreadSchedulingOptions encoderScheduling;
+    ThreadSchedulingOptions processingScheduling;
+    std::atomic_uint processingThreads;
+    std::shared_ptr<StripePool> stripePool; // only accessed atomically
+    std::mutex schedulingMutex;
+    std::string captureSchedulingInfo;
+
+    std::string traceFname;
+    uint traceSession; // 0 while not tracing
+
+    std::string sharedFrameRingName;
+    uint sharedFrameRingSlots;
+
+    std::shared_ptr<RoiTraceExtractor> roiExtractor; // only accessed atomically
+    std::atomic<double> roiBaselineWindow; // seconds
+    std::string roiTraceFname;
+    std::function<void (const RoiTraces&)> onRoiTracesCallback;
+
+    std::atomic_bool motionCorrection;
+    std::atomic_bool motionCorrectRecording;
+    std::string motionLogFname;
+    std::mutex motionMutex;
+    MotionShift motionShift;
+
+    std::atomic_bool summaryImagesEnabled;
+    std::atomic_uint summaryFrameStride;
+    mutable std::mutex summaryMutex;
+    SummaryAccumulator summary;
+
+    mutable std::mutex reductionMutex;
+    FrameReduction recordingReduction;
+    FrameReduction displayReduction;
+
+    std::atomic_bool displayEnabled;
+
+    std::atomic_bool statsEnabled;
+    LatencyHistogram grabTime;
+    LatencyHistogram retrieveTime;
+    LatencyHistogram processTime;
+    LatencyHistogram displayEnqueueTime;
+    LatencyHistogram recordEnqueueTime;
+    LatencyHistogram frameIntervalTime;
+    LatencyHistogram frameJitterTime;
+    LatencyHistogram wakeupLatencyTime;
+    LatencyHistogram roiTraceTime;
+    QueueGauge displayQueueDepth;
 };
 #pragma GCC diagnostic pop
 
@@ -142,6 +329,8 @@ MiniScope::~MiniScope()
 void MiniScope::startCaptureThread()
 {
     finishCaptureThread();
+    if (!d->traceFname.empty())
+        d->traceSession = TraceRecorder::beginSession();
     d->running = true;
     d->thread = new std::thread(captureThread, this);
 }
@@ -154,17 +343,28 @@ void MiniScope::finishCaptureThread()
         delete d->thread;
         d->thread = nullptr;
     }
+
+    if (d->traceSession != 0) {
+        // write events of the session that just ended
+        if (TraceRecorder::exportChromeTrace(d->traceSession, d->traceFname))
+            emitMessage(boost::str(boost::format("Wrote trace to %1%") % d->traceFname));
+        else
+            emitMessage(boost::str(boost::format("Unable to write trace to %1%") % d->traceFname));
+        TraceRecorder::endSession(d->traceSession);
+        d->traceSession = 0;
+    }
 }
 
 void MiniScope::emitMessage(const std::string &msg)
 {
-    if (!d->onMessageCallback) {
+    const auto callback = callbackCopy(d->callbackMutex, d->onMessageCallback);
+    if (!callback) {
         std::cout << msg << std::endl;
         return;
     }
 
     d->mutex.lock();
-    d->onMessageCallback(msg);
+    callback(msg);
     d->mutex.unlock();
 }
 
@@ -182,6 +382,28 @@ void MiniScope::setScopeCamId(int id)
     d->scopeCamId = id;
 }
 
+/**
+ * Use a different source for frames than the camera with the selected ID,
+ * for example a synthetic one for testing. Must be set while disconnected.
+ */
+void MiniScope::setFrameSource(std::shared_ptr<FrameSource> source)
+{
+    if (d->connected) {
+        std::cerr << "Tried to change the frame source of a connected camera." << std::endl;
+        return;
+    }
+    d->cam = source? source : std::make_shared<CameraFrameSource>();
+}
+
+/**
+ * Have recorded frames encoded by a pool of encoder threads shared with
+ * other devices, instead of a thread of our own.
+ */
+void MiniScope::setEncoderPool(std::shared_ptr<EncoderPool> pool)
+{
+    d->encoderPool = pool;
+}
+
 void MiniScope::setExposure(double value)
 {
     if (floor(value) == 0)
@@ -192,7 +414,7 @@ void MiniScope::setExposure(double value)
     // NOTE: With V4L as backend, 255 seems to be the max value here
 
     d->exposure = value;
-    d->cam.set(cv::CAP_PROP_BRIGHTNESS, value * 2.55);
+    queueControl(CameraControl::Exposure, value);
 }
 
 double MiniScope::exposure() const
@@ -205,7 +427,7 @@ void MiniScope::setGain(double value)
     // NOTE: With V4L as backend, 100 seems to be the max value here
 
     d->gain = value;
-    d->cam.set(cv::CAP_PROP_GAIN, value);
+    queueControl(CameraControl::Gain, value);
 }
 
 double MiniScope::gain() const
@@ -216,7 +438,7 @@ double MiniScope::gain() const
 void MiniScope::setExcitation(double value)
 {
     d->excitation = value;
-    setLed(value);
+    queueControl(CameraControl::Excitation, value);
 }
 
 double MiniScope::excitation() const
@@ -235,9 +457,9 @@ bool MiniScope::connect()
         }
     }
 
-    d->cam.open(d->scopeCamId);
+    d->cam->open(d->scopeCamId);
 
-    d->cam.set(cv::CAP_PROP_SATURATION, SET_CMOS_SETTINGS); // Initiallizes CMOS sensor (FPS, gain and exposure enabled...)
+    d->cam->set(cv::CAP_PROP_SATURATION, SET_CMOS_SETTINGS); // Initiallizes CMOS sensor (FPS, gain and exposure enabled...)
 
     // set default values
     setExposure(100);
@@ -254,7 +476,7 @@ bool MiniScope::connect()
 void MiniScope::disconnect()
 {
     stop();
-    d->cam.release();
+    d->cam->release();
     d->connected = false;
     emitMessage(boost::str(boost::format("Disconnected camera %1%") % d->scopeCamId));
 }
@@ -282,7 +504,11 @@ void MiniScope::stop()
     finishCaptureThread();
 }
 
-bool MiniScope::startRecording(const std::string &fname)
+/**
+ * Request a recording. The start time is published before the capture thread
+ * can see the recording flag, so it never records a frame grabbed too early.
+ */
+bool MiniScope::beginRecording(const std::string &fname, int64_t requestTime, int64_t startAt)
 {
     if (!d->connected)
         return false;
@@ -293,16 +519,43 @@ bool MiniScope::startRecording(const std::string &fname)
 
     if (!fname.empty())
         d->videoFname = fname;
+    d->recordRequestTime = requestTime;
+    d->recordStartAt = startAt;
+    d->recordStopAt = 0;
     d->recording = true;
 
     return true;
 }
 
+bool MiniScope::startRecording(const std::string &fname)
+{
+    const auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(steady_hr_clock::now().time_since_epoch()).count();
+    return beginRecording(fname, now, 0);
+}
+
+/**
+ * Start recording with the first frame grabbed at or after the given time.
+ * Frames grabbed earlier are not recorded, even if they are processed later.
+ */
+bool MiniScope::startRecording(const std::string &fname, const steady_hr_clock::time_point &startTime)
+{
+    const auto startNsec = std::chrono::duration_cast<std::chrono::nanoseconds>(startTime.time_since_epoch()).count();
+    return beginRecording(fname, startNsec, startNsec);
+}
+
 void MiniScope::stopRecording()
 {
     d->recording = false;
 }
 
+/**
+ * Stop recording with the last frame grabbed before the given time.
+ */
+void MiniScope::stopRecording(const steady_hr_clock::time_point &stopTime)
+{
+    d->recordStopAt = std::chrono::duration_cast<std::chrono::nanoseconds>(stopTime.time_since_epoch()).count();
+}
+
 bool MiniScope::running() const
 {
     return d->running;
@@ -315,7 +568,23 @@ bool MiniScope::recording() const
 
 void MiniScope::setOnMessage(std::function<void(const std::string&)> callback)
 {
-    d->onMessageCallback = callback;
+    // the previous callback is only destroyed once we released the lock, as that may block
+    std::lock_guard<std::mutex> lock(d->callbackMutex);
+    std::swap(d->onMessageCallback, callback);
+}
+
+void MiniScope::setOnFrame(std::function<void (const cv::Mat &, const FrameMetadata &)> callback)
+{
+    // the previous callback is only destroyed once we released the lock, as that may block
+    std::lock_guard<std::mutex> lock(d->callbackMutex);
+    std::swap(d->onFrameCallback, callback);
+}
+
+void MiniScope::setOnControlApplied(std::function<void (CameraControl, double, size_t)> callback)
+{
+    // the previous callback is only destroyed once we released the lock, as that may block
+    std::lock_guard<std::mutex> lock(d->callbackMutex);
+    std::swap(d->onControlAppliedCallback, callback);
 }
 
 bool MiniScope::useColor() const
@@ -359,6 +628,7 @@ cv::Mat MiniScope::currentFrame()
 
     frame = d->frameRing.front();
     d->frameRing.pop_front();
+    d->displayQueueDepth.set(d->frameRing.size());
     return frame;
 }
 
@@ -367,11 +637,33 @@ uint MiniScope::currentFPS() const
     return d->currentFPS;
 }
 
+double MiniScope::measuredFps() const
+{
+    return d->measuredFps;
+}
+
 size_t MiniScope::droppedFramesCount() const
 {
     return d->droppedFramesCount;
 }
 
+/**
+ * Number of times frames were lost silently during this session,
+ * as detected from the intervals between frame timestamps.
+ */
+size_t MiniScope::frameGapsCount() const
+{
+    return d->frameGapsCount;
+}
+
+/**
+ * Estimated total number of frames that were lost silently during this session.
+ */
+size_t MiniScope::missedFramesCount() const
+{
+    return d->missedFramesCount;
+}
+
 uint MiniScope::fps() const
 {
     return d->fps;
@@ -392,6 +684,24 @@ void MiniScope::setExternalRecordTrigger(bool enabled)
     d->checkRecTrigger = enabled;
 }
 
+double MiniScope::preTriggerBufferTime() const
+{
+    return d->preTriggerBufferTime;
+}
+
+/**
+ * Time before an external trigger edge to include in the recording, in seconds.
+ * At most 10 seconds and 384 frames are kept.
+ */
+void MiniScope::setPreTriggerBufferTime(double seconds)
+{
+    if (seconds < 0)
+        seconds = 0;
+    if (seconds > PRE_TRIGGER_MAX_TIME)
+        seconds = PRE_TRIGGER_MAX_TIME;
+    d->preTriggerBufferTime = seconds;
+}
+
 std::string MiniScope::videoFilename() const
 {
     return d->videoFname;
@@ -474,6 +784,34 @@ void MiniScope::setDisplayBgDiffMethod(BackgroundDiffMethod method)
     d->bgDiffMethod = method;
 }
 
+double MiniScope::bgPercentile() const
+{
+    return d->bgPercentile;
+}
+
+/**
+ * Set the percentile (0 to 100) of the recent values of every pixel that
+ * BackgroundDiffMethod::PERCENTILE uses as baseline.
+ */
+void MiniScope::setBgPercentile(double percentile)
+{
+    d->bgPercentile = percentile;
+}
+
+double MiniScope::bgPercentileWindow() const
+{
+    return d->bgPercentileWindow;
+}
+
+/**
+ * Set the time window, in seconds, that the percentile baseline is computed over.
+ * It is sampled with PercentileBaseline::SAMPLES evenly spaced frames.
+ */
+void MiniScope::setBgPercentileWindow(double seconds)
+{
+    d->bgPercentileWindow = seconds;
+}
+
 double MiniScope::bgAccumulateAlpha() const
 {
     return d->bgAccumulateAlpha;
@@ -506,6 +844,381 @@ double MiniScope::lastRecordedFrameTime() const
     return d->lastRecordedFrameTime;
 }
 
+double MiniScope::recordStartLatency() const
+{
+    return d->recordStartLatency;
+}
+
+std::string MiniScope::traceFile() const
+{
+    return d->traceFname;
+}
+
+void MiniScope::setTraceFile(const std::string &fname)
+{
+    d->traceFname = fname;
+}
+
+std::string MiniScope::sharedFrameRingName() const
+{
+    return d->sharedFrameRingName;
+}
+
+void MiniScope::setSharedFrameRingName(const std::string &name)
+{
+    d->sharedFrameRingName = name;
+}
+
+uint MiniScope::sharedFrameRingSlots() const
+{
+    return d->sharedFrameRingSlots;
+}
+
+void MiniScope::setSharedFrameRingSlots(uint slots)
+{
+    d->sharedFrameRingSlots = slots;
+}
+
+bool MiniScope::setRois(const std::vector<cv::Mat> &footprints)
+{
+    if (footprints.empty()) {
+        clearRois();
+        return true;
+    }
+
+    // compile the new set here, so the capture thread only has to swap it in
+    auto extractor = std::make_shared<RoiTraceExtractor>();
+    if (!extractor->compile(footprints)) {
+        d->lastError = extractor->lastError();
+        return false;
+    }
+    std::atomic_store(&d->roiExtractor, extractor);
+    return true;
+}
+
+void MiniScope::clearRois()
+{
+    std::atomic_store(&d->roiExtractor, std::shared_ptr<RoiTraceExtractor>());
+}
+
+size_t MiniScope::roisCount() const
+{
+    auto extractor = std::atomic_load(&d->roiExtractor);
+    return extractor? extractor->roisCount() : 0;
+}
+
+double MiniScope::roiBaselineWindow() const
+{
+    return d->roiBaselineWindow;
+}
+
+/**
+ * Set the time in seconds the baseline F0 of the ROI traces is averaged over.
+ */
+void MiniScope::setRoiBaselineWindow(double seconds)
+{
+    d->roiBaselineWindow = seconds;
+}
+
+std::string MiniScope::roiTraceFile() const
+{
+    return d->roiTraceFname;
+}
+
+/**
+ * Write the ROI traces of every frame into a binary file, from the time the
+ * acquisition is started.
+ */
+void MiniScope::setRoiTraceFile(const std::string &fname)
+{
+    d->roiTraceFname = fname;
+}
+
+void MiniScope::setOnRoiTraces(std::function<void (const RoiTraces &)> callback)
+{
+    // the previous callback is only destroyed once we released the lock, as that may block
+    std::lock_guard<std::mutex> lock(d->callbackMutex);
+    std::swap(d->onRoiTracesCallback, callback);
+}
+
+bool MiniScope::motionCorrection() const
+{
+    return d->motionCorrection;
+}
+
+/**
+ * Estimate the rigid motion of every frame against a running template, and
+ * move the frames used for display and ROI traces back into place.
+ */
+void MiniScope::setMotionCorrection(bool enabled)
+{
+    d->motionCorrection = enabled;
+}
+
+bool MiniScope::motionCorrectRecording() const
+{
+    return d->motionCorrectRecording;
+}
+
+/**
+ * Record motion corrected frames instead of the raw ones, if motion correction
+ * is enabled. Recorded frames are held back until the shift of their own
+ * was estimated, which delays them by a few frames.
+ */
+void MiniScope::setMotionCorrectRecording(bool enabled)
+{
+    d->motionCorrectRecording = enabled;
+}
+
+std::string MiniScope::motionLogFile() const
+{
+    return d->motionLogFname;
+}
+
+/**
+ * Write the shift applied to every frame to a CSV file, together with the frame
+ * it was estimated for, from the time motion correction is enabled.
+ */
+void MiniScope::setMotionLogFile(const std::string &fname)
+{
+    d->motionLogFname = fname;
+}
+
+MotionShift MiniScope::motionShift() const
+{
+    std::lock_guard<std::mutex> lock(d->motionMutex);
+    return d->motionShift;
+}
+
+bool MiniScope::summaryImagesEnabled() const
+{
+    return d->summaryImagesEnabled;
+}
+
+/**
+ * Compute mean, standard deviation, maximum and local correlation images of
+ * every recording while it is running, and save them next to the video
+ * when the recording stops.
+ */
+void MiniScope::setSummaryImagesEnabled(bool enabled)
+{
+    d->summaryImagesEnabled = enabled;
+}
+
+uint MiniScope::summaryFrameStride() const
+{
+    return d->summaryFrameStride;
+}
+
+/**
+ * Only add every n-th recorded frame to the summary images.
+ */
+void MiniScope::setSummaryFrameStride(uint stride)
+{
+    d->summaryFrameStride = (stride < 1)? 1 : stride;
+}
+
+/**
+ * Summary images of the current recording, or of the last one
+ * if we are not recording.
+ */
+SummaryImages MiniScope::summaryImages() const
+{
+    std::lock_guard<std::mutex> lock(d->summaryMutex);
+    return d->summary.images();
+}
+
+FrameReduction MiniScope::recordingReduction() const
+{
+    std::lock_guard<std::mutex> lock(d->reductionMutex);
+    return d->recordingReduction;
+}
+
+/**
+ * Crop and bin frames before they are recorded. A new setting takes
+ * effect with the next recording.
+ */
+void MiniScope::setRecordingReduction(const FrameReduction &reduction)
+{
+    std::lock_guard<std::mutex> lock(d->reductionMutex);
+    d->recordingReduction = reduction;
+}
+
+FrameReduction MiniScope::displayReduction() const
+{
+    std::lock_guard<std::mutex> lock(d->reductionMutex);
+    return d->displayReduction;
+}
+
+/**
+ * Crop and bin frames before they are displayed. The display always
+ * uses 8-bit frames at the full frame rate, so deepPixels and
+ * temporalBinning are ignored.
+ */
+void MiniScope::setDisplayReduction(const FrameReduction &reduction)
+{
+    std::lock_guard<std::mutex> lock(d->reductionMutex);
+    d->displayReduction = reduction;
+    d->displayReduction.deepPixels = false;
+    d->displayReduction.temporalBinning = 1;
+}
+
+ThreadSchedulingOptions MiniScope::captureScheduling() const
+{
+    return d->captureScheduling;
+}
+
+/**
+ * Set CPU affinity and scheduling policy of the capture thread, which also does
+ * all display processing. Takes effect when acquisition is started.
+ */
+void MiniScope::setCaptureScheduling(const ThreadSchedulingOptions &options)
+{
+    d->captureScheduling = options;
+}
+
+ThreadSchedulingOptions MiniScope::encoderScheduling() const
+{
+    return d->encoderScheduling;
+}
+
+/**
+ * Set CPU affinity, scheduling policy and I/O priority of the encoding thread
+ * of recordings. Takes effect for the next video writer we prepare, and has
+ * no effect if a shared encoder pool is used.
+ */
+void MiniScope::setEncoderScheduling(const ThreadSchedulingOptions &options)
+{
+    d->encoderScheduling = options;
+}
+
+uint MiniScope::processingThreads() const
+{
+    return d->processingThreads;
+}
+
+/**
+ * Set the number of threads that process the rows of large frames in parallel,
+ * including the capture thread itself. 1 processes frames on the capture thread
+ * only, 0 selects a number based on the CPU cores.
+ * Takes effect when acquisition is started.
+ */
+void MiniScope::setProcessingThreads(uint threads)
+{
+    d->processingThreads = threads;
+}
+
+ThreadSchedulingOptions MiniScope::processingScheduling() const
+{
+    return d->processingScheduling;
+}
+
+/**
+ * Set CPU affinity and scheduling policy of the threads helping the capture
+ * thread with processing frames, e.g. to keep them away from the cores of the
+ * encoders. Takes effect when acquisition is started.
+ */
+void MiniScope::setProcessingScheduling(const ThreadSchedulingOptions &options)
+{
+    d->processingScheduling = options;
+}
+
+bool MiniScope::displayEnabled() const
+{
+    return d->displayEnabled;
+}
+
+/**
+ * Enable or disable processing of frames for display. If disabled,
+ * currentFrame() will not return any new frames, which saves a bit of work
+ * per frame when nothing is displayed anyway.
+ */
+void MiniScope::setDisplayEnabled(bool enabled)
+{
+    d->displayEnabled = enabled;
+}
+
+bool MiniScope::statsEnabled() const
+{
+    return d->statsEnabled;
+}
+
+void MiniScope::setStatsEnabled(bool enabled)
+{
+    d->statsEnabled = enabled;
+    auto vwriter = std::atomic_load(&d->activeWriter);
+    if (vwriter)
+        vwriter->setStatsEnabled(enabled);
+}
+
+void MiniScope::resetStats()
+{
+    d->grabTime.reset();
+    d->retrieveTime.reset();
+    d->processTime.reset();
+    d->displayEnqueueTime.reset();
+    d->recordEnqueueTime.reset();
+    d->frameIntervalTime.reset();
+    d->frameJitterTime.reset();
+    d->wakeupLatencyTime.reset();
+    d->roiTraceTime.reset();
+    d->displayQueueDepth.reset();
+}
+
+PipelineStats MiniScope::stats() const
+{
+    PipelineStats stats;
+    stats.histograms.push_back(d->grabTime.summary());
+    stats.histograms.push_back(d->retrieveTime.summary());
+    stats.histograms.push_back(d->processTime.summary());
+    stats.histograms.push_back(d->displayEnqueueTime.summary());
+    stats.histograms.push_back(d->recordEnqueueTime.summary());
+    stats.histograms.push_back(d->frameIntervalTime.summary());
+    stats.histograms.push_back(d->frameJitterTime.summary());
+    stats.histograms.push_back(d->wakeupLatencyTime.summary());
+    stats.histograms.push_back(d->roiTraceTime.summary());
+    stats.gauges.push_back(d->displayQueueDepth.summary());
+    {
+        std::lock_guard<std::mutex> lock(d->schedulingMutex);
+        stats.threads.push_back({"capture", d->captureSchedulingInfo});
+    }
+    auto stripePool = std::atomic_load(&d->stripePool);
+    if (stripePool && stripePool->threadsCount() > 1)
+        stats.threads.push_back({"processing", stripePool->threadSchedulingInfo()});
+
+    // add statistics of the video writer for the current (or last) recording
+    auto vwriter = std::atomic_load(&d->activeWriter);
+    if (vwriter) {
+        const auto vwStats = vwriter->stats();
+        stats.histograms.insert(stats.histograms.end(), vwStats.histograms.begin(), vwStats.histograms.end());
+        stats.gauges.insert(stats.gauges.end(), vwStats.gauges.begin(), vwStats.gauges.end());
+        stats.threads.insert(stats.threads.end(), vwStats.threads.begin(), vwStats.threads.end());
+    }
+
+    return stats;
+}
+
+/**
+ * Current estimate of the mapping between the driver's frame timestamps
+ * and the host clocks.
+ */
+ClockMapping MiniScope::clockMapping() const
+{
+    std::lock_guard<std::mutex> lock(d->clockMutex);
+    return d->clockMapping;
+}
+
+/**
+ * Frame and gap counts of every file slice of the current (or last) recording.
+ */
+std::vector<SliceSummary> MiniScope::recordingSlices() const
+{
+    auto vwriter = std::atomic_load(&d->activeWriter);
+    if (!vwriter)
+        return std::vector<SliceSummary>();
+    return vwriter->sliceSummaries();
+}
+
 void MiniScope::setLed(double value)
 {
     // sanitize value
@@ -515,7 +1228,58 @@ void MiniScope::setLed(double value)
     // NOTE: With V4L, max value seems to be 125 here
     double ledPower = value * 0.8;
     if (d->connected) {
-        d->cam.set(cv::CAP_PROP_HUE, ledPower);
+        d->cam->set(cv::CAP_PROP_HUE, ledPower);
+    }
+}
+
+void MiniScope::queueControl(CameraControl control, double value)
+{
+    // if no acquisition is running, nobody else is talking to the camera
+    // and we can change the setting immediately
+    if ((d->thread == nullptr) || !d->running) {
+        applyControl(control, value);
+        return;
+    }
+
+    // otherwise, the capture thread will apply the setting between two frames.
+    // if there already is a pending change for this control, the new value replaces it
+    std::lock_guard<std::mutex> lock(d->controlMutex);
+    d->pendingControls[control] = value;
+}
+
+void MiniScope::applyControl(CameraControl control, double value)
+{
+    switch (control) {
+    case CameraControl::Exposure:
+        // NOTE: With V4L as backend, 255 seems to be the max value here
+        d->cam->set(cv::CAP_PROP_BRIGHTNESS, value * 2.55);
+        break;
+    case CameraControl::Gain:
+        // NOTE: With V4L as backend, 100 seems to be the max value here
+        d->cam->set(cv::CAP_PROP_GAIN, value);
+        break;
+    case CameraControl::Excitation:
+        setLed(value);
+        break;
+    }
+}
+
+void MiniScope::applyPendingControls(size_t frameNo)
+{
+    std::map<CameraControl, double> controls;
+    {
+        std::lock_guard<std::mutex> lock(d->controlMutex);
+        if (d->pendingControls.empty())
+            return;
+        controls.swap(d->pendingControls);
+    }
+
+    TRACE_SCOPE("apply_controls");
+    const auto onControlApplied = callbackCopy(d->callbackMutex, d->onControlAppliedCallback);
+    for (const auto &ctl : controls) {
+        applyControl(ctl.first, ctl.second);
+        if (onControlApplied)
+            onControlApplied(ctl.first, ctl.second, frameNo);
     }
 }
 
@@ -523,6 +1287,7 @@ void MiniScope::addFrameToBuffer(const cv::Mat &frame)
 {
     std::lock_guard<std::mutex> lock(d->mutex);
     d->frameRing.push_back(frame);
+    d->displayQueueDepth.set(d->frameRing.size());
 }
 
 void MiniScope::captureThread(void* msPtr)
@@ -539,7 +1304,10 @@ void MiniScope::captureThread(void* msPtr)
                 cv::Scalar(255,255,255));
 
     self->d->droppedFramesCount = 0;
+    self->d->frameGapsCount = 0;
+    self->d->missedFramesCount = 0;
     self->d->currentFPS = static_cast<uint>(self->d->fps);
+    self->d->measuredFps = self->d->fps;
 
     // reset errors
     self->d->failed = false;
@@ -548,24 +1316,192 @@ void MiniScope::captureThread(void* msPtr)
     // prepare accumulator image for running average (for dF/F)
     cv::Mat accumulatedMat;
 
+    // the display kernel, and the settings it was selected for
+    DisplayKernel displayKernel;
+    std::tuple<int, BackgroundDiffMethod, bool> displayKernelKey(0, BackgroundDiffMethod::NONE, false);
+
     // prepare for recording
-    std::unique_ptr<VideoWriter> vwriter(new VideoWriter());
+    // The video writer is prepared in the background while we are not recording,
+    // so starting a recording only needs to open the output file. We keep track of
+    // the settings it was prepared with, to redo that work in case they change.
+    using WriterSettings = std::tuple<VideoCodec, VideoContainer, bool, int, int, uint, bool, bool>;
+    std::shared_ptr<VideoWriter> vwriter;
+    std::future<void> vwriterPrepared;
+    WriterSettings vwriterSettings;
+    auto resetWriter = [&]() {
+        vwriter.reset(new VideoWriter());
+        vwriter->setCodec(self->d->videoCodec);
+        vwriter->setContainer(self->d->videoContainer);
+        vwriter->setLossless(self->d->recordLossless);
+        vwriter->setStatsEnabled(self->d->statsEnabled);
+        if (self->d->encoderPool)
+            vwriter->setEncoderPool(self->d->encoderPool);
+        vwriter->setThreadScheduling(self->d->encoderScheduling);
+    };
+    resetWriter();
     auto recordFrames = false;
+    auto awaitFirstRecordedFrame = false;
     auto recordStartTime = steady_hr_clock::now();
     double firstFrameTimestamp = 0.0;
+    auto reportSlices = [&]() {
+        for (const auto &slice : vwriter->sliceSummaries()) {
+            if (slice.gapsCount == 0)
+                continue;
+            self->emitMessage(boost::str(boost::format("Recording slice %1%: %2% gaps, ~%3% of %4% frames missing.")
+                                         % slice.sliceNo % slice.gapsCount % slice.missedFramesCount
+                                         % (slice.framesCount + slice.missedFramesCount)));
+        }
+    };
+
+    // raw frames (and their metadata) from before an external trigger was received,
+    // so a triggered recording can start a bit before the actual trigger edge
+    boost::circular_buffer<std::pair<cv::Mat, FrameMetadata>> preTriggerRing;
+    FrameReduction preTriggerReduction;
+
+    // crop and binning of recorded frames, which only changes between recordings
+    FrameReduction recReduction;
+    TemporalBinner recBinner;
+
+    // frame pacing and framerate estimation
+    auto nextFrameDeadline = steady_hr_clock::now();
+    auto prevFrameHostTime = nextFrameDeadline;
+    double prevFrameTimestamp = 0;
+    double smoothedFrameInterval = 0; // in milliseconds
+    bool havePrevFrame = false;
+    uint freeRunFps = 0; // recording rate used when no nominal framerate is set
+
+    TraceRecorder::setThreadSession(self->d->traceSession);
+    TraceRecorder::setThreadName(boost::str(boost::format("capture (camera %1%)") % self->d->scopeCamId));
+    {
+        // the capture thread also does all display processing, so this covers both
+        const auto info = applyThreadScheduling(self->d->captureScheduling);
+        std::lock_guard<std::mutex> lock(self->d->schedulingMutex);
+        self->d->captureSchedulingInfo = info;
+        if (!self->d->captureScheduling.isDefault())
+            self->emitMessage("Capture thread scheduling: " + info);
+    }
+
+    // recovery from camera failures
+    uint recoveryAttempts = 0;
+    auto recoveryBackoff = RECOVERY_INITIAL_BACKOFF;
+    auto outageStartTime = steady_hr_clock::now();
+    auto resendSettings = false;
+    uint pendingFrameFlags = FRAME_FLAG_NONE;
+
+    // detection of frames lost silently by the driver
+    FrameGapDetector gapDetector;
+    gapDetector.setThreshold(FRAME_GAP_THRESHOLD);
+
+    // mapping of driver timestamps to host time
+    ClockSync clockSync;
+    {
+        std::lock_guard<std::mutex> lock(self->d->clockMutex);
+        self->d->clockMapping = clockSync.mapping();
+    }
+
+    // raw frames for readers in other processes
+    std::unique_ptr<FrameRingWriter> sharedRing;
+    if (!self->d->sharedFrameRingName.empty())
+        sharedRing.reset(new FrameRingWriter(self->d->sharedFrameRingName, self->d->sharedFrameRingSlots));
+
+    // fluorescence traces of the configured ROIs
+    RoiTraces roiTraces;
+    RoiTraceWriter roiTraceWriter;
+    std::shared_ptr<RoiTraceExtractor> prevRoiExtractor;
+    if (!self->d->roiTraceFname.empty()) {
+        if (!roiTraceWriter.open(self->d->roiTraceFname))
+            self->emitMessage(boost::str(boost::format("Unable to open ROI trace file %1%") % self->d->roiTraceFname));
+    }
 
+    // helper threads for processing the rows of a frame in parallel
+    auto stripePool = std::make_shared<StripePool>(self->d->processingThreads);
+    stripePool->setThreadScheduling(self->d->processingScheduling);
+    std::atomic_store(&self->d->stripePool, stripePool);
+
+    // percentile baseline of the displayed frames, which is updated with a decimated
+    // stream of them in a thread of its own
+    PercentileBaseline bgBaseline;
+    std::mutex bgBaselineMutex;
+    cv::Mat bgBaselineFrame;
+    size_t bgFramesCount = 0;
+    FrameWorker bgBaselineWorker("percentile baseline");
+    const auto updateBaseline = [&](const cv::Mat &bgFrame, const FrameMetadata &) {
+        bgBaseline.setPercentile(self->d->bgPercentile);
+        bgBaseline.add(bgFrame, stripePool.get());
+        const auto baseline = bgBaseline.baseline();
+        std::lock_guard<std::mutex> lock(bgBaselineMutex);
+        bgBaselineFrame = baseline;
+    };
+
+    // rigid motion correction, which estimates shifts in a thread of its own.
+    // Recorded frames wait in a queue until the shift of their own is known.
+    // (the worker is declared after everything it uses, so it is stopped before any of it goes away)
+    MotionCorrector motionCorrector;
+    std::ofstream motionLog;
+    std::deque<MotionShift> motionShifts;
+    std::deque<std::tuple<cv::Mat, FrameMetadata, int64_t>> motionRecQueue; // frame, metadata, host time in nsec
+    FrameWorker motionWorker("motion correction");
+    const auto estimateMotion = [&](const cv::Mat &mcFrame, const FrameMetadata &mcMeta) {
+        const auto shift = motionCorrector.estimate(mcFrame, mcMeta.sequence);
+        std::lock_guard<std::mutex> lock(self->d->motionMutex);
+        self->d->motionShift = shift;
+        motionShifts.push_back(shift);
+        if (motionShifts.size() > MOTION_SHIFT_HISTORY)
+            motionShifts.pop_front();
+    };
+    const auto logMotionShift = [&](const FrameMetadata &meta, const MotionShift &shift) {
+        if (motionLog.is_open())
+            motionLog << meta.sequence << "; "
+                      << shift.sequence << "; "
+                      << std::fixed << std::setprecision(3) << shift.dx << "; "
+                      << shift.dy << "; "
+                      << shift.peak << "; "
+                      << shift.valid << "\n";
+    };
+
+    // summary images of the recorded frames, also accumulated in a thread of their own
+    size_t summaryFramesCount = 0;
+    FrameWorker summaryWorker("summary images");
+    const auto addToSummary = [&](const cv::Mat &sumFrame, const FrameMetadata &) {
+        std::lock_guard<std::mutex> lock(self->d->summaryMutex);
+        self->d->summary.add(sumFrame);
+    };
+    const auto saveSummaryImages = [&]() {
+        if (!summaryWorker.running())
+            return;
+        summaryWorker.stop();
+
+        // name the images like the video, without its extension
+        auto fnameBase = self->d->videoFname;
+        if (fnameBase.length() > 4 && fnameBase[fnameBase.length() - 4] == '.')
+            fnameBase = fnameBase.substr(0, fnameBase.length() - 4);
+
+        std::string error;
+        if (!SummaryAccumulator::save(self->summaryImages(), fnameBase, &error))
+            self->emitMessage(boost::str(boost::format("Unable to save summary images: %1%") % error));
+    };
+
+    size_t capturedFramesCount = 0;
     while (self->d->running) {
+        TRACE_SCOPE("capture_cycle");
         cv::Mat frame;
         const auto cycleStartTime = steady_hr_clock::now();
 
+        // apply any camera setting changes that were requested since the last frame,
+        // they will affect the next frame we grab
+        self->applyPendingControls(capturedFramesCount);
+
         // check if we might want to trigger a recording start via external input
         if (self->d->checkRecTrigger) {
-            auto temp = static_cast<int>(self->d->cam.get(cv::CAP_PROP_SATURATION));
+            auto temp = static_cast<int>(self->d->cam->get(cv::CAP_PROP_SATURATION));
 
-            //! std::cout << "GPIO state: " << self->d->cam.get(cv::CAP_PROP_SATURATION) << std::endl;
+            //! std::cout << "GPIO state: " << self->d->cam->get(cv::CAP_PROP_SATURATION) << std::endl;
             if ((temp & TRIG_RECORD_EXT) == TRIG_RECORD_EXT) {
                 if (!self->d->recording) {
                     // start recording
+                    self->d->recordRequestTime = std::chrono::duration_cast<std::chrono::nanoseconds>(cycleStartTime.time_since_epoch()).count();
+                    self->d->recordStartAt = 0;
+                    self->d->recordStopAt = 0;
                     self->d->recording = true;
                 }
             } else {
@@ -574,68 +1510,338 @@ void MiniScope::captureThread(void* msPtr)
             }
         }
 
-        auto status = self->d->cam.grab();
-        double frameTimestamp = self->d->cam.get(cv::CAP_PROP_POS_MSEC); // Driver generated millisecond timestamps
-                                                                        // Note that annoyingly, the driver may force frame 1 to 0.0
-
-        if (!status) {
-            self->fail("Failed to grab frame.");
-            break;
+        const bool statsEnabled = self->d->statsEnabled;
+        StageTimer grabTimer(self->d->grabTime, statsEnabled);
+        bool status;
+        {
+            TRACE_SCOPE("grab");
+            status = self->d->cam->grab();
         }
+        grabTimer.stop();
+        const auto frameHostTime = steady_hr_clock::now();
+        const auto frameRealTime = std::chrono::system_clock::now();
+        double frameTimestamp = self->d->cam->get(cv::CAP_PROP_POS_MSEC); // Driver generated millisecond timestamps
+                                                                        // Note that annoyingly, the driver may force frame 1 to 0.0
 
-        try {
-            status = self->d->cam.retrieve(frame);
-        } catch (const cv::Exception& e) {
-            status = false;
-            std::cerr << "Caught OpenCV exception:" << e.what() << std::endl;
+        if (status) {
+            try {
+                TRACE_SCOPE("retrieve");
+                StageTimer retrieveTimer(self->d->retrieveTime, statsEnabled);
+                status = self->d->cam->retrieve(frame);
+            } catch (const cv::Exception& e) {
+                status = false;
+                std::cerr << "Caught OpenCV exception:" << e.what() << std::endl;
+            }
         }
 
         if (!status) {
-            // terminate recording
-            self->d->recording = false;
-
+            // We failed to get a frame. We keep any ongoing recording open, and first
+            // just try to grab frames again, which is enough for short hiccups. If the camera
+            // keeps failing, we reopen the device, waiting longer between every attempt.
             self->d->droppedFramesCount++;
-            self->emitMessage("Dropped frame.");
-            self->addFrameToBuffer(droppedFrameImage);
-            if (self->d->droppedFramesCount > 0) {
+            recoveryAttempts++;
+            if (recoveryAttempts == 1) {
+                outageStartTime = frameHostTime;
+                recoveryBackoff = RECOVERY_INITIAL_BACKOFF;
+                TRACE_INSTANT("frame_dropped");
+                self->emitMessage("Dropped frame.");
+                self->addFrameToBuffer(droppedFrameImage);
+            }
+
+            if (frameHostTime - outageStartTime > RECOVERY_GIVE_UP_TIME) {
+                self->fail("Camera did not recover from failure. Giving up.");
+                break;
+            }
+
+            std::this_thread::sleep_for(recoveryBackoff);
+            recoveryBackoff = std::min(recoveryBackoff * 2, RECOVERY_MAX_BACKOFF);
+
+            if (recoveryAttempts > RECOVERY_RETRIES_BEFORE_REOPEN) {
+                TRACE_SCOPE("reconnect");
                 self->emitMessage("Reconnecting Miniscope...");
-                self->d->cam.release();
-                self->d->cam.open(self->d->scopeCamId);
+                self->d->cam->release();
+                self->d->cam->open(self->d->scopeCamId);
+                self->d->cam->set(cv::CAP_PROP_SATURATION, SET_CMOS_SETTINGS);
                 self->emitMessage("Miniscope reconnected.");
+
+                // all settings are lost when reopening the device
+                resendSettings = true;
             }
 
-            if (self->d->droppedFramesCount > 80)
-                self->fail("Too many dropped frames. Giving up.");
+            // don't try to catch up on the frames we missed
+            nextFrameDeadline = steady_hr_clock::now();
             continue;
         }
 
+        if (recoveryAttempts > 0) {
+            const auto outageMsec = std::chrono::duration<double, std::milli>(frameHostTime - outageStartTime).count();
+            self->emitMessage(boost::str(boost::format("Camera recovered after %1$.0f ms and %2% failed attempts.") % outageMsec % recoveryAttempts));
+            TRACE_INSTANT("camera_recovered");
+
+            // mark the discontinuity for the next recorded frame
+            pendingFrameFlags |= FRAME_FLAG_AFTER_GAP;
+            resendSettings = true;
+            recoveryAttempts = 0;
+        }
+
+        // check whether frames went missing before this one, by looking at the interval
+        // to the previous frame (this also covers the frames lost during a recovered outage)
+        FrameMetadata frameMeta;
+        frameMeta.sequence = capturedFramesCount;
+        frameMeta.timestamp = frameTimestamp;
+        frameMeta.hostTimestamp = std::chrono::duration<double, std::milli>(frameHostTime.time_since_epoch()).count();
+        gapDetector.setExpectedInterval((self->d->fps > 0)? 1000.0 / self->d->fps : 0);
+        frameMeta.missedFrames = gapDetector.check(frameMeta.timestamp, frameMeta.hostTimestamp);
+        if (frameMeta.missedFrames > 0) {
+            TRACE_INSTANT("frame_gap");
+            pendingFrameFlags |= FRAME_FLAG_DRIVER_GAP;
+        }
+        // the counts may also go down, when the detector found that the camera just runs slower
+        self->d->frameGapsCount = gapDetector.gapCount();
+        self->d->missedFramesCount = gapDetector.missedFramesCount();
+        frameMeta.flags = pendingFrameFlags;
+        pendingFrameFlags = FRAME_FLAG_NONE;
+
+        // refine our estimate of the driver clock's offset and drift, which
+        // the video writer periodically stores next to the frame timestamps
+        const auto realTimeMsec = std::chrono::duration<double, std::milli>(frameRealTime.time_since_epoch()).count();
+        if (clockSync.addSample(frameMeta.timestamp, frameMeta.hostTimestamp, realTimeMsec)) {
+            const auto mapping = clockSync.mapping();
+            {
+                std::lock_guard<std::mutex> lock(self->d->clockMutex);
+                self->d->clockMapping = mapping;
+            }
+            vwriter->setClockMapping(mapping);
+        }
+
+        capturedFramesCount++;
+
+        // publish the frame before any of our own processing, readers waiting for it
+        // are likely more latency-sensitive than the display
+        if (sharedRing) {
+            TRACE_SCOPE("publish_frame");
+            if (!sharedRing->publish(frame, frameMeta)) {
+                self->emitMessage(boost::str(boost::format("Unable to publish frames to shared memory: %1%") % sharedRing->lastError()));
+                sharedRing.reset();
+            }
+        }
+        const auto onFrame = callbackCopy(self->d->callbackMutex, self->d->onFrameCallback);
+        if (onFrame) {
+            TRACE_SCOPE("frame_callback");
+            onFrame(frame, frameMeta);
+        }
+
+        // hand the frame to the motion estimation, and correct it with the latest shift we know of
+        // (which is usually the one of the previous frame) for display and ROI traces
+        const bool delayRecording = self->d->motionCorrection && self->d->motionCorrectRecording;
+        cv::Mat correctedFrame;
+        if (self->d->motionCorrection) {
+            if (!motionWorker.running()) {
+                motionCorrector.reset();
+                if (!self->d->motionLogFname.empty() && !motionLog.is_open()) {
+                    motionLog.open(self->d->motionLogFname);
+                    motionLog << "frame; shift_frame; dx; dy; peak; valid" << "\n";
+                }
+                motionWorker.start(estimateMotion);
+            }
+            motionWorker.submit(frame, frameMeta);
+
+            const auto shift = self->motionShift();
+            if (shift.valid) {
+                TRACE_SCOPE("motion_apply");
+                MotionCorrector::apply(frame, correctedFrame, shift);
+            }
+            // recorded frames are logged once they got their own shift
+            if (!delayRecording)
+                logMotionShift(frameMeta, shift);
+        } else if (motionWorker.running()) {
+            motionWorker.stop();
+            std::lock_guard<std::mutex> lock(self->d->motionMutex);
+            self->d->motionShift = MotionShift();
+            motionShifts.clear();
+        }
+        const auto &alignedFrame = correctedFrame.empty()? frame : correctedFrame;
+
+        // the frame we record in this cycle. When recording motion corrected frames,
+        // that is the oldest frame whose own shift is known by now, which may be none.
+        cv::Mat recordedFrame = frame;
+        auto recMeta = frameMeta;
+        auto recHostNsec = std::chrono::duration_cast<std::chrono::nanoseconds>(frameHostTime.time_since_epoch()).count();
+        bool haveRecFrame = true;
+        if (delayRecording) {
+            motionRecQueue.emplace_back(frame, frameMeta, recHostNsec);
+
+            const auto seq = std::get<1>(motionRecQueue.front()).sequence;
+            MotionShift recShift;
+            bool shiftKnown = false;
+            {
+                std::lock_guard<std::mutex> lock(self->d->motionMutex);
+                // the worker skips frames when it falls behind, those get the shift of the next one it saw
+                while (!motionShifts.empty() && (motionShifts.front().sequence < seq))
+                    motionShifts.pop_front();
+                if (!motionShifts.empty()) {
+                    recShift = motionShifts.front();
+                    shiftKnown = true;
+                } else if (motionRecQueue.size() > MOTION_RECORD_MAX_DELAY) {
+                    recShift = self->d->motionShift;
+                    shiftKnown = true;
+                }
+            }
+
+            haveRecFrame = shiftKnown;
+            if (haveRecFrame) {
+                recordedFrame = std::get<0>(motionRecQueue.front());
+                recMeta = std::get<1>(motionRecQueue.front());
+                recHostNsec = std::get<2>(motionRecQueue.front());
+                motionRecQueue.pop_front();
+                if (recShift.valid) {
+                    TRACE_SCOPE("motion_apply_recorded");
+                    cv::Mat correctedRecFrame;
+                    MotionCorrector::apply(recordedFrame, correctedRecFrame, recShift);
+                    recordedFrame = correctedRecFrame;
+                }
+                logMotionShift(recMeta, recShift);
+            }
+        } else if (!motionRecQueue.empty()) {
+            // frames still waiting when the correction of recorded frames was switched off are lost
+            motionRecQueue.clear();
+        }
+
+        auto roiExtractor = std::atomic_load(&self->d->roiExtractor);
+        if (roiExtractor) {
+            TRACE_SCOPE("roi_traces");
+            StageTimer roiTimer(self->d->roiTraceTime, statsEnabled);
+            if (self->d->fps > 0)
+                roiExtractor->setBaselineFrames(static_cast<uint>(self->d->roiBaselineWindow * self->d->fps));
+
+            if (roiExtractor->process(alignedFrame, frameMeta, &roiTraces)) {
+                roiTimer.stop();
+                if (roiTraceWriter.isOpen())
+                    roiTraceWriter.write(roiTraces);
+                const auto onRoiTraces = callbackCopy(self->d->callbackMutex, self->d->onRoiTracesCallback);
+                if (onRoiTraces)
+                    onRoiTraces(roiTraces);
+            } else if (roiExtractor != prevRoiExtractor) {
+                // report a problem only once for every ROI set
+                self->emitMessage(boost::str(boost::format("Unable to extract ROI traces: %1%") % roiExtractor->lastError()));
+            }
+            prevRoiExtractor = roiExtractor;
+        }
+
+        // estimate the actual framerate from the intervals between driver timestamps, or
+        // from our own clock in case the driver did not provide a usable timestamp
+        if (havePrevFrame) {
+            auto interval = std::chrono::duration<double, std::milli>(frameHostTime - prevFrameHostTime).count();
+            if ((prevFrameTimestamp > 0) && (frameTimestamp > prevFrameTimestamp))
+                interval = frameTimestamp - prevFrameTimestamp;
+
+            smoothedFrameInterval = (smoothedFrameInterval <= 0)?
+                        interval : FPS_SMOOTHING_ALPHA * interval + (1 - FPS_SMOOTHING_ALPHA) * smoothedFrameInterval;
+            if (smoothedFrameInterval > 0) {
+                self->d->measuredFps = 1000.0 / smoothedFrameInterval;
+                self->d->currentFPS = static_cast<uint>(std::lround(self->d->measuredFps));
+            }
+
+            if (statsEnabled) {
+                const std::chrono::duration<double, std::milli> intervalMsec(interval);
+                self->d->frameIntervalTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(intervalMsec));
+                if (self->d->fps > 0) {
+                    const std::chrono::duration<double, std::milli> jitterMsec(std::abs(interval - 1000.0 / self->d->fps));
+                    self->d->frameJitterTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(jitterMsec));
+                }
+            }
+        }
+        prevFrameHostTime = frameHostTime;
+        prevFrameTimestamp = frameTimestamp;
+        havePrevFrame = true;
+
         // check if we are too slow, resend settings in case we are
         // NOTE: This behaviour was copied from the original Miniscope DAQ software
-        if ((self->d->droppedFramesCount > 0) || (self->d->currentFPS < self->d->fps / 2.0)) {
+        if (resendSettings || (self->d->currentFPS < self->d->fps / 2.0)) {
+            TRACE_INSTANT("settings_resend");
             self->emitMessage("Sending settings again.");
-            self->setExposure(self->d->exposure);
-            self->setGain(self->d->gain);
-            self->setExcitation(self->d->excitation);
-            self->d->droppedFramesCount = 0;
+            {
+                std::lock_guard<std::mutex> lock(self->d->controlMutex);
+                self->d->pendingControls[CameraControl::Exposure] = self->d->exposure;
+                self->d->pendingControls[CameraControl::Gain] = self->d->gain;
+                self->d->pendingControls[CameraControl::Excitation] = self->d->excitation;
+            }
+            resendSettings = false;
         }
 
+        if (!recordFrames)
+            recReduction = self->recordingReduction();
+        const auto recSize = reducedFrameSize(recReduction, frame.size());
+        const auto recHasColor = (frame.channels() == 3) && !recReduction.deepPixels;
+
+        // a free-running camera (fps 0) has no nominal rate, so we record at the measured one.
+        // The value only follows the measurement while we are not recording and when it moved
+        // by a whole frame per second, so the writer settings stay stable.
+        auto sourceFps = static_cast<uint>(self->d->fps);
+        if (sourceFps == 0) {
+            if (!recordFrames && (smoothedFrameInterval > 0)
+                && ((freeRunFps == 0) || (std::abs(self->d->measuredFps - freeRunFps) >= 1.0)))
+                freeRunFps = std::max(1u, static_cast<uint>(std::lround(self->d->measuredFps)));
+            sourceFps = freeRunFps;
+        }
+        auto recFps = sourceFps;
+        if (recFps > 0 && recReduction.temporalBinning > 1)
+            recFps = std::max(1u, static_cast<uint>(std::lround(static_cast<double>(recFps) / recReduction.temporalBinning)));
+        const WriterSettings currentWriterSettings(self->d->videoCodec,
+                                                   self->d->videoContainer,
+                                                   self->d->recordLossless,
+                                                   recSize.width,
+                                                   recSize.height,
+                                                   recFps,
+                                                   recHasColor,
+                                                   recReduction.deepPixels);
+
+        // recordings may be scheduled to start or stop at a certain time, which keeps
+        // the recordings of several devices aligned to the same frame times
+        if (haveRecFrame && (self->d->recordStopAt > 0) && (recHostNsec >= self->d->recordStopAt)) {
+            self->d->recording = false;
+            self->d->recordStopAt = 0;
+        }
+        // without a known framerate we can not set up the encoder, so recording only starts
+        // once the framerate of a free-running camera has been measured
+        const auto recordThisFrame = haveRecFrame && self->recording() && (recHostNsec >= self->d->recordStartAt) && (recFps > 0);
+
+        cv::Mat reducedFrame;
+        if (haveRecFrame && !recReduction.isSpatialIdentity() && (recordThisFrame || preTriggerRing.capacity() > 0)) {
+            TRACE_SCOPE("reduce_frame");
+            if (!reduceFrame(recordedFrame, reducedFrame, recReduction, stripePool.get()) && recordThisFrame) {
+                self->fail("Unable to crop or bin the frames to record. Is the crop region inside the frame?");
+                break;
+            }
+        }
+        const auto &encodedFrame = recReduction.isSpatialIdentity()? recordedFrame : reducedFrame;
+
         // prepare video recording if it was enabled while we were running
-        if (self->recording()) {
-            if (!vwriter->initialized()) {
+        if (recordThisFrame) {
+            if (!recordFrames) {
                 self->emitMessage("Recording enabled.");
                 // we want to record, but are not initialized yet
+
+                // wait for the writer to be prepared, in case that is still in progress.
+                // if preparing it failed, initializing it will raise the error again.
+                if (vwriterPrepared.valid()) {
+                    try {
+                        vwriterPrepared.get();
+                    } catch (const std::exception&) {}
+                }
+                if (vwriterSettings != currentWriterSettings)
+                    resetWriter();
                 vwriter->setFileSliceInterval(self->d->recordingSliceInterval);
-                vwriter->setCodec(self->d->videoCodec);
-                vwriter->setContainer(self->d->videoContainer);
-                vwriter->setLossless(self->d->recordLossless);
+                vwriter->setHighBitDepth(recReduction.deepPixels);
+                std::atomic_store(&self->d->activeWriter, vwriter);
 
                 try {
                     vwriter->initialize(self->d->videoFname,
-                                        frame.cols,
-                                        frame.rows,
-                                        static_cast<int>(self->d->fps),
-                                        frame.channels() == 3);
-                } catch (const cv::Exception& e) {
+                                        recSize.width,
+                                        recSize.height,
+                                        static_cast<int>(recFps),
+                                        recHasColor);
+                } catch (const std::exception& e) {
                     self->fail(boost::str(boost::format("Unable to initialize recording: %1%") % e.what()));
                     break;
                 }
@@ -643,93 +1849,238 @@ void MiniScope::captureThread(void* msPtr)
                 // we are set for recording and initialized the video writer,
                 // so we allow recording frames now
                 recordFrames = true;
+                awaitFirstRecordedFrame = true;
+                if (self->d->summaryImagesEnabled) {
+                    {
+                        std::lock_guard<std::mutex> lock(self->d->summaryMutex);
+                        self->d->summary.reset();
+                    }
+                    summaryFramesCount = 0;
+                    summaryWorker.start(addToSummary);
+                }
+                TRACE_INSTANT("recording_started");
                 self->emitMessage("Initialized video recording.");
                 recordStartTime = steady_hr_clock::now();
-                firstFrameTimestamp = frameTimestamp; // Hopefully not 0 if we displayed a few frames first!
+                firstFrameTimestamp = recMeta.timestamp; // Hopefully not 0 if we displayed a few frames first!
+
+                // flush the frames we kept from before the trigger, so the video starts
+                // the selected amount of time before the trigger edge
+                recBinner.reset(recReduction.temporalBinning, recReduction.binningMode);
+                if (!preTriggerRing.empty()) {
+                    firstFrameTimestamp = preTriggerRing.front().second.timestamp;
+                    bool pushFailed = false;
+                    for (const auto &tf : preTriggerRing) {
+                        if (!recBinner.add(tf.first, tf.second, stripePool.get()))
+                            continue;
+                        if (!vwriter->pushFrame(recBinner.frame(), recBinner.metadata())) {
+                            pushFailed = true;
+                            break;
+                        }
+                    }
+                    if (pushFailed) {
+                        self->fail(boost::str(boost::format("Unable to send frames to encoder: %1%") % vwriter->lastError()));
+                        break;
+                    }
+                    self->emitMessage(boost::str(boost::format("Added %1% pre-trigger frames to recording.") % preTriggerRing.size()));
+                    preTriggerRing.clear();
+                }
             }
-        } else {
+        } else if (haveRecFrame) {
             // we are not recording or stopped recording
             if (recordFrames) {
                 // we were recording previously, so finalize the movie and stop adding
                 // new frames to the video.
                 // Also reset the video writer for a clean start
                 vwriter->finalize();
-                vwriter.reset(new VideoWriter());
+                reportSlices();
+                resetWriter();
+                vwriterSettings = WriterSettings();
+                saveSummaryImages();
                 recordFrames = false;
+                TRACE_INSTANT("recording_finalized");
                 self->emitMessage("Recording finalized.");
                 self->d->lastRecordedFrameTime = 0.0; // reset to 0.0 milliseconds
             }
-        }
 
-        // "frame" is the frame that we record to disk, while the "displayFrame"
-        // is the one that we may also record as a video file
-        cv::Mat displayFrame;
-        frame.copyTo(displayFrame);
-
-        // calculate various background differences, if selected
-        if (accumulatedMat.rows == 0)
-            accumulatedMat = cv::Mat::zeros(frame.rows, frame.cols, CV_32FC(frame.channels()));
-
-        cv::Mat displayF32;
-        displayFrame.convertTo(displayF32, CV_32F, 1.0 / 255.0);
-        cv::accumulateWeighted(displayF32, accumulatedMat, self->d->bgAccumulateAlpha);
-        if (self->d->bgDiffMethod == BackgroundDiffMethod::DIVISION) {
-            cv::Mat tmpMat;
-            cv::divide(displayF32, accumulatedMat, tmpMat, 1, CV_32FC(frame.channels()));
-            tmpMat.convertTo(displayFrame, displayFrame.type(), 250.0);
-        } else if (self->d->bgDiffMethod == BackgroundDiffMethod::SUBTRACTION) {
-            cv::Mat tmpBgMat;
-            accumulatedMat.convertTo(tmpBgMat, CV_8UC1, 255.0);
-            cv::subtract(displayFrame, tmpBgMat, displayFrame);
+            // prepare the writer for the next recording while we are idle
+            if (vwriterPrepared.valid() && (vwriterPrepared.wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+                try {
+                    vwriterPrepared.get();
+                } catch (const std::exception& e) {
+                    self->emitMessage(boost::str(boost::format("Unable to prepare video writer in advance: %1%") % e.what()));
+                }
+            }
+            if (!vwriterPrepared.valid() && (recFps > 0) && (vwriterSettings != currentWriterSettings)) {
+                resetWriter();
+                vwriterSettings = currentWriterSettings;
+
+                auto vw = vwriter.get();
+                vw->setHighBitDepth(std::get<7>(currentWriterSettings));
+                vwriterPrepared = std::async(std::launch::async, [vw, currentWriterSettings]() {
+                    vw->prepare(std::get<3>(currentWriterSettings),
+                                std::get<4>(currentWriterSettings),
+                                static_cast<int>(std::get<5>(currentWriterSettings)),
+                                std::get<6>(currentWriterSettings));
+                });
+            }
+
+            // keep the most recent raw frames around in case an external trigger
+            // starts a recording soon
+            const auto preTriggerCapacity = self->d->checkRecTrigger?
+                        std::min(static_cast<size_t>(std::ceil(self->d->preTriggerBufferTime * sourceFps)), PRE_TRIGGER_MAX_FRAMES) : 0;
+            if (preTriggerRing.capacity() != preTriggerCapacity)
+                preTriggerRing.set_capacity(preTriggerCapacity);
+            if (preTriggerReduction != recReduction) {
+                preTriggerRing.clear();
+                preTriggerReduction = recReduction;
+            }
+            if (preTriggerCapacity > 0 && !encodedFrame.empty())
+                preTriggerRing.push_back(std::make_pair(encodedFrame, recMeta));
         }
 
-        if (self->d->useColor) {
-            // we want a colored image
-            if (self->d->showRed || self->d->showGreen || self->d->showBlue) {
-                cv::Mat bgrChannels[3];
-                cv::split(displayFrame, bgrChannels);
+        // headless users have no use for the display frame, so we can skip all the work on it
+        if (self->d->displayEnabled) {
+            // "frame" is the frame that we record to disk, while the "displayFrame"
+            // is the one that we may also record as a video file
+            StageTimer processTimer(self->d->processTime, statsEnabled);
+            cv::Mat sourceFrame = alignedFrame;
+            const auto dispReduction = self->displayReduction();
+            if (!dispReduction.isIdentity()) {
+                cv::Mat reducedDisplayFrame;
+                if (reduceFrame(alignedFrame, reducedDisplayFrame, dispReduction, stripePool.get()))
+                    sourceFrame = reducedDisplayFrame;
+            }
+            const auto grayscale = !self->d->useColor;
+
+            // the percentile baseline is updated in the background, from every few frames
+            auto bgDiffMethod = self->d->bgDiffMethod.load();
+            cv::Mat baseline;
+            if (bgDiffMethod == BackgroundDiffMethod::PERCENTILE) {
+                if (!bgBaselineWorker.running()) {
+                    bgBaseline.reset();
+                    bgBaselineFrame = cv::Mat();
+                    bgFramesCount = 0;
+                    bgBaselineWorker.start(updateBaseline);
+                }
+                const double rate = (self->d->fps > 0)? self->d->fps : self->d->measuredFps;
+                const auto sampleInterval = std::max(1L, std::lround(self->d->bgPercentileWindow * rate / PercentileBaseline::SAMPLES));
+                if (bgFramesCount++ % static_cast<size_t>(sampleInterval) == 0) {
+                    // the baseline of grayscale images only needs a third of the memory and time
+                    cv::Mat sample;
+                    if (grayscale && sourceFrame.channels() == 3)
+                        cv::cvtColor(sourceFrame, sample, cv::COLOR_BGR2GRAY);
+                    else
+                        sample = sourceFrame.clone();
+                    bgBaselineWorker.submit(sample, frameMeta);
+                }
 
-                if (!self->d->showBlue)
-                    bgrChannels[0] = cv::Mat::zeros(displayFrame.rows, displayFrame.cols, CV_8UC1);
-                if (!self->d->showGreen)
-                    bgrChannels[1] = cv::Mat::zeros(displayFrame.rows, displayFrame.cols, CV_8UC1);
-                if (!self->d->showRed)
-                    bgrChannels[2] = cv::Mat::zeros(displayFrame.rows, displayFrame.cols, CV_8UC1);
+                {
+                    std::lock_guard<std::mutex> lock(bgBaselineMutex);
+                    baseline = bgBaselineFrame;
+                }
+                const auto baselineChannels = (grayscale)? 1 : sourceFrame.channels();
+                if ((baseline.size() != sourceFrame.size()) || (baseline.channels() != baselineChannels))
+                    bgDiffMethod = BackgroundDiffMethod::NONE; // no baseline yet
+            } else if (bgBaselineWorker.running()) {
+                bgBaselineWorker.stop();
+            }
 
-                cv::merge(bgrChannels, 3, displayFrame);
+            // select the kernel for the current display settings, only if they changed
+            const auto kernelKey = std::make_tuple(sourceFrame.channels(), bgDiffMethod, grayscale);
+            if (kernelKey != displayKernelKey) {
+                displayKernel = selectDisplayKernel(sourceFrame.channels(), bgDiffMethod, grayscale);
+                displayKernelKey = kernelKey;
+            }
+            if (!displayKernel) {
+                self->fail("Unable to display frames with this number of channels.");
+                break;
             }
-         } else {
-            // grayscale image
-            cv::cvtColor(displayFrame, displayFrame, cv::COLOR_BGR2GRAY);
 
-            double minF, maxF;
-            cv::minMaxLoc(displayFrame, &minF, &maxF);
-            self->d->minFluor = static_cast<int>(minF);
-            self->d->maxFluor = static_cast<int>(maxF);
+            DisplayKernelParams kernelParams;
+            kernelParams.alpha = static_cast<float>(self->d->bgAccumulateAlpha);
+            const auto displayRange = std::max(1, self->d->maxFluorDisplay - self->d->minFluorDisplay);
+            kernelParams.scale = 255.0f / displayRange;
+            kernelParams.offset = -self->d->minFluorDisplay * kernelParams.scale;
+            // no channel selected shows all of them
+            const auto showAll = !(self->d->showRed || self->d->showGreen || self->d->showBlue);
+            kernelParams.channelMask[0] = (showAll || self->d->showBlue)? 0xFF : 0;
+            kernelParams.channelMask[1] = (showAll || self->d->showGreen)? 0xFF : 0;
+            kernelParams.channelMask[2] = (showAll || self->d->showRed)? 0xFF : 0;
+
+            cv::Mat displayFrame;
+            DisplayKernelResult kernelResult;
+            displayKernel(sourceFrame, displayFrame, accumulatedMat, baseline, kernelParams, &kernelResult, stripePool.get());
+            if (grayscale) {
+                self->d->minFluor = kernelResult.minValue;
+                self->d->maxFluor = kernelResult.maxValue;
+            }
 
-            displayFrame.convertTo(displayFrame, CV_8U, 255.0 / (self->d->maxFluorDisplay - self->d->minFluorDisplay), -self->d->minFluorDisplay * 255.0 / (self->d->maxFluorDisplay - self->d->minFluorDisplay));
+            // add display frame to ringbuffer, and record the raw
+            // frame to disk if we want to record it.
+            processTimer.stop();
+            StageTimer displayEnqueueTimer(self->d->displayEnqueueTime, statsEnabled);
+            self->addFrameToBuffer(displayFrame);
+            displayEnqueueTimer.stop();
         }
-
-        // add display frame to ringbuffer, and record the raw
-        // frame to disk if we want to record it.
-        self->addFrameToBuffer(displayFrame);
-        if (recordFrames) {
-            if (!vwriter->pushFrame(frame, frameTimestamp))
-                self->fail(boost::str(boost::format("Unable to send frames to encoder: %1%") % vwriter->lastError()));
-            self->d->lastRecordedFrameTime = frameTimestamp - firstFrameTimestamp;
+        if (recordFrames && haveRecFrame) {
+            // with temporal binning, only every few frames completes one we can record
+            if (recBinner.add(encodedFrame, recMeta, stripePool.get())) {
+                const auto binnedFrame = recBinner.frame();
+                const auto binnedMeta = recBinner.metadata();
+
+                StageTimer recordEnqueueTimer(self->d->recordEnqueueTime, statsEnabled);
+                if (!vwriter->pushFrame(binnedFrame, binnedMeta))
+                    self->fail(boost::str(boost::format("Unable to send frames to encoder: %1%") % vwriter->lastError()));
+                recordEnqueueTimer.stop();
+
+                if (summaryWorker.running() && (summaryFramesCount++ % self->d->summaryFrameStride == 0))
+                    summaryWorker.submit(binnedFrame, binnedMeta);
+            }
+            self->d->lastRecordedFrameTime = recMeta.timestamp - firstFrameTimestamp;
+
+            if (awaitFirstRecordedFrame) {
+                const auto requestTime = std::chrono::nanoseconds(self->d->recordRequestTime);
+                const auto latency = steady_hr_clock::now().time_since_epoch() - requestTime;
+                self->d->recordStartLatency = std::chrono::duration<double, std::milli>(latency).count();
+                self->emitMessage(boost::str(boost::format("Recording started, latency: %1$.2f ms") % self->d->recordStartLatency));
+                awaitFirstRecordedFrame = false;
+            }
         }
 
-        // wait a bit if necessary, to keep the right framerate
-        const auto cycleTime = std::chrono::duration_cast<std::chrono::milliseconds>(steady_hr_clock::now() - cycleStartTime);
-        const auto extraWaitTime = std::chrono::milliseconds((1000 / self->d->fps) - cycleTime.count());
-        if (extraWaitTime.count() > 0)
-            std::this_thread::sleep_for(extraWaitTime);
-
-        const auto totalTime = std::chrono::duration_cast<std::chrono::milliseconds>(steady_hr_clock::now() - cycleStartTime);
-        self->d->currentFPS = static_cast<uint>(1 / (totalTime.count() / static_cast<double>(1000)));
+        // wait until the next frame is due, to keep the right framerate.
+        // if the framerate is set to zero, we are paced by the driver's blocking grab alone.
+        const uint fps = self->d->fps;
+        if (fps > 0) {
+            const auto framePeriod = std::chrono::duration_cast<steady_hr_clock::duration>(std::chrono::duration<double>(1.0 / fps));
+            const auto now = steady_hr_clock::now();
+            nextFrameDeadline += framePeriod;
+            if (nextFrameDeadline + framePeriod < now) {
+                // we fell behind by more than a frame, don't try to catch up with a burst of frames
+                nextFrameDeadline = now;
+            } else if (nextFrameDeadline > now) {
+                std::this_thread::sleep_until(nextFrameDeadline);
+
+                // how late we woke up is what real-time scheduling should improve
+                if (statsEnabled)
+                    self->d->wakeupLatencyTime.recordSince(nextFrameDeadline);
+            }
+        } else {
+            nextFrameDeadline = steady_hr_clock::now();
+        }
     }
 
+    // don't lose settings that were changed just before we stopped
+    self->applyPendingControls(capturedFramesCount);
+
     // finalize recording (if there was any still ongoing)
+    if (vwriterPrepared.valid())
+        vwriterPrepared.wait();
     vwriter->finalize();
+    if (recordFrames)
+        reportSlices();
+    saveSummaryImages();
     self->d->lastRecordedFrameTime = 0.0;
+
+    // the pool's threads go away with the last reference, once the workers using it stopped
+    std::atomic_store(&self->d->stripePool, std::shared_ptr<StripePool>());
 }
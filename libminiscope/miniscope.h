@@ -24,20 +24,29 @@
 #include <functional>
 #include <opencv2/core.hpp>
 
+#include "msexport.h"
 #include "videowriter.h"
-
-#ifdef _WIN32
-#define MS_LIB_EXPORT __declspec(dllexport)
-#else
-#define MS_LIB_EXPORT __attribute__((visibility("default")))
-#endif
+#include "mstypes.h"
 
 enum class BackgroundDiffMethod {
     NONE,
     SUBTRACTION,
-    DIVISION
+    DIVISION,
+    PERCENTILE      // divide by a running low percentile of every pixel
+};
+
+/**
+ * @brief Camera settings which are sent to the device
+ */
+enum class CameraControl {
+    Exposure,
+    Gain,
+    Excitation
 };
 
+class FrameSource;
+class EncoderPool;
+
 class MiniScopeData;
 class MS_LIB_EXPORT MiniScope
 {
@@ -46,6 +55,8 @@ public:
     ~MiniScope();
 
     void setScopeCamId(int id);
+    void setFrameSource(std::shared_ptr<FrameSource> source);
+    void setEncoderPool(std::shared_ptr<EncoderPool> pool);
 
     void setExposure(double value);
     double exposure() const;
@@ -62,13 +73,31 @@ public:
     bool run();
     void stop();
     bool startRecording(const std::string& fname = "");
+    bool startRecording(const std::string& fname, const steady_hr_clock::time_point &startTime);
     void stopRecording();
+    void stopRecording(const steady_hr_clock::time_point &stopTime);
 
     bool running() const;
     bool recording() const;
 
     void setOnMessage(std::function<void(const std::string&)> callback);
 
+    /**
+     * Set a function to be called from the capture thread whenever a changed
+     * camera setting was sent to the device. It receives the control, its new value
+     * and the number of the first frame (counted from the start of acquisition)
+     * that was grabbed after the change.
+     */
+    void setOnControlApplied(std::function<void(CameraControl, double, size_t)> callback);
+
+    /**
+     * Set a function to be called from the capture thread with every raw frame
+     * and its metadata, before the frame is processed for display or recording.
+     * The frame is never modified or reused afterwards, so it may be kept.
+     * The capture thread waits for the function, so it must return quickly.
+     */
+    void setOnFrame(std::function<void(const cv::Mat&, const FrameMetadata&)> callback);
+
     bool useColor() const;
     void setUseColor(bool color);
 
@@ -78,8 +107,13 @@ public:
     bool showBlueChannel() const;
 
     cv::Mat currentFrame();
+    bool displayEnabled() const;
+    void setDisplayEnabled(bool enabled);
     uint currentFPS() const;
+    double measuredFps() const;
     size_t droppedFramesCount() const;
+    size_t frameGapsCount() const;
+    size_t missedFramesCount() const;
 
     uint fps() const;
     void setFps(uint fps);
@@ -87,6 +121,9 @@ public:
     bool externalRecordTrigger() const;
     void setExternalRecordTrigger(bool enabled);
 
+    double preTriggerBufferTime() const;
+    void setPreTriggerBufferTime(double seconds);
+
     std::string videoFilename() const;
     void setVideoFilename(const std::string& fname);
 
@@ -113,6 +150,10 @@ public:
 
     double bgAccumulateAlpha() const;
     void setBgAccumulateAlpha(double value);
+    double bgPercentile() const;
+    void setBgPercentile(double percentile);
+    double bgPercentileWindow() const;
+    void setBgPercentileWindow(double seconds);
 
     uint recordingSliceInterval() const;
     void setRecordingSliceInterval(uint minutes);
@@ -120,11 +161,79 @@ public:
     std::string lastError() const;
 
     double lastRecordedFrameTime() const;
+    double recordStartLatency() const;
+    std::vector<SliceSummary> recordingSlices() const;
+    ClockMapping clockMapping() const;
+
+    std::string traceFile() const;
+    void setTraceFile(const std::string &fname);
+
+    /**
+     * Publish all raw frames into a POSIX shared-memory ring of this name, so other
+     * processes can read them with a FrameRingReader. Takes effect when the
+     * acquisition is started, an empty name disables publishing.
+     */
+    std::string sharedFrameRingName() const;
+    void setSharedFrameRingName(const std::string &name);
+    uint sharedFrameRingSlots() const;
+    void setSharedFrameRingSlots(uint slots);
+
+    /**
+     * Extract the fluorescence of these ROIs from every frame. Each footprint is
+     * a mask or weight map of the frame size. Can be changed while running.
+     */
+    bool setRois(const std::vector<cv::Mat> &footprints);
+    void clearRois();
+    size_t roisCount() const;
+    double roiBaselineWindow() const;
+    void setRoiBaselineWindow(double seconds);
+    std::string roiTraceFile() const;
+    void setRoiTraceFile(const std::string &fname);
+    void setOnRoiTraces(std::function<void(const RoiTraces&)> callback);
+
+    bool motionCorrection() const;
+    void setMotionCorrection(bool enabled);
+    bool motionCorrectRecording() const;
+    void setMotionCorrectRecording(bool enabled);
+    std::string motionLogFile() const;
+    void setMotionLogFile(const std::string &fname);
+    MotionShift motionShift() const;
+
+    bool summaryImagesEnabled() const;
+    void setSummaryImagesEnabled(bool enabled);
+    uint summaryFrameStride() const;
+    void setSummaryFrameStride(uint stride);
+    SummaryImages summaryImages() const;
+
+    FrameReduction recordingReduction() const;
+    void setRecordingReduction(const FrameReduction &reduction);
+    FrameReduction displayReduction() const;
+    void setDisplayReduction(const FrameReduction &reduction);
+
+    ThreadSchedulingOptions captureScheduling() const;
+    void setCaptureScheduling(const ThreadSchedulingOptions &options);
+
+    ThreadSchedulingOptions encoderScheduling() const;
+    void setEncoderScheduling(const ThreadSchedulingOptions &options);
+
+    uint processingThreads() const;
+    void setProcessingThreads(uint threads);
+    ThreadSchedulingOptions processingScheduling() const;
+    void setProcessingScheduling(const ThreadSchedulingOptions &options);
+
+    bool statsEnabled() const;
+    void setStatsEnabled(bool enabled);
+    void resetStats();
+    PipelineStats stats() const;
 
 private:
     std::unique_ptr<MiniScopeData> d;
 
     void setLed(double value);
+    void queueControl(CameraControl control, double value);
+    void applyControl(CameraControl control, double value);
+    void applyPendingControls(size_t frameNo);
+    bool beginRecording(const std::string &fname, int64_t requestTime, int64_t startAt);
     void addFrameToBuffer(const cv::Mat& frame);
     static void captureThread(void *msPtr);
     void startCaptureThread();
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "miniscopemanager.h"
+
+#include <mutex>
+#include <boost/format.hpp>
+
+#include "encoderpool.h"
+#include "framesource.h"
+
+#pragma GCC diagnostic ignored "-Wpadded"
+class MiniScopeManagerData
+{
+public:
+    MiniScopeManagerData()
+        : recording(false),
+          lastFramesEncoded(0)
+    {
+    }
+
+    mutable std::mutex mutex;
+    std::vector<std::shared_ptr<MiniScope>> scopes;
+    std::shared_ptr<EncoderPool> encoderPool;
+    bool recording;
+
+    uint64_t lastFramesEncoded;
+    steady_hr_clock::time_point lastThroughputTime;
+
+    std::string lastError;
+};
+#pragma GCC diagnostic pop
+
+/**
+ * Create a new manager, with the given number of encoder threads shared
+ * by all devices. If zero, one thread per CPU core is used.
+ */
+MiniScopeManager::MiniScopeManager(uint encoderThreads)
+    : d(new MiniScopeManagerData())
+{
+    d->encoderPool = std::make_shared<EncoderPool>(encoderThreads);
+    d->lastThroughputTime = steady_hr_clock::now();
+}
+
+MiniScopeManager::~MiniScopeManager()
+{
+    // the devices must finish their recordings before the encoder pool goes away
+    disconnect();
+    d->scopes.clear();
+}
+
+std::shared_ptr<MiniScope> MiniScopeManager::addScopeInternal(std::shared_ptr<MiniScope> scope)
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    scope->setEncoderPool(d->encoderPool);
+    d->scopes.push_back(scope);
+    return scope;
+}
+
+/**
+ * Add the Miniscope camera with the given ID.
+ */
+std::shared_ptr<MiniScope> MiniScopeManager::addScope(int camId)
+{
+    auto scope = std::make_shared<MiniScope>();
+    scope->setScopeCamId(camId);
+    return addScopeInternal(scope);
+}
+
+/**
+ * Add a device acquiring frames from a custom source,
+ * e.g. a SyntheticFrameSource for testing.
+ */
+std::shared_ptr<MiniScope> MiniScopeManager::addScope(std::shared_ptr<FrameSource> source)
+{
+    auto scope = std::make_shared<MiniScope>();
+    scope->setScopeCamId(static_cast<int>(scopesCount()));
+    scope->setFrameSource(source);
+    return addScopeInternal(scope);
+}
+
+std::vector<std::shared_ptr<MiniScope>> MiniScopeManager::scopes() const
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    return d->scopes;
+}
+
+size_t MiniScopeManager::scopesCount() const
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    return d->scopes.size();
+}
+
+bool MiniScopeManager::connect()
+{
+    for (const auto &scope : scopes()) {
+        if (!scope->connect()) {
+            d->lastError = "Unable to connect all devices.";
+            return false;
+        }
+    }
+    return true;
+}
+
+void MiniScopeManager::disconnect()
+{
+    for (const auto &scope : scopes())
+        scope->disconnect();
+    d->recording = false;
+}
+
+bool MiniScopeManager::run()
+{
+    for (const auto &scope : scopes()) {
+        if (scope->running())
+            continue;
+        if (!scope->run()) {
+            d->lastError = scope->lastError();
+            return false;
+        }
+    }
+    return true;
+}
+
+void MiniScopeManager::stop()
+{
+    for (const auto &scope : scopes())
+        scope->stop();
+    d->recording = false;
+}
+
+/**
+ * Start recording on all devices, beginning with the first frame every device grabs
+ * after this call. Every device records to its own file, named after the given base
+ * name and the device's index. Either all devices start recording, or none does.
+ */
+bool MiniScopeManager::startRecording(const std::string &fnameBase)
+{
+    const auto allScopes = scopes();
+    if (allScopes.empty()) {
+        d->lastError = "No devices to record from.";
+        return false;
+    }
+
+    // all devices must be acquiring frames before we can start recording on any of them
+    if (!run())
+        return false;
+
+    const auto startTime = steady_hr_clock::now();
+    for (size_t i = 0; i < allScopes.size(); i++) {
+        const auto fname = boost::str(boost::format("%1%_scope%2%") % fnameBase % i);
+        if (!allScopes[i]->startRecording(fname, startTime)) {
+            d->lastError = boost::str(boost::format("Unable to start recording on device %1%: %2%") % i % allScopes[i]->lastError());
+            for (size_t j = 0; j < i; j++)
+                allScopes[j]->stopRecording();
+            return false;
+        }
+    }
+
+    d->recording = true;
+    return true;
+}
+
+/**
+ * Stop recording on all devices, after the last frame every device grabbed before this call.
+ */
+void MiniScopeManager::stopRecording()
+{
+    const auto stopTime = steady_hr_clock::now();
+    for (const auto &scope : scopes())
+        scope->stopRecording(stopTime);
+    d->recording = false;
+}
+
+bool MiniScopeManager::recording() const
+{
+    return d->recording;
+}
+
+uint MiniScopeManager::encoderThreadsCount() const
+{
+    return d->encoderPool->threadsCount();
+}
+
+/**
+ * Set CPU affinity, scheduling policy and I/O priority of the shared encoder threads.
+ */
+void MiniScopeManager::setEncoderScheduling(const ThreadSchedulingOptions &options)
+{
+    d->encoderPool->setThreadScheduling(options);
+}
+
+/**
+ * Get the aggregate throughput of all devices. The encoding rate is averaged
+ * over the time since the previous call of this function.
+ */
+ManagerThroughput MiniScopeManager::throughput()
+{
+    ManagerThroughput tp;
+    tp.captureFps = 0;
+    tp.droppedFrames = 0;
+    tp.missedFrames = 0;
+    for (const auto &scope : scopes()) {
+        if (scope->running())
+            tp.captureFps += scope->measuredFps();
+        tp.droppedFrames += scope->droppedFramesCount();
+        tp.missedFrames += scope->missedFramesCount();
+    }
+
+    const auto now = steady_hr_clock::now();
+    const auto framesEncoded = d->encoderPool->framesEncoded();
+    const auto elapsedSec = std::chrono::duration<double>(now - d->lastThroughputTime).count();
+    tp.encodeFps = (elapsedSec > 0)? (framesEncoded - d->lastFramesEncoded) / elapsedSec : 0;
+    d->lastFramesEncoded = framesEncoded;
+    d->lastThroughputTime = now;
+
+    tp.pendingFrames = d->encoderPool->pendingFrames();
+    return tp;
+}
+
+std::string MiniScopeManager::lastError() const
+{
+    return d->lastError;
+}
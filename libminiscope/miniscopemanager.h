@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MINISCOPEMANAGER_H
+#define MINISCOPEMANAGER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "miniscope.h"
+
+/**
+ * @brief Aggregate throughput of all devices of a MiniScopeManager.
+ */
+struct ManagerThroughput
+{
+    double captureFps;      // frames acquired per second, summed over all devices
+    double encodeFps;       // frames encoded per second since the last query
+    size_t pendingFrames;   // frames waiting to be encoded
+    size_t droppedFrames;   // frames the devices failed to deliver
+    size_t missedFrames;    // frames estimated to be lost silently
+};
+
+/**
+ * @brief The MiniScopeManager class
+ *
+ * Owns a set of Miniscopes used together in one experiment. Their recordings
+ * are encoded by one shared pool of encoder threads, and are started and stopped
+ * at the same frame time on all devices.
+ */
+class MiniScopeManagerData;
+class MS_LIB_EXPORT MiniScopeManager
+{
+public:
+    explicit MiniScopeManager(uint encoderThreads = 0);
+    ~MiniScopeManager();
+
+    std::shared_ptr<MiniScope> addScope(int camId);
+    std::shared_ptr<MiniScope> addScope(std::shared_ptr<FrameSource> source);
+    std::vector<std::shared_ptr<MiniScope>> scopes() const;
+    size_t scopesCount() const;
+
+    bool connect();
+    void disconnect();
+
+    bool run();
+    void stop();
+
+    bool startRecording(const std::string &fnameBase);
+    void stopRecording();
+    bool recording() const;
+
+    uint encoderThreadsCount() const;
+    void setEncoderScheduling(const ThreadSchedulingOptions &options);
+    ManagerThroughput throughput();
+
+    std::string lastError() const;
+
+private:
+    std::unique_ptr<MiniScopeManagerData> d;
+
+    std::shared_ptr<MiniScope> addScopeInternal(std::shared_ptr<MiniScope> scope);
+};
+
+#endif // MINISCOPEMANAGER_H
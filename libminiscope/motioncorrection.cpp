@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "motioncorrection.h"
+
+#include <cmath>
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+
+// correlation peaks below this height are most likely noise
+static const double MIN_VALID_PEAK = 0.02;
+
+MotionCorrector::MotionCorrector()
+    : m_patchSize(256),
+      m_downsample(2),
+      m_templateAlpha(0.05),
+      m_dftSize(0),
+      m_haveTemplate(false)
+{
+    m_translation = cv::Mat(2, 3, CV_64F);
+}
+
+int MotionCorrector::patchSize() const
+{
+    return m_patchSize;
+}
+
+/**
+ * Set the edge length of the patch shifts are estimated on, after downsampling.
+ */
+void MotionCorrector::setPatchSize(int size)
+{
+    m_patchSize = std::max(16, size);
+    m_frameSize = cv::Size();
+}
+
+int MotionCorrector::downsample() const
+{
+    return m_downsample;
+}
+
+void MotionCorrector::setDownsample(int factor)
+{
+    m_downsample = std::max(1, factor);
+    m_frameSize = cv::Size();
+}
+
+double MotionCorrector::templateAlpha() const
+{
+    return m_templateAlpha;
+}
+
+/**
+ * Set how much each aligned frame contributes to the running template.
+ */
+void MotionCorrector::setTemplateAlpha(double alpha)
+{
+    m_templateAlpha = std::min(1.0, std::max(0.0, alpha));
+}
+
+void MotionCorrector::reset()
+{
+    m_haveTemplate = false;
+}
+
+void MotionCorrector::setup(const cv::Size &frameSize)
+{
+    m_frameSize = frameSize;
+
+    // the largest square at the center that fits the frame, in a size the DFT is fast for
+    const auto side = std::min(m_patchSize * m_downsample, std::min(frameSize.width, frameSize.height));
+    m_dftSize = side / m_downsample;
+    while (m_dftSize > 1 && cv::getOptimalDFTSize(m_dftSize) != m_dftSize)
+        m_dftSize--;
+
+    const auto regionSide = m_dftSize * m_downsample;
+    m_region = cv::Rect((frameSize.width - regionSide) / 2,
+                        (frameSize.height - regionSide) / 2,
+                        regionSide,
+                        regionSide);
+
+    cv::createHanningWindow(m_window, cv::Size(m_dftSize, m_dftSize), CV_32F);
+    m_haveTemplate = false;
+}
+
+/**
+ * Cut the patch from the frame, into m_raw (zero mean) and m_patch (windowed).
+ */
+void MotionCorrector::preparePatch(const cv::Mat &frame)
+{
+    cv::Mat src = frame(m_region);
+    if (src.channels() == 3) {
+        cv::cvtColor(src, m_gray, cv::COLOR_BGR2GRAY);
+        src = m_gray;
+    }
+    if (m_downsample > 1) {
+        cv::resize(src, m_small, cv::Size(m_dftSize, m_dftSize), 0, 0, cv::INTER_AREA);
+        src = m_small;
+    }
+
+    src.convertTo(m_raw, CV_32F);
+    cv::subtract(m_raw, cv::mean(m_raw), m_raw);
+    cv::multiply(m_raw, m_window, m_patch);
+}
+
+MotionShift MotionCorrector::estimate(const cv::Mat &frame, uint64_t sequence)
+{
+    MotionShift shift;
+    shift.sequence = sequence;
+    if (frame.empty())
+        return shift;
+
+    if (frame.size() != m_frameSize)
+        setup(frame.size());
+    preparePatch(frame);
+
+    if (!m_haveTemplate) {
+        m_patch.copyTo(m_template);
+        cv::dft(m_template, m_templateSpec, cv::DFT_COMPLEX_OUTPUT);
+        m_haveTemplate = true;
+
+        shift.peak = 1;
+        shift.valid = true;
+        return shift;
+    }
+
+    // normalized cross-power spectrum, its inverse has a peak at the displacement
+    cv::dft(m_patch, m_patchSpec, cv::DFT_COMPLEX_OUTPUT);
+    cv::mulSpectrums(m_patchSpec, m_templateSpec, m_cross, 0, true);
+    for (int y = 0; y < m_cross.rows; y++) {
+        auto c = m_cross.ptr<float>(y);
+        for (int x = 0; x < m_cross.cols; x++) {
+            const auto mag = std::sqrt(c[2 * x] * c[2 * x] + c[2 * x + 1] * c[2 * x + 1]) + 1e-6f;
+            c[2 * x] /= mag;
+            c[2 * x + 1] /= mag;
+        }
+    }
+    cv::idft(m_cross, m_corr, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+    double peak;
+    cv::Point loc;
+    cv::minMaxLoc(m_corr, nullptr, &peak, nullptr, &loc);
+
+    // refine to sub-pixel precision with the centroid of the peak's neighborhood,
+    // which wraps around the borders just like the correlation does
+    const auto n = m_dftSize;
+    double sum = 0, sumX = 0, sumY = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            const auto v = m_corr.at<float>((loc.y + dy + n) % n, (loc.x + dx + n) % n);
+            if (v <= 0)
+                continue;
+            sum += v;
+            sumX += v * dx;
+            sumY += v * dy;
+        }
+    }
+    auto px = loc.x + ((sum > 0)? sumX / sum : 0);
+    auto py = loc.y + ((sum > 0)? sumY / sum : 0);
+    if (px > n / 2)
+        px -= n;
+    if (py > n / 2)
+        py -= n;
+
+    shift.dx = px * m_downsample;
+    shift.dy = py * m_downsample;
+    shift.peak = peak;
+    shift.valid = peak >= MIN_VALID_PEAK;
+    if (!shift.valid)
+        return shift;
+
+    // blend the aligned patch into the template, windowed again at its original position
+    m_translation.at<double>(0, 0) = 1;
+    m_translation.at<double>(0, 1) = 0;
+    m_translation.at<double>(0, 2) = -px;
+    m_translation.at<double>(1, 0) = 0;
+    m_translation.at<double>(1, 1) = 1;
+    m_translation.at<double>(1, 2) = -py;
+    cv::warpAffine(m_raw, m_aligned, m_translation, m_raw.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+    cv::multiply(m_aligned, m_window, m_aligned);
+    cv::addWeighted(m_template, 1 - m_templateAlpha, m_aligned, m_templateAlpha, 0, m_template);
+    cv::dft(m_template, m_templateSpec, cv::DFT_COMPLEX_OUTPUT);
+
+    return shift;
+}
+
+/**
+ * Move a frame back by the estimated displacement.
+ */
+void MotionCorrector::apply(const cv::Mat &src, cv::Mat &dst, const MotionShift &shift)
+{
+    cv::Mat translation(2, 3, CV_64F);
+    translation.at<double>(0, 0) = 1;
+    translation.at<double>(0, 1) = 0;
+    translation.at<double>(0, 2) = -shift.dx;
+    translation.at<double>(1, 0) = 0;
+    translation.at<double>(1, 1) = 1;
+    translation.at<double>(1, 2) = -shift.dy;
+    cv::warpAffine(src, dst, translation, src.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+}
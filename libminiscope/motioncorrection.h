@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOTIONCORRECTION_H
+#define MOTIONCORRECTION_H
+
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+#include "mstypes.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief The MotionCorrector class
+ *
+ * Estimates the rigid translation of frames against a running template by phase
+ * correlation of a square patch from the center of the frame, optionally downsampled.
+ *
+ * All buffers, the window function and the spectrum of the template are kept between
+ * frames, so estimating a shift does not allocate memory once the first frame was seen.
+ */
+class MotionCorrector
+{
+public:
+    MotionCorrector();
+
+    int patchSize() const;
+    void setPatchSize(int size);
+    int downsample() const;
+    void setDownsample(int factor);
+    double templateAlpha() const;
+    void setTemplateAlpha(double alpha);
+
+    void reset();
+    MotionShift estimate(const cv::Mat &frame, uint64_t sequence);
+
+    static void apply(const cv::Mat &src, cv::Mat &dst, const MotionShift &shift);
+
+private:
+    int m_patchSize;
+    int m_downsample;
+    double m_templateAlpha;
+
+    cv::Size m_frameSize;
+    cv::Rect m_region;
+    int m_dftSize;
+    bool m_haveTemplate;
+
+    cv::Mat m_gray;
+    cv::Mat m_small;
+    cv::Mat m_raw;
+    cv::Mat m_patch;
+    cv::Mat m_window;
+    cv::Mat m_template;
+    cv::Mat m_templateSpec;
+    cv::Mat m_patchSpec;
+    cv::Mat m_cross;
+    cv::Mat m_corr;
+    cv::Mat m_aligned;
+    cv::Mat m_translation;
+
+    void setup(const cv::Size &frameSize);
+    void preparePatch(const cv::Mat &frame);
+};
+
+#pragma GCC diagnostic pop
+
+#endif // MOTIONCORRECTION_H
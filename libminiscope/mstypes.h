@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MSTYPES_H
+#define MSTYPES_H
+
+#include <vector>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+#include "msexport.h"
+#include "videowriter.h"
+
+// Value types of the public MiniScope API, whose classes producing them are internal.
+
+enum class BinningMode {
+    Mean,
+    Sum
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief Crop and binning applied to frames before they are recorded or displayed.
+ *
+ * The crop rectangle is clipped to the frame, and shrunk to a multiple of the
+ * binning factor. An empty rectangle selects the whole frame.
+ * Temporal binning combines consecutive frames into one, in the same mode as
+ * the spatial binning. It only applies to recordings.
+ */
+struct MS_LIB_EXPORT FrameReduction
+{
+    FrameReduction();
+
+    cv::Rect crop;
+    uint binning;               // 1, 2 or 4
+    uint temporalBinning;       // number of consecutive frames combined into one
+    BinningMode binningMode;
+    bool deepPixels;            // 16-bit grayscale output instead of the input format
+
+    bool isIdentity() const;
+    bool isSpatialIdentity() const;
+    bool operator==(const FrameReduction &other) const;
+    bool operator!=(const FrameReduction &other) const;
+};
+
+/**
+ * @brief Fluorescence of all ROIs in a single frame.
+ */
+struct RoiTraces
+{
+    FrameMetadata meta;
+    std::vector<float> fluorescence;  // weighted mean of the pixels of each ROI
+    std::vector<float> dff;           // (F - F0) / F0, with F0 the running baseline
+};
+
+/**
+ * @brief Estimated rigid displacement of a frame against the motion template.
+ */
+struct MotionShift
+{
+    MotionShift()
+        : sequence(0),
+          dx(0),
+          dy(0),
+          peak(0),
+          valid(false)
+    {}
+
+    uint64_t sequence;  // frame the shift was estimated for
+    double dx;          // displacement of the frame contents, in pixels
+    double dy;
+    double peak;        // height of the phase correlation peak (0 - 1), a measure of confidence
+    bool valid;
+};
+
+/**
+ * @brief Per-pixel summary images of a recording.
+ */
+struct SummaryImages
+{
+    uint64_t framesCount;
+    cv::Mat mean;           // CV_32F
+    cv::Mat max;            // CV_16U
+    cv::Mat stddev;         // CV_32F
+    cv::Mat correlation;    // CV_32F, mean correlation of each pixel with its 8 neighbors
+};
+
+#pragma GCC diagnostic pop
+
+#endif // MSTYPES_H
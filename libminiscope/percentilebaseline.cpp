@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "percentilebaseline.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "pixelkernels.h"
+#include "stripepool.h"
+
+PercentileBaseline::PercentileBaseline()
+    : m_type(-1),
+      m_percentile(8),
+      m_filled(0),
+      m_next(0)
+{
+}
+
+double PercentileBaseline::percentile() const
+{
+    return m_percentile;
+}
+
+void PercentileBaseline::setPercentile(double percentile)
+{
+    m_percentile = std::min(100.0, std::max(0.0, percentile));
+}
+
+void PercentileBaseline::reset()
+{
+    m_ring.clear();
+    m_sorted.clear();
+    m_size = cv::Size();
+    m_type = -1;
+    m_filled = 0;
+    m_next = 0;
+}
+
+uint PercentileBaseline::samplesCount() const
+{
+    return m_filled;
+}
+
+/**
+ * Add a frame as new sample, replacing the oldest one once SAMPLES frames
+ * were added. A frame of a different size or type starts over.
+ */
+bool PercentileBaseline::add(const cv::Mat &frame, StripePool *pool)
+{
+    if (frame.empty() || frame.depth() != CV_8U)
+        return false;
+
+    if ((frame.size() != m_size) || (frame.type() != m_type) || m_sorted.empty()) {
+        m_size = frame.size();
+        m_type = frame.type();
+        m_ring.assign(SAMPLES, cv::Mat());
+        m_sorted.clear();
+        for (uint k = 0; k < SAMPLES; k++)
+            m_sorted.push_back(cv::Mat(m_size, m_type, cv::Scalar(255, 255, 255)));
+        m_filled = 0;
+        m_next = 0;
+    }
+
+    const auto rowLength = static_cast<size_t>(frame.cols * frame.channels());
+    m_maxRow.assign(rowLength, 255);
+
+    // until the ring is full, the sample we replace is one of the
+    // placeholders at the top of the sorted planes
+    const auto full = m_filled == SAMPLES;
+
+    const auto percentileRow = pixelKernels().percentileRow;
+    runStripes(pool, frame.rows, 8, [&](int begin, int end) {
+        std::vector<uint8_t> prevRow(rowLength);
+        uint8_t *sortedRows[SAMPLES];
+        for (int y = begin; y < end; y++) {
+            const auto newValues = frame.ptr<uint8_t>(y);
+            const auto oldValues = full? m_ring[m_next].ptr<uint8_t>(y) : m_maxRow.data();
+            for (uint k = 0; k < SAMPLES; k++)
+                sortedRows[k] = m_sorted[k].ptr<uint8_t>(y);
+
+            // remove the old value from the sorted samples and insert the new one
+            percentileRow(sortedRows, SAMPLES, oldValues, newValues,
+                          prevRow.data(), m_maxRow.data(), rowLength);
+        }
+    });
+
+    frame.copyTo(m_ring[m_next]);
+    m_next = (m_next + 1) % SAMPLES;
+    if (!full)
+        m_filled++;
+
+    return true;
+}
+
+/**
+ * The selected percentile of the samples of every pixel, or an empty
+ * matrix if no samples were added yet.
+ */
+cv::Mat PercentileBaseline::baseline() const
+{
+    if (m_filled == 0)
+        return cv::Mat();
+
+    const auto rank = static_cast<size_t>(std::lround(m_percentile / 100.0 * (m_filled - 1)));
+    return m_sorted[rank].clone();
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERCENTILEBASELINE_H
+#define PERCENTILEBASELINE_H
+
+#include <vector>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+class StripePool;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief The PercentileBaseline class
+ *
+ * Estimates the baseline F0 of every pixel as a low percentile of its recent values,
+ * which, unlike a moving average, is not pulled up by transient activity.
+ *
+ * The last SAMPLES frames given to it (usually a decimated stream of frames covering
+ * the desired time window) are kept in a ring. Additionally, the samples of every pixel
+ * are kept sorted, in SAMPLES planes of the frame size where plane k holds the k-th
+ * smallest value of each pixel. A new frame replaces the oldest one in the sorted
+ * planes with a branch-free merge step per plane, so every plane is a contiguous loop
+ * over all pixels that the compiler vectorizes.
+ *
+ * Only 8-bit frames are supported. Memory use is 2 * SAMPLES bytes per pixel and channel,
+ * that is 22 MiB for a 752x480 and 64 MiB for a 1024x1024 grayscale sensor. Adding a
+ * frame costs SAMPLES passes over it, about 7 ms for 752x480 and 24 ms for 1024x1024
+ * on one core of a recent x86 CPU in an optimized (-O3) build. This only happens for
+ * every decimated frame; reading the baseline costs one frame copy.
+ */
+class PercentileBaseline
+{
+public:
+    static const uint SAMPLES = 32;
+
+    PercentileBaseline();
+
+    double percentile() const;
+    void setPercentile(double percentile);
+
+    void reset();
+    bool add(const cv::Mat &frame, StripePool *pool = nullptr);
+    uint samplesCount() const;
+
+    cv::Mat baseline() const;
+
+private:
+    cv::Size m_size;
+    int m_type;
+    double m_percentile;
+    uint m_filled;
+    uint m_next;
+
+    std::vector<cv::Mat> m_ring;    // the samples, in order of arrival
+    std::vector<cv::Mat> m_sorted;  // the samples of each pixel, in ascending order
+    std::vector<uint8_t> m_maxRow;
+};
+
+#pragma GCC diagnostic pop
+
+#endif // PERCENTILEBASELINE_H
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipelinestats.h"
+
+#include <cmath>
+#include <limits>
+
+/**
+ * Values below 2^SUB_BUCKET_BITS+1 are stored exactly, every power-of-two range above
+ * that is split into 2^SUB_BUCKET_BITS buckets.
+ */
+static const int SUB_BUCKET_BITS = 5;
+static const uint64_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+
+/**
+ * The largest value (in nanoseconds) we can record, everything above is clamped.
+ */
+static const int MAX_VALUE_BITS = 40;
+// values of MAX_VALUE_BITS bits land in the last range of sub-buckets
+static const size_t BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+static inline int msb_index(uint64_t v)
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(v);
+#else
+    int r = 0;
+    while (v >>= 1)
+        r++;
+    return r;
+#endif
+}
+
+static inline size_t bucket_index(uint64_t v)
+{
+    if (v < 2 * SUB_BUCKET_COUNT)
+        return static_cast<size_t>(v);
+    const auto shift = msb_index(v) - SUB_BUCKET_BITS;
+    return static_cast<size_t>(shift) * SUB_BUCKET_COUNT + static_cast<size_t>(v >> shift);
+}
+
+static inline void bucket_range(size_t index, uint64_t *lower, uint64_t *width)
+{
+    if (index < 2 * SUB_BUCKET_COUNT) {
+        *lower = index;
+        *width = 1;
+        return;
+    }
+    const auto shift = index / SUB_BUCKET_COUNT - 1;
+    *lower = (index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT) << shift;
+    *width = static_cast<uint64_t>(1) << shift;
+}
+
+const HistogramSummary *PipelineStats::histogram(const std::string &name) const
+{
+    for (const auto &h : histograms) {
+        if (h.name == name)
+            return &h;
+    }
+    return nullptr;
+}
+
+const GaugeSummary *PipelineStats::gauge(const std::string &name) const
+{
+    for (const auto &g : gauges) {
+        if (g.name == name)
+            return &g;
+    }
+    return nullptr;
+}
+
+LatencyHistogram::LatencyHistogram(const std::string &name)
+    : m_name(name),
+      m_buckets(BUCKET_COUNT)
+{
+    reset();
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds value)
+{
+    const auto maxValue = (static_cast<uint64_t>(1) << MAX_VALUE_BITS) - 1;
+    auto v = value.count() < 0? 0 : static_cast<uint64_t>(value.count());
+    if (v > maxValue)
+        v = maxValue;
+
+    m_buckets[bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+
+    // we only ever have one thread recording values, so plain stores are fine here
+    m_sum.store(m_sum.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    if (v < m_min.load(std::memory_order_relaxed))
+        m_min.store(v, std::memory_order_relaxed);
+    if (v > m_max.load(std::memory_order_relaxed))
+        m_max.store(v, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_release);
+}
+
+void LatencyHistogram::recordSince(const steady_hr_clock::time_point &start)
+{
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_hr_clock::now() - start));
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto &b : m_buckets)
+        b.store(0, std::memory_order_relaxed);
+    m_sum = 0;
+    m_min = std::numeric_limits<uint64_t>::max();
+    m_max = 0;
+    m_count = 0;
+}
+
+std::string LatencyHistogram::name() const
+{
+    return m_name;
+}
+
+double LatencyHistogram::valueAtPercentile(uint64_t count, double percentile) const
+{
+    const auto target = static_cast<uint64_t>(std::ceil(percentile / 100.0 * count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_buckets.size(); i++) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target && seen > 0) {
+            uint64_t lower, width;
+            bucket_range(i, &lower, &width);
+            return lower + (width - 1) / 2.0;
+        }
+    }
+
+    return m_max.load(std::memory_order_relaxed);
+}
+
+HistogramSummary LatencyHistogram::summary() const
+{
+    HistogramSummary s;
+    s.name = m_name;
+    s.count = m_count.load(std::memory_order_acquire);
+    if (s.count == 0) {
+        s.min = s.max = s.mean = 0;
+        s.p50 = s.p90 = s.p99 = s.p999 = 0;
+        return s;
+    }
+
+    // we report microseconds, but record nanoseconds
+    const auto minV = static_cast<double>(m_min.load(std::memory_order_relaxed));
+    const auto maxV = static_cast<double>(m_max.load(std::memory_order_relaxed));
+    auto clampUsec = [&](double v) {
+        if (v < minV)
+            v = minV;
+        if (v > maxV)
+            v = maxV;
+        return v / 1000.0;
+    };
+
+    s.min = minV / 1000.0;
+    s.max = maxV / 1000.0;
+    s.mean = m_sum.load(std::memory_order_relaxed) / static_cast<double>(s.count) / 1000.0;
+    s.p50 = clampUsec(valueAtPercentile(s.count, 50));
+    s.p90 = clampUsec(valueAtPercentile(s.count, 90));
+    s.p99 = clampUsec(valueAtPercentile(s.count, 99));
+    s.p999 = clampUsec(valueAtPercentile(s.count, 99.9));
+
+    return s;
+}
+
+StageTimer::StageTimer(LatencyHistogram &hist, bool enabled)
+    : m_hist(hist),
+      m_active(enabled)
+{
+    if (m_active)
+        m_start = steady_hr_clock::now();
+}
+
+StageTimer::~StageTimer()
+{
+    stop();
+}
+
+void StageTimer::stop()
+{
+    if (!m_active)
+        return;
+    m_hist.recordSince(m_start);
+    m_active = false;
+}
+
+QueueGauge::QueueGauge(const std::string &name)
+    : m_name(name)
+{
+    reset();
+}
+
+void QueueGauge::set(size_t value)
+{
+    m_current.store(value, std::memory_order_relaxed);
+    if (value > m_max.load(std::memory_order_relaxed))
+        m_max.store(value, std::memory_order_relaxed);
+}
+
+void QueueGauge::reset()
+{
+    m_current = 0;
+    m_max = 0;
+}
+
+GaugeSummary QueueGauge::summary() const
+{
+    GaugeSummary s;
+    s.name = m_name;
+    s.current = m_current.load(std::memory_order_relaxed);
+    s.max = m_max.load(std::memory_order_relaxed);
+    return s;
+}
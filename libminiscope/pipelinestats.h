@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINESTATS_H
+#define PIPELINESTATS_H
+
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "msexport.h"
+
+using steady_hr_clock =
+    std::conditional<std::chrono::high_resolution_clock::is_steady,
+                     std::chrono::high_resolution_clock,
+                     std::chrono::steady_clock
+                    >::type;
+
+/**
+ * @brief Summary of a latency histogram at the time a snapshot was taken.
+ *
+ * All times are in microseconds.
+ */
+struct HistogramSummary
+{
+    std::string name;
+    uint64_t count;
+    double min;
+    double max;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+};
+
+/**
+ * @brief Current and highest observed value of a queue depth gauge.
+ */
+struct GaugeSummary
+{
+    std::string name;
+    size_t current;
+    size_t max;
+};
+
+/**
+ * @brief Scheduling settings in effect for a pipeline thread.
+ */
+struct ThreadSummary
+{
+    std::string name;
+    std::string scheduling;
+};
+
+/**
+ * @brief Snapshot of all instrumentation data of a pipeline element.
+ */
+struct MS_LIB_EXPORT PipelineStats
+{
+    std::vector<HistogramSummary> histograms;
+    std::vector<GaugeSummary> gauges;
+    std::vector<ThreadSummary> threads;
+
+    const HistogramSummary *histogram(const std::string &name) const;
+    const GaugeSummary *gauge(const std::string &name) const;
+};
+
+/**
+ * @brief The LatencyHistogram class
+ *
+ * A log-linear histogram of durations in the style of HdrHistogram:
+ * every power-of-two range is split into 32 linear sub-buckets, so recorded
+ * values keep a relative precision of about 3% from one nanosecond up to
+ * about 18 minutes, without any allocations after construction.
+ *
+ * Values are recorded by a single thread, while snapshots may be taken from any
+ * other thread at any time.
+ */
+class LatencyHistogram
+{
+public:
+    explicit LatencyHistogram(const std::string &name);
+
+    void record(std::chrono::nanoseconds value);
+    void recordSince(const steady_hr_clock::time_point &start);
+    void reset();
+
+    std::string name() const;
+    HistogramSummary summary() const;
+
+private:
+    std::string m_name;
+    std::vector<std::atomic<uint64_t>> m_buckets;
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_min;
+    std::atomic<uint64_t> m_max;
+
+    double valueAtPercentile(uint64_t count, double percentile) const;
+};
+
+/**
+ * @brief Records the time between its creation and a call to stop() (or its destruction)
+ * in a histogram, if instrumentation is enabled.
+ */
+class StageTimer
+{
+public:
+    StageTimer(LatencyHistogram &hist, bool enabled);
+    ~StageTimer();
+
+    void stop();
+
+private:
+    LatencyHistogram &m_hist;
+    bool m_active;
+    steady_hr_clock::time_point m_start;
+};
+
+/**
+ * @brief The QueueGauge class
+ *
+ * Tracks the current and maximum depth of a queue.
+ */
+class QueueGauge
+{
+public:
+    explicit QueueGauge(const std::string &name);
+
+    void set(size_t value);
+    void reset();
+
+    GaugeSummary summary() const;
+
+private:
+    std::string m_name;
+    std::atomic<size_t> m_current;
+    std::atomic<size_t> m_max;
+};
+
+#endif // PIPELINESTATS_H
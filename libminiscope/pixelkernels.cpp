@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pixelkernels.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+
+const PixelKernels *pixelKernelsBaseline();
+#ifdef HAVE_PIXEL_KERNELS_AVX2
+const PixelKernels *pixelKernelsAvx2();
+#endif
+#ifdef HAVE_PIXEL_KERNELS_AVX512
+const PixelKernels *pixelKernelsAvx512();
+#endif
+
+/**
+ * All kernel variants this CPU can run, the best one first.
+ */
+static std::vector<const PixelKernels*> supportedPixelKernels()
+{
+    std::vector<const PixelKernels*> kernels;
+
+#if defined(HAVE_PIXEL_KERNELS_AVX2) || defined(HAVE_PIXEL_KERNELS_AVX512)
+    __builtin_cpu_init();
+#endif
+#ifdef HAVE_PIXEL_KERNELS_AVX512
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+        kernels.push_back(pixelKernelsAvx512());
+#endif
+#ifdef HAVE_PIXEL_KERNELS_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        kernels.push_back(pixelKernelsAvx2());
+#endif
+    kernels.push_back(pixelKernelsBaseline());
+
+    return kernels;
+}
+
+static const PixelKernels *selectPixelKernels()
+{
+    const auto kernels = supportedPixelKernels();
+
+    // allow selecting a lesser variant, to compare them or to work around problems
+    const auto forced = std::getenv("MINISCOPE_PIXEL_KERNELS");
+    if (forced != nullptr) {
+        for (const auto k : kernels) {
+            if (std::string(k->isa) == forced)
+                return k;
+        }
+    }
+
+    return kernels.front();
+}
+
+/**
+ * The kernels for the best instruction set this CPU supports,
+ * which are selected on first use.
+ */
+const PixelKernels &pixelKernels()
+{
+    static const auto kernels = selectPixelKernels();
+    return *kernels;
+}
+
+std::string selectedPixelKernelIsa()
+{
+    return pixelKernels().isa;
+}
+
+template<typename T>
+static PixelPlane<T> benchPlane(std::vector<T> &buffer, int rows, int cols)
+{
+    PixelPlane<T> plane;
+    plane.data = buffer.data();
+    plane.step = static_cast<size_t>(cols) * sizeof(T);
+    plane.rows = rows;
+    plane.cols = cols;
+    return plane;
+}
+
+template<typename T>
+static PixelPlane<const T> constPlane(const PixelPlane<T> &plane)
+{
+    PixelPlane<const T> cplane;
+    cplane.data = plane.data;
+    cplane.step = plane.step;
+    cplane.rows = plane.rows;
+    cplane.cols = plane.cols;
+    return cplane;
+}
+
+/**
+ * Pixels per second of a kernel processing frames of the given pixel count,
+ * run repeatedly for about 100 msec.
+ */
+static double measureThroughput(size_t pixels, const std::function<void()> &run)
+{
+    using clock = std::chrono::steady_clock;
+
+    run(); // warm up caches
+    size_t iterations = 0;
+    const auto start = clock::now();
+    std::chrono::duration<double> elapsed(0);
+    do {
+        run();
+        iterations++;
+        elapsed = clock::now() - start;
+    } while (elapsed.count() < 0.1);
+
+    return static_cast<double>(pixels * iterations) / elapsed.count();
+}
+
+/**
+ * Measure the throughput of the main kernels in every variant this CPU supports,
+ * on frames of the given size.
+ */
+std::vector<PixelKernelBenchmark> benchmarkPixelKernels(int width, int height)
+{
+    std::vector<PixelKernelBenchmark> report;
+    const auto pixels = static_cast<size_t>(width) * static_cast<size_t>(height);
+
+    // a deterministic noisy BGR frame, and room for all results
+    std::vector<uint8_t> bgrData(pixels * 3);
+    uint32_t seed = 1;
+    for (auto &v : bgrData) {
+        seed = seed * 1664525u + 1013904223u;
+        v = static_cast<uint8_t>(seed >> 24);
+    }
+    std::vector<uint8_t> grayData(bgrData.begin(), bgrData.begin() + static_cast<std::ptrdiff_t>(pixels));
+    std::vector<uint8_t> outData(pixels * 3);
+    std::vector<float> averageData(pixels * 3, 0.5f);
+    std::vector<uint32_t> accData(pixels * 3, 0);
+    std::vector<uint32_t> rowSum(static_cast<size_t>(width) * 3);
+    std::vector<float> roiWeights(static_cast<size_t>(width), 0.5f);
+    volatile float roiSum = 0;
+
+    const auto bgr = constPlane(benchPlane(bgrData, height, width * 3));
+    const auto gray = constPlane(benchPlane(grayData, height, width));
+
+    DisplayKernelParams params;
+    params.alpha = 0.01f;
+    params.scale = 1.0f;
+    params.offset = 0.0f;
+    params.channelMask[0] = params.channelMask[1] = params.channelMask[2] = 0xFF;
+    DisplayKernelResult result;
+
+    // the percentile baseline keeps 32 sorted samples per pixel
+    const unsigned samples = 32;
+    std::vector<std::vector<uint8_t>> sortedPlanes(samples, std::vector<uint8_t>(pixels, 255));
+    std::vector<uint8_t*> sortedRows(samples);
+    std::vector<uint8_t> prevRow(static_cast<size_t>(width));
+    std::vector<uint8_t> maxRow(static_cast<size_t>(width), 255);
+
+    const auto selected = &pixelKernels();
+    for (const auto k : supportedPixelKernels()) {
+        const auto add = [&](const std::string &name, const std::function<void()> &run) {
+            PixelKernelBenchmark bench;
+            bench.kernel = name;
+            bench.isa = k->isa;
+            bench.selected = k == selected;
+            bench.pixelsPerSecond = measureThroughput(pixels, run);
+            report.push_back(bench);
+        };
+
+        add("display gray F/F0", [&]() {
+            k->display[1][PIXEL_BG_DIVISION][1](bgr, benchPlane(outData, height, width),
+                                                benchPlane(averageData, height, width),
+                                                gray, params, &result);
+        });
+        add("display color", [&]() {
+            k->display[1][PIXEL_BG_NONE][0](bgr, benchPlane(outData, height, width * 3),
+                                            benchPlane(averageData, height, width * 3),
+                                            gray, params, &result);
+        });
+        add("bin 2x2 gray", [&]() {
+            k->bin8u8u(gray, benchPlane(outData, height / 2, width / 2), 1, 2, true, 1, 255, rowSum.data());
+        });
+        add("temporal accumulate gray", [&]() {
+            k->accumulate8u(gray, benchPlane(accData, height, width));
+        });
+        add("roi weighted sum gray", [&]() {
+            float sum = 0;
+            for (int y = 0; y < height; y++)
+                sum += k->weightedSum8u(roiWeights.data(), grayData.data() + static_cast<size_t>(y) * static_cast<size_t>(width),
+                                        static_cast<size_t>(width));
+            roiSum = sum;
+        });
+        add("percentile update gray", [&]() {
+            for (int y = 0; y < height; y++) {
+                const auto offset = static_cast<size_t>(y) * static_cast<size_t>(width);
+                for (unsigned s = 0; s < samples; s++)
+                    sortedRows[s] = sortedPlanes[s].data() + offset;
+                k->percentileRow(sortedRows.data(), samples, grayData.data() + offset,
+                                 bgrData.data() + pixels + offset, prevRow.data(), maxRow.data(),
+                                 static_cast<size_t>(width));
+            }
+        });
+    }
+
+    return report;
+}
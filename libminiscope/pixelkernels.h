@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIXELKERNELS_H
+#define PIXELKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "msexport.h"
+
+// This header is also included by the instruction set specific kernel units,
+// so it must not pull in anything with inline code (like OpenCV), which the
+// linker could pick from a unit built for a newer CPU.
+
+/**
+ * Background methods of the display kernels, in the order of BackgroundDiffMethod.
+ */
+enum {
+    PIXEL_BG_NONE = 0,
+    PIXEL_BG_SUBTRACTION,
+    PIXEL_BG_DIVISION,
+    PIXEL_BG_PERCENTILE,
+    PIXEL_BG_METHODS_COUNT
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief Settings of a display kernel that may change with every frame.
+ */
+struct DisplayKernelParams
+{
+    float alpha;                // update speed of the moving average background
+    float scale;                // linear mapping of grayscale values to the display range
+    float offset;
+    uint8_t channelMask[3];     // 0xFF to show a color channel, 0 to hide it
+};
+
+/**
+ * @brief Measurements a display kernel takes while processing a frame.
+ */
+struct DisplayKernelResult
+{
+    int minValue;               // range of grayscale values before mapping them to the display range
+    int maxValue;
+};
+
+/**
+ * @brief Pixels of an image in memory, without ownership.
+ */
+template<typename T>
+struct PixelPlane
+{
+    T *data;
+    size_t step;                // bytes per row
+    int rows;
+    int cols;                   // elements per row, all channels included
+};
+
+typedef void (*DisplayRowsKernel)(PixelPlane<const uint8_t> src, PixelPlane<uint8_t> dst,
+                                  PixelPlane<float> average, PixelPlane<const uint8_t> baseline,
+                                  const DisplayKernelParams &params, DisplayKernelResult *result);
+
+typedef void (*BinKernel8u8u)(PixelPlane<const uint8_t> src, PixelPlane<uint8_t> dst, int channels, int factor,
+                              bool mean, uint32_t scale, uint32_t maxValue, uint32_t *rowSum);
+typedef void (*BinKernel8u16u)(PixelPlane<const uint8_t> src, PixelPlane<uint16_t> dst, int channels, int factor,
+                               bool mean, uint32_t scale, uint32_t maxValue, uint32_t *rowSum);
+typedef void (*BinKernel16u16u)(PixelPlane<const uint16_t> src, PixelPlane<uint16_t> dst, int channels, int factor,
+                                bool mean, uint32_t scale, uint32_t maxValue, uint32_t *rowSum);
+
+typedef void (*AccumulateKernel8u)(PixelPlane<const uint8_t> src, PixelPlane<uint32_t> acc);
+typedef void (*AccumulateKernel16u)(PixelPlane<const uint16_t> src, PixelPlane<uint32_t> acc);
+typedef void (*StoreKernel8u)(PixelPlane<const uint32_t> acc, PixelPlane<uint8_t> dst, uint32_t divisor, uint32_t maxValue);
+typedef void (*StoreKernel16u)(PixelPlane<const uint32_t> acc, PixelPlane<uint16_t> dst, uint32_t divisor, uint32_t maxValue);
+
+typedef float (*WeightedSumKernel8u)(const float *weights, const uint8_t *pixels, size_t length);
+typedef float (*WeightedSumKernel16u)(const float *weights, const uint16_t *pixels, size_t length);
+typedef float (*WeightedSumKernel32f)(const float *weights, const float *pixels, size_t length);
+
+typedef void (*PercentileRowKernel)(uint8_t *const *sortedRows, unsigned samples,
+                                    const uint8_t *oldValues, const uint8_t *newValues,
+                                    uint8_t *prev, const uint8_t *maxRow, size_t length);
+
+/**
+ * @brief The hot pixel loops, built for one instruction set.
+ */
+struct PixelKernels
+{
+    const char *isa;
+
+    // display kernels, by [3 channels][background method][grayscale output]
+    DisplayRowsKernel display[2][PIXEL_BG_METHODS_COUNT][2];
+
+    BinKernel8u8u bin8u8u;
+    BinKernel8u16u bin8u16u;
+    BinKernel16u16u bin16u16u;
+
+    AccumulateKernel8u accumulate8u;
+    AccumulateKernel16u accumulate16u;
+    StoreKernel8u store8u;
+    StoreKernel16u store16u;
+
+    // ROI trace extraction
+    WeightedSumKernel8u weightedSum8u;
+    WeightedSumKernel16u weightedSum16u;
+    WeightedSumKernel32f weightedSum32f;
+
+    PercentileRowKernel percentileRow;
+};
+
+/**
+ * @brief Throughput of one kernel in one instruction set variant.
+ */
+struct PixelKernelBenchmark
+{
+    std::string kernel;
+    std::string isa;
+    bool selected;              // whether this variant is used on this machine
+    double pixelsPerSecond;
+};
+
+#pragma GCC diagnostic pop
+
+const PixelKernels &pixelKernels();
+
+MS_LIB_EXPORT std::string selectedPixelKernelIsa();
+MS_LIB_EXPORT std::vector<PixelKernelBenchmark> benchmarkPixelKernels(int width = 752, int height = 480);
+
+#endif // PIXELKERNELS_H
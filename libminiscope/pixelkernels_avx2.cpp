@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// built with the compiler flags for this instruction set, see CMakeLists.txt
+#ifdef HAVE_PIXEL_KERNELS_AVX2
+
+#define PIXEL_KERNELS_TABLE pixelKernelsAvx2
+#define PIXEL_KERNELS_ISA_NAME "avx2"
+#include "pixelkernels_impl.h"
+
+#endif // HAVE_PIXEL_KERNELS_AVX2
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The hot pixel loops, which are built once per supported instruction set.
+ *
+ * This file is included by the pixelkernels_<isa>.cpp units after they defined
+ * PIXEL_KERNELS_TABLE to the name of the function returning their kernel table.
+ * Everything else here has internal linkage and must stay free of inline functions
+ * from other headers, see pixelkernels.h.
+ */
+
+#include "pixelkernels.h"
+
+#ifndef PIXEL_KERNELS_TABLE
+#error "PIXEL_KERNELS_TABLE must be defined before including pixelkernels_impl.h"
+#endif
+
+namespace {
+
+template<typename T>
+inline T pkMin(T a, T b)
+{
+    return (b < a)? b : a;
+}
+
+template<typename T>
+inline T pkMax(T a, T b)
+{
+    return (a < b)? b : a;
+}
+
+template<typename T>
+inline T *pkRow(const PixelPlane<T> &plane, int y)
+{
+    return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(plane.data) + static_cast<size_t>(y) * plane.step);
+}
+
+/**
+ * Luminance of a BGR pixel, with the fixed-point weights cv::cvtColor uses.
+ */
+inline int grayValue(const uint8_t *bgr)
+{
+    return (bgr[0] * 1868 + bgr[1] * 9617 + bgr[2] * 4899 + (1 << 13)) >> 14;
+}
+
+/**
+ * The display kernel for one combination of settings.
+ *
+ * All decisions depend on template parameters only, so every instantiation
+ * has a branch-free inner loop over a row that the compiler can vectorize.
+ * Grayscale output is converted to grayscale first, so the background
+ * is only computed on a single channel.
+ */
+template<int CN, int METHOD, bool GRAY>
+void displayRows(PixelPlane<const uint8_t> src, PixelPlane<uint8_t> dst,
+                 PixelPlane<float> average, PixelPlane<const uint8_t> baseline,
+                 const DisplayKernelParams &params, DisplayKernelResult *result)
+{
+    constexpr bool USE_AVERAGE = METHOD != PIXEL_BG_PERCENTILE;
+
+    const auto alpha = params.alpha;
+    const auto keep = 1.0f - alpha;
+    const auto rowLength = dst.cols;
+    int minValue = 255;
+    int maxValue = 0;
+
+    for (int y = 0; y < src.rows; y++) {
+        const auto in = pkRow(src, y);
+        auto out = pkRow(dst, y);
+        auto avg = USE_AVERAGE? pkRow(average, y) : nullptr;
+        const auto base = USE_AVERAGE? nullptr : pkRow(baseline, y);
+
+        for (int i = 0; i < rowLength; i++) {
+            int v = (GRAY && CN == 3)? grayValue(in + i * 3) : in[i];
+
+            if (USE_AVERAGE) {
+                const auto a = keep * avg[i] + alpha * (v * (1.0f / 255.0f));
+                avg[i] = a;
+                if (METHOD == PIXEL_BG_SUBTRACTION) {
+                    v = pkMax(0, v - static_cast<int>(a * 255.0f + 0.5f));
+                } else if (METHOD == PIXEL_BG_DIVISION) {
+                    const auto q = (a > 0)? v * (250.0f / 255.0f) / a : 0.0f;
+                    v = static_cast<int>(pkMin(q, 255.0f) + 0.5f);
+                }
+            } else {
+                const auto b = static_cast<float>(base[i]);
+                const auto q = (b > 0)? v * 250.0f / b : 0.0f;
+                v = static_cast<int>(pkMin(q, 255.0f) + 0.5f);
+            }
+
+            if (GRAY) {
+                minValue = pkMin(minValue, v);
+                maxValue = pkMax(maxValue, v);
+                const auto mapped = v * params.scale + params.offset;
+                out[i] = static_cast<uint8_t>(pkMin(255.0f, pkMax(0.0f, mapped)) + 0.5f);
+            } else {
+                out[i] = static_cast<uint8_t>(v & params.channelMask[i % CN]);
+            }
+        }
+    }
+
+    result->minValue = minValue;
+    result->maxValue = maxValue;
+}
+
+/**
+ * Sum blocks of factor x factor pixels of every channel.
+ *
+ * Rows are summed up first and the columns of the summed row afterwards,
+ * so the loop over the (much longer) rows runs over contiguous memory.
+ */
+template<typename T, typename O>
+void binRows(PixelPlane<const T> src, PixelPlane<O> dst, int channels, int factor,
+             bool mean, uint32_t scale, uint32_t maxValue, uint32_t *rowSum)
+{
+    const auto rowLength = src.cols;
+    const auto outCols = dst.cols / channels;
+    const auto area = static_cast<uint32_t>(factor * factor);
+
+    for (int oy = 0; oy < dst.rows; oy++) {
+        for (int i = 0; i < rowLength; i++)
+            rowSum[i] = 0;
+        for (int k = 0; k < factor; k++) {
+            const auto in = pkRow(src, oy * factor + k);
+            for (int i = 0; i < rowLength; i++)
+                rowSum[i] += in[i];
+        }
+
+        auto out = pkRow(dst, oy);
+        for (int ox = 0; ox < outCols; ox++) {
+            for (int c = 0; c < channels; c++) {
+                uint32_t sum = 0;
+                for (int k = 0; k < factor; k++)
+                    sum += rowSum[(ox * factor + k) * channels + c];
+
+                sum *= scale;
+                if (mean)
+                    sum = (sum + area / 2) / area;
+                out[ox * channels + c] = static_cast<O>(pkMin(sum, maxValue));
+            }
+        }
+    }
+}
+
+template<typename T>
+void accumulateRows(PixelPlane<const T> src, PixelPlane<uint32_t> acc)
+{
+    for (int y = 0; y < src.rows; y++) {
+        const auto in = pkRow(src, y);
+        auto sums = pkRow(acc, y);
+        for (int i = 0; i < src.cols; i++)
+            sums[i] += in[i];
+    }
+}
+
+template<typename T>
+void storeRows(PixelPlane<const uint32_t> acc, PixelPlane<T> dst, uint32_t divisor, uint32_t maxValue)
+{
+    for (int y = 0; y < dst.rows; y++) {
+        const auto sums = pkRow(acc, y);
+        auto out = pkRow(dst, y);
+        for (int i = 0; i < dst.cols; i++)
+            out[i] = static_cast<T>(pkMin((sums[i] + divisor / 2) / divisor, maxValue));
+    }
+}
+
+/**
+ * Sum of the pixels of a run, each multiplied by its weight.
+ *
+ * Without -ffast-math the compiler must keep the order of float additions, so a
+ * single running sum can not be vectorized. We keep one partial sum per lane
+ * instead, which are independent and map to two AVX2 or one AVX-512 register.
+ */
+template<typename T>
+float weightedSum(const float *weights, const T *pixels, size_t length)
+{
+    constexpr size_t LANES = 16;
+    float lanes[LANES] = {};
+
+    size_t i = 0;
+    for (; i + LANES <= length; i += LANES) {
+        for (size_t l = 0; l < LANES; l++)
+            lanes[l] += weights[i + l] * static_cast<float>(pixels[i + l]);
+    }
+
+    float sum = 0;
+    for (; i < length; i++)
+        sum += weights[i] * static_cast<float>(pixels[i]);
+    for (size_t l = 0; l < LANES; l++)
+        sum += lanes[l];
+    return sum;
+}
+
+/**
+ * Replace the old value by the new one in the sorted samples of a row of pixels.
+ * If the new value is larger, the samples from the old one's position up to the
+ * new one's move down a rank, otherwise those from the new one's position up to
+ * the old one's move up. Other samples are unchanged.
+ */
+void percentileRow(uint8_t *const *sortedRows, unsigned samples,
+                   const uint8_t *oldValues, const uint8_t *newValues,
+                   uint8_t *prev, const uint8_t *maxRow, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        prev[i] = 0;
+
+    for (unsigned k = 0; k < samples; k++) {
+        auto s = sortedRows[k];
+        const auto next = (k + 1 < samples)? sortedRows[k + 1] : maxRow;
+        for (size_t i = 0; i < length; i++) {
+            // all values are loaded unconditionally, so this becomes a select
+            const uint8_t cur = s[i];
+            const uint8_t o = oldValues[i];
+            const uint8_t n = newValues[i];
+            const uint8_t up = pkMin(next[i], pkMax(cur, n));
+            const uint8_t down = pkMax(prev[i], pkMin(cur, n));
+            const bool moveUp = (n >= o) && (cur >= o);
+            const bool moveDown = (n < o) && (cur <= o);
+            s[i] = moveUp? up : (moveDown? down : cur);
+            prev[i] = cur;
+        }
+    }
+}
+
+template<int CN, bool GRAY>
+void fillDisplayKernels(PixelKernels &kernels)
+{
+    kernels.display[CN == 3][PIXEL_BG_NONE][GRAY] = &displayRows<CN, PIXEL_BG_NONE, GRAY>;
+    kernels.display[CN == 3][PIXEL_BG_SUBTRACTION][GRAY] = &displayRows<CN, PIXEL_BG_SUBTRACTION, GRAY>;
+    kernels.display[CN == 3][PIXEL_BG_DIVISION][GRAY] = &displayRows<CN, PIXEL_BG_DIVISION, GRAY>;
+    kernels.display[CN == 3][PIXEL_BG_PERCENTILE][GRAY] = &displayRows<CN, PIXEL_BG_PERCENTILE, GRAY>;
+}
+
+PixelKernels makeKernelTable(const char *isa)
+{
+    PixelKernels kernels;
+    kernels.isa = isa;
+    fillDisplayKernels<1, false>(kernels);
+    fillDisplayKernels<1, true>(kernels);
+    fillDisplayKernels<3, false>(kernels);
+    fillDisplayKernels<3, true>(kernels);
+
+    kernels.bin8u8u = &binRows<uint8_t, uint8_t>;
+    kernels.bin8u16u = &binRows<uint8_t, uint16_t>;
+    kernels.bin16u16u = &binRows<uint16_t, uint16_t>;
+    kernels.accumulate8u = &accumulateRows<uint8_t>;
+    kernels.accumulate16u = &accumulateRows<uint16_t>;
+    kernels.store8u = &storeRows<uint8_t>;
+    kernels.store16u = &storeRows<uint16_t>;
+    kernels.weightedSum8u = &weightedSum<uint8_t>;
+    kernels.weightedSum16u = &weightedSum<uint16_t>;
+    kernels.weightedSum32f = &weightedSum<float>;
+    kernels.percentileRow = &percentileRow;
+
+    return kernels;
+}
+
+} // namespace
+
+const PixelKernels *PIXEL_KERNELS_TABLE()
+{
+    static const PixelKernels kernels = makeKernelTable(PIXEL_KERNELS_ISA_NAME);
+    return &kernels;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIXELPLANE_H
+#define PIXELPLANE_H
+
+#include <opencv2/core.hpp>
+
+#include "pixelkernels.h"
+
+/**
+ * View the pixels of a matrix as a plane for the pixel kernels.
+ */
+template<typename T>
+inline PixelPlane<T> pixelPlane(const cv::Mat &mat)
+{
+    PixelPlane<T> plane;
+    plane.data = reinterpret_cast<T*>(mat.data);
+    plane.step = mat.step[0];
+    plane.rows = mat.rows;
+    plane.cols = mat.cols * mat.channels();
+    return plane;
+}
+
+/**
+ * The rows begin to end of a plane, to process a stripe of it.
+ */
+template<typename T>
+inline PixelPlane<T> planeRows(const PixelPlane<T> &plane, int begin, int end)
+{
+    auto stripe = plane;
+    if (plane.data != nullptr)
+        stripe.data = reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(plane.data) + static_cast<size_t>(begin) * plane.step);
+    stripe.rows = end - begin;
+    return stripe;
+}
+
+#endif // PIXELPLANE_H
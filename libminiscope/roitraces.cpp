@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "roitraces.h"
+#include "pixelkernels.h"
+
+#include <boost/format.hpp>
+#include <opencv2/imgproc.hpp>
+
+static const uint32_t ROI_TRACE_FILE_VERSION = 1;
+
+RoiTraceExtractor::RoiTraceExtractor()
+    : m_width(0),
+      m_height(0),
+      m_baselineFrames(600),
+      m_haveBaseline(false)
+{
+    m_roiRuns.push_back(0);
+}
+
+bool RoiTraceExtractor::compile(const std::vector<cv::Mat> &footprints)
+{
+    m_runs.clear();
+    m_weights.clear();
+    m_weightSums.clear();
+    m_roiRuns.clear();
+    m_roiRuns.push_back(0);
+    m_width = 0;
+    m_height = 0;
+    resetBaseline();
+
+    for (size_t i = 0; i < footprints.size(); i++) {
+        const auto &fp = footprints[i];
+        if (fp.empty() || fp.channels() != 1) {
+            m_lastError = boost::str(boost::format("Footprint of ROI %1% is empty or not single-channel.") % i);
+            return false;
+        }
+        if (i == 0) {
+            m_width = fp.cols;
+            m_height = fp.rows;
+        } else if (fp.cols != m_width || fp.rows != m_height) {
+            m_lastError = boost::str(boost::format("Footprint of ROI %1% has a size of %2%x%3%, expected %4%x%5%.")
+                                     % i % fp.cols % fp.rows % m_width % m_height);
+            return false;
+        }
+
+        // masks have unit weights, anything else is a weight map
+        cv::Mat weights;
+        fp.convertTo(weights, CV_32F);
+        if (fp.depth() == CV_8U)
+            weights.setTo(cv::Scalar(1), fp);
+
+        double weightSum = 0;
+        for (int y = 0; y < weights.rows; y++) {
+            const auto row = weights.ptr<float>(y);
+            int x = 0;
+            while (x < weights.cols) {
+                if (row[x] == 0) {
+                    x++;
+                    continue;
+                }
+
+                PixelRun run;
+                run.row = y;
+                run.col = x;
+                run.weightIndex = m_weights.size();
+                while (x < weights.cols && row[x] != 0) {
+                    m_weights.push_back(row[x]);
+                    weightSum += row[x];
+                    x++;
+                }
+                run.length = static_cast<uint>(x - run.col);
+                m_runs.push_back(run);
+            }
+        }
+
+        if (weightSum <= 0) {
+            m_lastError = boost::str(boost::format("ROI %1% has no pixels with a positive total weight.") % i);
+            m_roiRuns.resize(1);
+            m_runs.clear();
+            m_weights.clear();
+            m_weightSums.clear();
+            return false;
+        }
+        m_weightSums.push_back(static_cast<float>(weightSum));
+        m_roiRuns.push_back(m_runs.size());
+    }
+
+    return true;
+}
+
+size_t RoiTraceExtractor::roisCount() const
+{
+    return m_weightSums.size();
+}
+
+size_t RoiTraceExtractor::pixelsCount() const
+{
+    return m_weights.size();
+}
+
+uint RoiTraceExtractor::baselineFrames() const
+{
+    return m_baselineFrames;
+}
+
+/**
+ * Set the number of frames the baseline F0 averages over.
+ */
+void RoiTraceExtractor::setBaselineFrames(uint frames)
+{
+    m_baselineFrames = (frames < 1)? 1 : frames;
+}
+
+void RoiTraceExtractor::resetBaseline()
+{
+    m_baseline.assign(roisCount(), 0);
+    m_haveBaseline = false;
+}
+
+std::string RoiTraceExtractor::lastError() const
+{
+    return m_lastError;
+}
+
+template<typename T>
+void RoiTraceExtractor::accumulate(const cv::Mat &frame, float (*weightedSum)(const float*, const T*, size_t),
+                                   std::vector<float> &fluorescence) const
+{
+    const auto weights = m_weights.data();
+    for (size_t roi = 0; roi < m_weightSums.size(); roi++) {
+        float sum = 0;
+        for (auto r = m_roiRuns[roi]; r < m_roiRuns[roi + 1]; r++) {
+            const auto &run = m_runs[r];
+            sum += weightedSum(weights + run.weightIndex, frame.ptr<T>(run.row) + run.col, run.length);
+        }
+        fluorescence[roi] = sum / m_weightSums[roi];
+    }
+}
+
+bool RoiTraceExtractor::process(const cv::Mat &frame, const FrameMetadata &meta, RoiTraces *traces)
+{
+    if (frame.cols != m_width || frame.rows != m_height) {
+        m_lastError = boost::str(boost::format("Frame size %1%x%2% does not match the ROI footprints (%3%x%4%).")
+                                 % frame.cols % frame.rows % m_width % m_height);
+        return false;
+    }
+
+    cv::Mat gray = frame;
+    if (frame.channels() == 3)
+        cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    else if (frame.channels() != 1) {
+        m_lastError = "Only grayscale and BGR frames are supported.";
+        return false;
+    }
+
+    const auto count = roisCount();
+    traces->meta = meta;
+    traces->fluorescence.resize(count);
+    traces->dff.resize(count);
+
+    const auto &kernels = pixelKernels();
+    switch (gray.depth()) {
+    case CV_8U:
+        accumulate<uint8_t>(gray, kernels.weightedSum8u, traces->fluorescence);
+        break;
+    case CV_16U:
+        accumulate<uint16_t>(gray, kernels.weightedSum16u, traces->fluorescence);
+        break;
+    case CV_32F:
+        accumulate<float>(gray, kernels.weightedSum32f, traces->fluorescence);
+        break;
+    default:
+        m_lastError = "Unsupported frame depth for ROI trace extraction.";
+        return false;
+    }
+
+    if (!m_haveBaseline) {
+        for (size_t i = 0; i < count; i++)
+            m_baseline[i] = traces->fluorescence[i];
+        m_haveBaseline = true;
+    }
+
+    const auto alpha = 1.0 / m_baselineFrames;
+    for (size_t i = 0; i < count; i++) {
+        const double f = traces->fluorescence[i];
+        const auto f0 = m_baseline[i];
+        traces->dff[i] = (f0 > 0)? static_cast<float>((f - f0) / f0) : 0.0f;
+        m_baseline[i] = alpha * f + (1 - alpha) * f0;
+    }
+
+    return true;
+}
+
+RoiTraceWriter::RoiTraceWriter()
+{
+}
+
+RoiTraceWriter::~RoiTraceWriter()
+{
+    close();
+}
+
+bool RoiTraceWriter::open(const std::string &fname)
+{
+    close();
+    m_file.open(fname, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m_file.is_open())
+        return false;
+
+    m_file.write("MSRT", 4);
+    m_file.write(reinterpret_cast<const char*>(&ROI_TRACE_FILE_VERSION), sizeof(ROI_TRACE_FILE_VERSION));
+    return m_file.good();
+}
+
+void RoiTraceWriter::close()
+{
+    if (m_file.is_open())
+        m_file.close();
+}
+
+bool RoiTraceWriter::isOpen() const
+{
+    return m_file.is_open();
+}
+
+bool RoiTraceWriter::write(const RoiTraces &traces)
+{
+    const uint32_t header[2] = {static_cast<uint32_t>(traces.fluorescence.size()), 0};
+    const double times[2] = {traces.meta.timestamp, traces.meta.hostTimestamp};
+    const uint64_t sequence = traces.meta.sequence;
+
+    m_file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    m_file.write(reinterpret_cast<const char*>(&sequence), sizeof(sequence));
+    m_file.write(reinterpret_cast<const char*>(times), sizeof(times));
+    m_file.write(reinterpret_cast<const char*>(traces.fluorescence.data()),
+                 static_cast<std::streamsize>(traces.fluorescence.size() * sizeof(float)));
+    m_file.write(reinterpret_cast<const char*>(traces.dff.data()),
+                 static_cast<std::streamsize>(traces.dff.size() * sizeof(float)));
+    return m_file.good();
+}
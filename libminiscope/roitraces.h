@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ROITRACES_H
+#define ROITRACES_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+#include "mstypes.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief The RoiTraceExtractor class
+ *
+ * Computes the fluorescence of a fixed set of regions of interest in every frame.
+ *
+ * ROIs are given as footprints of the frame size: 8-bit masks (every nonzero
+ * pixel has weight 1) or floating-point weight maps. They are compiled into
+ * horizontal runs of nonzero pixels, stored per ROI in compressed sparse row
+ * order with one contiguous weight array, so processing a frame only touches the
+ * pixels of the ROIs and the innermost loop runs over contiguous memory.
+ *
+ * The baseline F0 of each ROI is an exponential moving average of its fluorescence.
+ */
+class RoiTraceExtractor
+{
+public:
+    RoiTraceExtractor();
+
+    bool compile(const std::vector<cv::Mat> &footprints);
+    size_t roisCount() const;
+    size_t pixelsCount() const;
+
+    uint baselineFrames() const;
+    void setBaselineFrames(uint frames);
+    void resetBaseline();
+
+    bool process(const cv::Mat &frame, const FrameMetadata &meta, RoiTraces *traces);
+
+    std::string lastError() const;
+
+private:
+    struct PixelRun {
+        int row;
+        int col;
+        uint length;
+        size_t weightIndex;
+    };
+
+    int m_width;
+    int m_height;
+    std::vector<size_t> m_roiRuns;      // index of the first run of each ROI, plus end marker
+    std::vector<PixelRun> m_runs;
+    std::vector<float> m_weights;
+    std::vector<float> m_weightSums;
+
+    uint m_baselineFrames;
+    std::vector<double> m_baseline;
+    bool m_haveBaseline;
+
+    std::string m_lastError;
+
+    template<typename T>
+    void accumulate(const cv::Mat &frame, float (*weightedSum)(const float*, const T*, size_t),
+                    std::vector<float> &fluorescence) const;
+};
+
+/**
+ * @brief Writes ROI traces to a binary file.
+ *
+ * The file starts with the 4 bytes "MSRT" and a uint32 format version, followed by one
+ * record per frame: uint32 number of ROIs n, uint32 reserved, uint64 frame sequence number,
+ * double driver timestamp (msec), double host timestamp (msec), n float32 fluorescence values
+ * and n float32 dF/F values. All values are in the byte order of the recording host.
+ */
+class RoiTraceWriter
+{
+public:
+    RoiTraceWriter();
+    ~RoiTraceWriter();
+
+    bool open(const std::string &fname);
+    void close();
+    bool isOpen() const;
+
+    bool write(const RoiTraces &traces);
+
+private:
+    std::ofstream m_file;
+};
+
+#pragma GCC diagnostic pop
+
+#endif // ROITRACES_H
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stripepool.h"
+
+#include <chrono>
+#include <algorithm>
+#include <boost/format.hpp>
+
+#include "tracerecorder.h"
+#include "framesource.h"
+#include "framereduction.h"
+#include "displaykernels.h"
+
+/**
+ * Create a new pool, using the given number of threads including the one calling run().
+ * If zero, half of the CPU cores are used, but no more than four threads.
+ */
+StripePool::StripePool(uint threadsCount)
+    : m_running(true),
+      m_jobGeneration(0),
+      m_func(nullptr),
+      m_rows(0),
+      m_stripeRows(0),
+      m_stripesCount(0),
+      m_nextStripe(0),
+      m_stripesDone(0),
+      m_activeWorkers(0),
+      m_schedulingGeneration(0),
+      m_schedulingInfo("default")
+{
+    if (threadsCount == 0)
+        threadsCount = std::min(4u, std::max(1u, std::thread::hardware_concurrency() / 2));
+
+    // the helpers trace into the session of the thread that creates them
+    for (uint i = 1; i < threadsCount; i++)
+        m_threads.emplace_back(&StripePool::workerThread, this, i, TraceRecorder::threadSession());
+}
+
+StripePool::~StripePool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+    }
+    m_workCond.notify_all();
+    for (auto &t : m_threads)
+        t.join();
+}
+
+/**
+ * Number of threads working on a job, including the calling thread.
+ */
+uint StripePool::threadsCount() const
+{
+    return static_cast<uint>(m_threads.size()) + 1;
+}
+
+/**
+ * Claim and process stripes of the given job until none are left.
+ * Returns the number of stripes this thread processed.
+ */
+int StripePool::processStripes(const StripeFunc &func, int rows, int stripeRows, int stripesCount)
+{
+    int done = 0;
+    while (true) {
+        const auto stripe = m_nextStripe.fetch_add(1);
+        if (stripe >= stripesCount)
+            break;
+        const auto begin = stripe * stripeRows;
+        func(begin, std::min(rows, begin + stripeRows));
+        done++;
+    }
+
+    return done;
+}
+
+/**
+ * Call func for stripes of the rows 0 to rows, in parallel, and return
+ * once all rows were processed. Stripes have at least minStripeRows rows,
+ * except for the last one.
+ */
+void StripePool::run(int rows, int minStripeRows, const StripeFunc &func)
+{
+    if (rows <= 0)
+        return;
+    minStripeRows = std::max(1, minStripeRows);
+
+    // a few stripes per thread, so threads that are preempted do not hold up the others
+    const auto maxStripes = static_cast<int>(threadsCount()) * 4;
+    const auto stripesCount = std::min(maxStripes, (rows + minStripeRows - 1) / minStripeRows);
+    std::unique_lock<std::mutex> jobLock(m_jobMutex, std::try_to_lock);
+    if (m_threads.empty() || stripesCount <= 1 || !jobLock.owns_lock()) {
+        func(0, rows);
+        return;
+    }
+    const auto stripeRows = (rows + stripesCount - 1) / stripesCount;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_func = &func;
+        m_rows = rows;
+        m_stripeRows = stripeRows;
+        m_stripesCount = (rows + stripeRows - 1) / stripeRows;
+        m_nextStripe = 0;
+        m_stripesDone = 0;
+        m_jobGeneration++;
+    }
+    m_workCond.notify_all();
+
+    const auto done = processStripes(func, rows, stripeRows, m_stripesCount);
+
+    // workers may still be busy with their last stripe, and must be done with
+    // this job before we let the next one overwrite it
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_stripesDone += done;
+    m_doneCond.wait(lock, [&] { return (m_stripesDone == m_stripesCount) && (m_activeWorkers == 0); });
+    m_func = nullptr;
+}
+
+/**
+ * Set CPU affinity, scheduling policy and I/O priority of all worker threads.
+ * Every worker applies them before working on its next job.
+ */
+void StripePool::setThreadScheduling(const ThreadSchedulingOptions &options)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_scheduling = options;
+    m_schedulingGeneration++;
+}
+
+/**
+ * Description of the scheduling settings the workers last applied.
+ */
+std::string StripePool::threadSchedulingInfo() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_schedulingInfo;
+}
+
+void StripePool::workerThread(uint index, uint traceSession)
+{
+    TraceRecorder::setThreadSession(traceSession);
+    TraceRecorder::setThreadName(boost::str(boost::format("processing %1%") % index));
+    uint64_t jobGeneration = 0;
+    uint schedulingGeneration = 0;
+    while (true) {
+        const StripeFunc *func;
+        int rows;
+        int stripeRows;
+        int stripesCount;
+        ThreadSchedulingOptions scheduling;
+        bool schedulingChanged;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_workCond.wait(lock, [&] { return (jobGeneration != m_jobGeneration) || !m_running; });
+            if (!m_running)
+                return;
+            jobGeneration = m_jobGeneration;
+
+            // the job may already be done if we woke up late
+            if (m_func == nullptr)
+                continue;
+            func = m_func;
+            rows = m_rows;
+            stripeRows = m_stripeRows;
+            stripesCount = m_stripesCount;
+            m_activeWorkers++;
+
+            schedulingChanged = schedulingGeneration != m_schedulingGeneration;
+            schedulingGeneration = m_schedulingGeneration;
+            scheduling = m_scheduling;
+        }
+
+        if (schedulingChanged) {
+            const auto info = applyThreadScheduling(scheduling);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_schedulingInfo = info;
+        }
+
+        const auto done = processStripes(*func, rows, stripeRows, stripesCount);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stripesDone += done;
+            m_activeWorkers--;
+        }
+        m_doneCond.notify_one();
+    }
+}
+
+/**
+ * Process rows in stripes on the given pool, or all at once
+ * on the calling thread if there is no pool.
+ */
+void runStripes(StripePool *pool, int rows, int minStripeRows, const StripePool::StripeFunc &func)
+{
+    if (pool == nullptr) {
+        if (rows > 0)
+            func(0, rows);
+        return;
+    }
+    pool->run(rows, minStripeRows, func);
+}
+
+/**
+ * Measure the frame rate of the striped per-frame processing of the capture thread
+ * (2x2 binning and temporal binning of the recorded frames, F/F0 display of grayscale
+ * frames) on synthetic frames of the given size, with 1 to maxThreads threads.
+ */
+std::vector<StripeScalingBenchmark> benchmarkStripeScaling(int width, int height, uint maxThreads)
+{
+    using clock = std::chrono::steady_clock;
+    std::vector<StripeScalingBenchmark> report;
+
+    SyntheticFrameSource source(width, height);
+    source.open(0);
+    cv::Mat frame;
+    source.retrieve(frame);
+    source.release();
+
+    FrameReduction reduction;
+    reduction.binning = 2;
+    const auto kernel = selectDisplayKernel(frame.channels(), BackgroundDiffMethod::DIVISION, true);
+    DisplayKernelParams params;
+    params.alpha = 0.01f;
+    params.scale = 1.0f;
+    params.offset = 0.0f;
+    params.channelMask[0] = params.channelMask[1] = params.channelMask[2] = 0xFF;
+
+    for (uint threads = 1; threads <= std::max(1u, maxThreads); threads *= 2) {
+        StripePool pool(threads);
+        TemporalBinner binner;
+        binner.reset(4, BinningMode::Mean);
+        cv::Mat reduced, displayFrame, average;
+        DisplayKernelResult result;
+
+        const auto processFrame = [&]() {
+            reduceFrame(frame, reduced, reduction, &pool);
+            binner.add(reduced, FrameMetadata(), &pool);
+            kernel(frame, displayFrame, average, cv::Mat(), params, &result, &pool);
+        };
+
+        processFrame(); // allocate all buffers
+        size_t frames = 0;
+        const auto start = clock::now();
+        std::chrono::duration<double> elapsed(0);
+        do {
+            processFrame();
+            frames++;
+            elapsed = clock::now() - start;
+        } while (elapsed.count() < 0.5);
+
+        StripeScalingBenchmark bench;
+        bench.width = width;
+        bench.height = height;
+        bench.threads = threads;
+        bench.framesPerSecond = frames / elapsed.count();
+        report.push_back(bench);
+    }
+
+    return report;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STRIPEPOOL_H
+#define STRIPEPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include "msexport.h"
+#include "threadscheduling.h"
+
+/**
+ * @brief The StripePool class
+ *
+ * A small set of persistent worker threads that process the rows of a frame
+ * in parallel, split into horizontal stripes.
+ *
+ * The thread calling run() works on stripes as well, and returns once all of them
+ * are done. Stripes are claimed one by one from a shared counter, so threads that
+ * finish early simply take more of them and a stalled thread does not hold up the rest.
+ * Only one job runs at a time: if the pool is busy with the job of another thread,
+ * the caller processes all of its rows itself instead of waiting.
+ *
+ * The pool is separate from the encoder pool, so its threads can be given
+ * CPU cores of their own.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+class StripePool
+{
+public:
+    using StripeFunc = std::function<void(int begin, int end)>;
+
+    explicit StripePool(uint threadsCount = 0);
+    ~StripePool();
+
+    uint threadsCount() const;
+
+    void run(int rows, int minStripeRows, const StripeFunc &func);
+
+    void setThreadScheduling(const ThreadSchedulingOptions &options);
+    std::string threadSchedulingInfo() const;
+
+private:
+    std::vector<std::thread> m_threads;
+    std::mutex m_jobMutex; // held by the thread whose job the pool is running
+    mutable std::mutex m_mutex;
+    std::condition_variable m_workCond;
+    std::condition_variable m_doneCond;
+    bool m_running;
+
+    // the current job
+    uint64_t m_jobGeneration;
+    const StripeFunc *m_func;
+    int m_rows;
+    int m_stripeRows;
+    int m_stripesCount;
+    std::atomic<int> m_nextStripe;
+    int m_stripesDone;
+    uint m_activeWorkers;
+
+    ThreadSchedulingOptions m_scheduling;
+    uint m_schedulingGeneration; // incremented whenever the options change
+    std::string m_schedulingInfo;
+
+    int processStripes(const StripeFunc &func, int rows, int stripeRows, int stripesCount);
+    void workerThread(uint index, uint traceSession);
+};
+
+void runStripes(StripePool *pool, int rows, int minStripeRows, const StripePool::StripeFunc &func);
+
+/**
+ * @brief Frame rate of the striped frame processing with a given number of threads.
+ */
+struct StripeScalingBenchmark
+{
+    int width;
+    int height;
+    uint threads;
+    double framesPerSecond;
+};
+#pragma GCC diagnostic pop
+
+MS_LIB_EXPORT std::vector<StripeScalingBenchmark> benchmarkStripeScaling(int width, int height, uint maxThreads = 8);
+
+#endif // STRIPEPOOL_H
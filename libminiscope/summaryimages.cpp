@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "summaryimages.h"
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+SummaryAccumulator::SummaryAccumulator()
+    : m_count(0)
+{
+}
+
+void SummaryAccumulator::reset()
+{
+    m_size = cv::Size();
+    m_count = 0;
+}
+
+uint64_t SummaryAccumulator::framesCount() const
+{
+    return m_count;
+}
+
+/**
+ * Add a frame to the summary. Returns false if its size differs from
+ * the frames added before.
+ */
+bool SummaryAccumulator::add(const cv::Mat &frame)
+{
+    if (frame.empty())
+        return false;
+    if (m_count == 0) {
+        m_size = frame.size();
+        m_mean = cv::Mat::zeros(m_size, CV_64F);
+        m_m2 = cv::Mat::zeros(m_size, CV_64F);
+        m_max = cv::Mat::zeros(m_size, CV_32F);
+        m_crossRight = cv::Mat::zeros(m_size, CV_64F);
+        m_crossDown = cv::Mat::zeros(m_size, CV_64F);
+        m_crossDownRight = cv::Mat::zeros(m_size, CV_64F);
+        m_crossDownLeft = cv::Mat::zeros(m_size, CV_64F);
+    } else if (frame.size() != m_size) {
+        return false;
+    }
+
+    if (frame.channels() == 3) {
+        cv::Mat gray;
+        cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+        gray.convertTo(m_frameF, CV_32F);
+    } else {
+        frame.convertTo(m_frameF, CV_32F);
+    }
+
+    m_count++;
+    const auto invCount = 1.0 / static_cast<double>(m_count);
+    const auto width = m_size.width;
+
+    // all loops below run over contiguous rows without branches, so the compiler
+    // can vectorize them
+    for (int y = 0; y < m_size.height; y++) {
+        const auto x = m_frameF.ptr<float>(y);
+        auto mean = m_mean.ptr<double>(y);
+        auto m2 = m_m2.ptr<double>(y);
+        auto mx = m_max.ptr<float>(y);
+        for (int i = 0; i < width; i++) {
+            const double v = x[i];
+            const auto delta = v - mean[i];
+            mean[i] += delta * invCount;
+            m2[i] += delta * (v - mean[i]);
+            mx[i] = std::max(mx[i], x[i]);
+        }
+
+        auto right = m_crossRight.ptr<double>(y);
+        for (int i = 0; i < width - 1; i++)
+            right[i] += static_cast<double>(x[i]) * x[i + 1];
+
+        if (y + 1 >= m_size.height)
+            continue;
+        const auto below = m_frameF.ptr<float>(y + 1);
+        auto down = m_crossDown.ptr<double>(y);
+        auto downRight = m_crossDownRight.ptr<double>(y);
+        auto downLeft = m_crossDownLeft.ptr<double>(y);
+        for (int i = 0; i < width; i++)
+            down[i] += static_cast<double>(x[i]) * below[i];
+        for (int i = 0; i < width - 1; i++)
+            downRight[i] += static_cast<double>(x[i]) * below[i + 1];
+        for (int i = 1; i < width; i++)
+            downLeft[i] += static_cast<double>(x[i]) * below[i - 1];
+    }
+
+    return true;
+}
+
+SummaryImages SummaryAccumulator::images() const
+{
+    SummaryImages images;
+    images.framesCount = m_count;
+    if (m_count == 0)
+        return images;
+
+    const auto n = static_cast<double>(m_count);
+    const auto width = m_size.width;
+    const auto height = m_size.height;
+
+    m_mean.convertTo(images.mean, CV_32F);
+    m_max.convertTo(images.max, CV_16U);
+
+    cv::Mat stddev(m_size, CV_64F);
+    for (int y = 0; y < height; y++) {
+        const auto m2 = m_m2.ptr<double>(y);
+        auto sd = stddev.ptr<double>(y);
+        for (int i = 0; i < width; i++)
+            sd[i] = std::sqrt(m2[i] / n);
+    }
+    stddev.convertTo(images.stddev, CV_32F);
+
+    // correlation of pixels a and b from the sum of their products
+    const auto corr = [&](int ya, int xa, int yb, int xb, double crossSum) {
+        const auto sdA = stddev.at<double>(ya, xa);
+        const auto sdB = stddev.at<double>(yb, xb);
+        if (sdA <= 0 || sdB <= 0)
+            return 0.0;
+        const auto cov = crossSum / n - m_mean.at<double>(ya, xa) * m_mean.at<double>(yb, xb);
+        return cov / (sdA * sdB);
+    };
+
+    images.correlation = cv::Mat::zeros(m_size, CV_32F);
+    for (int y = 0; y < height; y++) {
+        auto out = images.correlation.ptr<float>(y);
+        for (int x = 0; x < width; x++) {
+            double sum = 0;
+            int count = 0;
+
+            // every neighbor pair is stored once, at the pixel that is further up or left
+            if (x + 1 < width) {
+                sum += corr(y, x, y, x + 1, m_crossRight.at<double>(y, x));
+                count++;
+            }
+            if (x > 0) {
+                sum += corr(y, x - 1, y, x, m_crossRight.at<double>(y, x - 1));
+                count++;
+            }
+            if (y + 1 < height) {
+                sum += corr(y, x, y + 1, x, m_crossDown.at<double>(y, x));
+                count++;
+                if (x + 1 < width) {
+                    sum += corr(y, x, y + 1, x + 1, m_crossDownRight.at<double>(y, x));
+                    count++;
+                }
+                if (x > 0) {
+                    sum += corr(y, x, y + 1, x - 1, m_crossDownLeft.at<double>(y, x));
+                    count++;
+                }
+            }
+            if (y > 0) {
+                sum += corr(y - 1, x, y, x, m_crossDown.at<double>(y - 1, x));
+                count++;
+                if (x > 0) {
+                    sum += corr(y - 1, x - 1, y, x, m_crossDownRight.at<double>(y - 1, x - 1));
+                    count++;
+                }
+                if (x + 1 < width) {
+                    sum += corr(y - 1, x + 1, y, x, m_crossDownLeft.at<double>(y - 1, x + 1));
+                    count++;
+                }
+            }
+
+            out[x] = (count > 0)? static_cast<float>(sum / count) : 0.0f;
+        }
+    }
+
+    return images;
+}
+
+/**
+ * Save summary images as TIFF files named after fnameBase, with
+ * "_mean", "_max", "_std" and "_corr" appended.
+ */
+bool SummaryAccumulator::save(const SummaryImages &images, const std::string &fnameBase, std::string *error)
+{
+    if (images.framesCount == 0) {
+        *error = "No frames were summarized.";
+        return false;
+    }
+
+    const std::vector<std::pair<std::string, cv::Mat>> files = {
+        {"_mean.tiff", images.mean},
+        {"_max.tiff", images.max},
+        {"_std.tiff", images.stddev},
+        {"_corr.tiff", images.correlation}
+    };
+    for (const auto &file : files) {
+        const auto fname = fnameBase + file.first;
+        bool ok;
+        try {
+            ok = cv::imwrite(fname, file.second);
+        } catch (const cv::Exception &) {
+            ok = false;
+        }
+        if (!ok) {
+            *error = boost::str(boost::format("Unable to write summary image %1%") % fname);
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SUMMARYIMAGES_H
+#define SUMMARYIMAGES_H
+
+#include <string>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+#include "mstypes.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+
+/**
+ * @brief The SummaryAccumulator class
+ *
+ * Maintains summary images of a stream of frames incrementally, so they are available
+ * as soon as a recording ends: the mean and variance (with Welford's algorithm),
+ * the maximum and the sums of products of neighboring pixels, from which the local
+ * correlation image is computed.
+ *
+ * Color frames are converted to grayscale first.
+ */
+class SummaryAccumulator
+{
+public:
+    SummaryAccumulator();
+
+    void reset();
+    bool add(const cv::Mat &frame);
+
+    uint64_t framesCount() const;
+    SummaryImages images() const;
+
+    static bool save(const SummaryImages &images, const std::string &fnameBase, std::string *error);
+
+private:
+    cv::Size m_size;
+    uint64_t m_count;
+
+    cv::Mat m_frameF;       // current frame, as float
+    cv::Mat m_mean;         // CV_64F
+    cv::Mat m_m2;           // CV_64F, sum of squared differences from the mean
+    cv::Mat m_max;          // CV_32F
+
+    // sums of products of each pixel with its neighbor to the right, below,
+    // below right and below left (all CV_64F)
+    cv::Mat m_crossRight;
+    cv::Mat m_crossDown;
+    cv::Mat m_crossDownRight;
+    cv::Mat m_crossDownLeft;
+};
+
+#pragma GCC diagnostic pop
+
+#endif // SUMMARYIMAGES_H
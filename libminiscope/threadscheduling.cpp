@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "threadscheduling.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <string.h>
+#include <boost/format.hpp>
+#include <boost/algorithm/string/join.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+/**
+ * Niceness we fall back to if we are not permitted to use a real-time policy.
+ */
+static const int FALLBACK_NICE_LEVEL = -10;
+
+#ifdef __linux__
+// not every C library has wrappers or definitions for the ioprio syscalls
+static const int MS_IOPRIO_CLASS_BE = 2;
+static const int MS_IOPRIO_CLASS_SHIFT = 13;
+static const int MS_IOPRIO_WHO_PROCESS = 1;
+#endif
+
+bool ThreadSchedulingOptions::isDefault() const
+{
+    return cores.empty() && (policy == SchedulingPolicy::Default) && (ioPriority < 0);
+}
+
+#ifdef __linux__
+static std::string ms_apply_affinity(const std::vector<int> &cores)
+{
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    std::vector<std::string> coreNames;
+    for (const auto core : cores) {
+        if ((core < 0) || (core >= CPU_SETSIZE))
+            continue;
+        CPU_SET(core, &cpuset);
+        coreNames.push_back(std::to_string(core));
+    }
+
+    const auto ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (ret != 0)
+        return boost::str(boost::format("cores: failed (%1%)") % strerror(ret));
+    return "cores " + boost::algorithm::join(coreNames, ",");
+}
+
+static std::string ms_apply_policy(SchedulingPolicy policy, int priority)
+{
+    const auto policyId = (policy == SchedulingPolicy::Fifo)? SCHED_FIFO : SCHED_RR;
+    const auto policyName = (policy == SchedulingPolicy::Fifo)? "SCHED_FIFO" : "SCHED_RR";
+    priority = std::max(sched_get_priority_min(policyId), std::min(priority, sched_get_priority_max(policyId)));
+
+    sched_param param;
+    param.sched_priority = priority;
+    auto ret = pthread_setschedparam(pthread_self(), policyId, &param);
+    if (ret == 0)
+        return boost::str(boost::format("%1% %2%") % policyName % priority);
+
+    // unprivileged users may still be granted a limited real-time priority
+    if (ret == EPERM) {
+        rlimit rtLimit;
+        if ((getrlimit(RLIMIT_RTPRIO, &rtLimit) == 0) && (rtLimit.rlim_cur > 0)) {
+            param.sched_priority = std::min(priority, static_cast<int>(rtLimit.rlim_cur));
+            if (pthread_setschedparam(pthread_self(), policyId, &param) == 0)
+                return boost::str(boost::format("%1% %2% (limited by RLIMIT_RTPRIO)") % policyName % param.sched_priority);
+        }
+
+        // no real-time scheduling for us, so try to at least get ahead of normal threads
+        const auto tid = static_cast<id_t>(syscall(SYS_gettid));
+        for (auto nice = FALLBACK_NICE_LEVEL; nice < 0; nice++) {
+            if (setpriority(PRIO_PROCESS, tid, nice) == 0)
+                return boost::str(boost::format("%1% not permitted, using nice %2%") % policyName % nice);
+        }
+        return boost::str(boost::format("%1% not permitted, using default scheduling") % policyName);
+    }
+
+    return boost::str(boost::format("%1%: failed (%2%)") % policyName % strerror(ret));
+}
+
+static std::string ms_apply_io_priority(int level)
+{
+    level = std::max(0, std::min(level, 7));
+    const auto ioprio = (MS_IOPRIO_CLASS_BE << MS_IOPRIO_CLASS_SHIFT) | level;
+    if (syscall(SYS_ioprio_set, MS_IOPRIO_WHO_PROCESS, 0, ioprio) != 0)
+        return boost::str(boost::format("I/O priority: failed (%1%)") % strerror(errno));
+    return boost::str(boost::format("I/O best-effort %1%") % level);
+}
+#endif
+
+/**
+ * Apply the given scheduling options to the calling thread. Options which
+ * can not be applied are skipped, or replaced by the closest permitted setting.
+ *
+ * @return A human-readable description of the scheduling settings now in effect.
+ */
+std::string applyThreadScheduling(const ThreadSchedulingOptions &options)
+{
+    if (options.isDefault())
+        return "default";
+
+#ifdef __linux__
+    std::vector<std::string> applied;
+    if (!options.cores.empty())
+        applied.push_back(ms_apply_affinity(options.cores));
+    if (options.policy != SchedulingPolicy::Default)
+        applied.push_back(ms_apply_policy(options.policy, options.priority));
+    if (options.ioPriority >= 0)
+        applied.push_back(ms_apply_io_priority(options.ioPriority));
+
+    return boost::algorithm::join(applied, "; ");
+#else
+    return "not supported on this platform";
+#endif
+}
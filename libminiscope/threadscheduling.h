@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREADSCHEDULING_H
+#define THREADSCHEDULING_H
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief Scheduling policies a thread can be run with.
+ */
+enum class SchedulingPolicy {
+    Default,    /// normal time-sharing scheduling
+    Fifo,       /// real-time, first in first out (SCHED_FIFO)
+    RoundRobin  /// real-time, round robin (SCHED_RR)
+};
+
+/**
+ * @brief Scheduling options of a thread.
+ */
+struct ThreadSchedulingOptions
+{
+    ThreadSchedulingOptions()
+        : policy(SchedulingPolicy::Default),
+          priority(0),
+          ioPriority(-1)
+    {}
+
+    std::vector<int> cores;   // CPU cores the thread may run on, empty for any
+    SchedulingPolicy policy;
+    int priority;             // real-time priority (1 - 99), for the real-time policies
+    int ioPriority;           // best-effort I/O priority (0 - 7, 0 is highest), -1 to keep the default
+
+    bool isDefault() const;
+};
+
+std::string applyThreadScheduling(const ThreadSchedulingOptions &options);
+
+#endif // THREADSCHEDULING_H
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "tracerecorder.h"
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <iomanip>
+
+/**
+ * @brief TRACE_BUFFER_SIZE
+ * Number of events we keep per thread before overwriting the oldest ones.
+ */
+static const size_t TRACE_BUFFER_SIZE = 32768;
+
+namespace {
+
+struct TraceEvent
+{
+    const char *name;
+    int64_t startNs;
+    int64_t durationNs;
+    int64_t arg;
+    char phase;
+};
+
+/**
+ * A slot of the ring buffer. Its sequence number is odd while the owning thread
+ * writes the event, so the exporter can read it concurrently and skip torn events.
+ */
+struct TraceSlot
+{
+    std::atomic<uint64_t> seq;
+    std::atomic<const char*> name;
+    std::atomic<int64_t> startNs;
+    std::atomic<int64_t> durationNs;
+    std::atomic<int64_t> arg;
+    std::atomic<char> phase;
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+class ThreadTraceBuffer
+{
+public:
+    ThreadTraceBuffer(uint id, uint sessionId)
+        : tid(id),
+          session(sessionId),
+          slots(TRACE_BUFFER_SIZE),
+          writeIndex(0),
+          retired(false)
+    {}
+
+    // only ever called from the thread owning this buffer
+    void push(const TraceEvent &ev)
+    {
+        const auto idx = writeIndex.load(std::memory_order_relaxed);
+        auto &slot = slots[idx % slots.size()];
+        slot.seq.store(idx * 2 + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.name.store(ev.name, std::memory_order_relaxed);
+        slot.startNs.store(ev.startNs, std::memory_order_relaxed);
+        slot.durationNs.store(ev.durationNs, std::memory_order_relaxed);
+        slot.arg.store(ev.arg, std::memory_order_relaxed);
+        slot.phase.store(ev.phase, std::memory_order_relaxed);
+        slot.seq.store(idx * 2 + 2, std::memory_order_release);
+        writeIndex.store(idx + 1, std::memory_order_release);
+    }
+
+    // read the event with the given index, returns false if it was overwritten
+    bool read(uint64_t idx, TraceEvent *ev) const
+    {
+        const auto &slot = slots[idx % slots.size()];
+        const auto seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != idx * 2 + 2)
+            return false;
+        ev->name = slot.name.load(std::memory_order_relaxed);
+        ev->startNs = slot.startNs.load(std::memory_order_relaxed);
+        ev->durationNs = slot.durationNs.load(std::memory_order_relaxed);
+        ev->arg = slot.arg.load(std::memory_order_relaxed);
+        ev->phase = slot.phase.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot.seq.load(std::memory_order_relaxed) == seq;
+    }
+
+    uint tid;
+    uint session;   // session the thread works for, 0 for all of them
+    std::string name;
+    std::vector<TraceSlot> slots;
+    std::atomic<uint64_t> writeIndex;
+    std::atomic_bool retired;
+};
+
+struct TraceSession
+{
+    int64_t startNs;
+    std::map<uint, uint64_t> exportedIndex; // by thread ID
+};
+
+class TraceRegistry
+{
+public:
+    TraceRegistry()
+        : sessionsCount(0),
+          nextTid(1),
+          nextSession(1)
+    {}
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadTraceBuffer>> buffers;
+    std::map<uint, TraceSession> sessions;
+    std::atomic_int sessionsCount;
+    uint nextTid;
+    uint nextSession;
+};
+#pragma GCC diagnostic pop
+
+}
+
+static TraceRegistry &trace_registry()
+{
+    static TraceRegistry registry;
+    return registry;
+}
+
+/**
+ * Whether a session still has to export events of a buffer.
+ */
+static bool session_needs_buffer(uint sessionId, const TraceSession &session, const ThreadTraceBuffer &buf)
+{
+    if (buf.session != 0 && buf.session != sessionId)
+        return false;
+    const auto it = session.exportedIndex.find(buf.tid);
+    const auto exported = (it == session.exportedIndex.end())? 0 : it->second;
+    return exported < buf.writeIndex.load(std::memory_order_acquire);
+}
+
+/**
+ * Free the buffers of threads that have exited, once no session needs their
+ * events anymore. Must be called with the registry locked.
+ */
+static void drop_retired_buffers(TraceRegistry &reg)
+{
+    for (auto it = reg.buffers.begin(); it != reg.buffers.end();) {
+        const auto &buf = **it;
+        bool needed = false;
+        if (buf.retired) {
+            for (const auto &s : reg.sessions)
+                needed = needed || session_needs_buffer(s.first, s.second, buf);
+        }
+
+        if (buf.retired && !needed) {
+            for (auto &s : reg.sessions)
+                s.second.exportedIndex.erase(buf.tid);
+            it = reg.buffers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+namespace {
+
+/**
+ * The trace buffer of a thread, which is only allocated once the thread records
+ * an event, its name and the session it works for.
+ * When the thread exits, its buffer is marked as retired, and dropped once all
+ * sessions exported its events.
+ */
+class ThreadBufferHandle
+{
+public:
+    ThreadBufferHandle()
+        : buffer(nullptr),
+          session(0)
+    {}
+
+    ~ThreadBufferHandle()
+    {
+        if (buffer == nullptr)
+            return;
+
+        auto &reg = trace_registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        buffer->retired = true;
+        drop_retired_buffers(reg);
+    }
+
+    ThreadTraceBuffer *buffer;
+    std::string name;
+    uint session;
+};
+
+}
+
+static thread_local ThreadBufferHandle tls_trace_buffer;
+
+static ThreadTraceBuffer *thread_trace_buffer()
+{
+    if (tls_trace_buffer.buffer != nullptr)
+        return tls_trace_buffer.buffer;
+
+    auto &reg = trace_registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    std::unique_ptr<ThreadTraceBuffer> buf(new ThreadTraceBuffer(reg.nextTid++, tls_trace_buffer.session));
+    buf->name = tls_trace_buffer.name;
+    tls_trace_buffer.buffer = buf.get();
+    reg.buffers.push_back(std::move(buf));
+    return tls_trace_buffer.buffer;
+}
+
+static inline int64_t trace_time_ns(const steady_hr_clock::time_point &tp)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+}
+
+static std::string json_escape(const std::string &str)
+{
+    std::string res;
+    res.reserve(str.size());
+    for (const auto c : str) {
+        if (c == '"' || c == '\\')
+            res.push_back('\\');
+        if (static_cast<unsigned char>(c) >= 0x20)
+            res.push_back(c);
+    }
+    return res;
+}
+
+/**
+ * Start a new trace session, and return its ID.
+ */
+uint TraceRecorder::beginSession()
+{
+    auto &reg = trace_registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    const auto id = reg.nextSession++;
+    TraceSession session;
+    session.startNs = trace_time_ns(steady_hr_clock::now());
+    reg.sessions[id] = session;
+    reg.sessionsCount++;
+    return id;
+}
+
+void TraceRecorder::endSession(uint session)
+{
+    auto &reg = trace_registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    if (reg.sessions.erase(session) > 0)
+        reg.sessionsCount--;
+
+    // the session will not export the events of exited threads anymore
+    drop_retired_buffers(reg);
+}
+
+bool TraceRecorder::enabled()
+{
+    return trace_registry().sessionsCount.load(std::memory_order_relaxed) > 0;
+}
+
+/**
+ * Set the name of the calling thread in traces. This does not allocate
+ * a trace buffer, so it is cheap to call when tracing is disabled.
+ */
+void TraceRecorder::setThreadName(const std::string &name)
+{
+    tls_trace_buffer.name = name;
+    if (tls_trace_buffer.buffer == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> lock(trace_registry().mutex);
+    tls_trace_buffer.buffer->name = name;
+}
+
+/**
+ * The session the calling thread works for, which threads it starts should
+ * pass on to setThreadSession().
+ */
+uint TraceRecorder::threadSession()
+{
+    return tls_trace_buffer.session;
+}
+
+/**
+ * Assign the calling thread to a trace session, so its events are only part
+ * of that session's trace. Threads of session 0 are part of every trace.
+ */
+void TraceRecorder::setThreadSession(uint session)
+{
+    tls_trace_buffer.session = session;
+    if (tls_trace_buffer.buffer == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> lock(trace_registry().mutex);
+    tls_trace_buffer.buffer->session = session;
+}
+
+void TraceRecorder::instant(const char *name, int64_t arg)
+{
+    if (!enabled())
+        return;
+    thread_trace_buffer()->push({name, trace_time_ns(steady_hr_clock::now()), 0, arg, 'i'});
+}
+
+void TraceRecorder::complete(const char *name,
+                             const steady_hr_clock::time_point &start,
+                             const steady_hr_clock::time_point &end,
+                             int64_t arg)
+{
+    if (!enabled())
+        return;
+    const auto startNs = trace_time_ns(start);
+    thread_trace_buffer()->push({name, startNs, trace_time_ns(end) - startNs, arg, 'X'});
+}
+
+/**
+ * Write the events of a session that were not exported before.
+ * Events its threads are writing at the same time are skipped.
+ */
+bool TraceRecorder::exportChromeTrace(uint session, const std::string &fname)
+{
+    std::ofstream f(fname);
+    if (!f.is_open())
+        return false;
+
+    auto &reg = trace_registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    const auto sit = reg.sessions.find(session);
+    if (sit == reg.sessions.end())
+        return false;
+    auto &traceSession = sit->second;
+
+    f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    f << std::fixed << std::setprecision(3);
+    bool first = true;
+    for (auto &buf : reg.buffers) {
+        if (buf->session != 0 && buf->session != session)
+            continue;
+
+        if (!first)
+            f << ",\n";
+        first = false;
+        f << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buf->tid
+          << ",\"args\":{\"name\":\"" << json_escape(buf->name.empty()? "thread" : buf->name) << "\"}}";
+
+        // only export events we did not export previously, and which were not overwritten yet
+        auto &exportedIndex = traceSession.exportedIndex[buf->tid];
+        const auto writeIndex = buf->writeIndex.load(std::memory_order_acquire);
+        auto startIndex = exportedIndex;
+        if (writeIndex - startIndex > buf->slots.size())
+            startIndex = writeIndex - buf->slots.size();
+
+        TraceEvent ev;
+        for (auto i = startIndex; i < writeIndex; i++) {
+            if (!buf->read(i, &ev))
+                continue;
+            // threads shared by several sessions may have recorded events before this one began
+            if (ev.startNs < traceSession.startNs)
+                continue;
+            f << ",\n{\"name\":\"" << ev.name << "\",\"cat\":\"miniscope\",\"ph\":\"" << ev.phase << "\""
+              << ",\"pid\":1,\"tid\":" << buf->tid
+              << ",\"ts\":" << ev.startNs / 1000.0;
+            if (ev.phase == 'X')
+                f << ",\"dur\":" << ev.durationNs / 1000.0;
+            else
+                f << ",\"s\":\"t\"";
+            if (ev.arg >= 0)
+                f << ",\"args\":{\"value\":" << ev.arg << "}";
+            f << "}";
+        }
+        exportedIndex = writeIndex;
+    }
+    f << "\n]}\n";
+
+    // drop the buffers of threads that have exited, if all of their events are exported now
+    drop_retired_buffers(reg);
+
+    return f.good();
+}
+
+TraceScope::TraceScope(const char *name, int64_t arg)
+    : m_name(name),
+      m_arg(arg),
+      m_active(TraceRecorder::enabled())
+{
+    if (m_active)
+        m_start = steady_hr_clock::now();
+}
+
+TraceScope::~TraceScope()
+{
+    if (m_active)
+        TraceRecorder::complete(m_name, m_start, steady_hr_clock::now(), m_arg);
+}
+
+void TraceScope::setArg(int64_t arg)
+{
+    m_arg = arg;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACERECORDER_H
+#define TRACERECORDER_H
+
+#include <string>
+#include <cstdint>
+
+#include "pipelinestats.h"
+
+/**
+ * @brief The TraceRecorder class
+ *
+ * Records timestamped events of the acquisition and encoding threads, so stalls
+ * and dropped frames can be inspected on a timeline after a session.
+ *
+ * Every thread writes into its own fixed-size ring buffer without taking any locks,
+ * only the most recent events of each thread are kept if a buffer overflows.
+ * Recorded events are exported in the Chrome trace event JSON format, which can be
+ * loaded into chrome://tracing or the Perfetto UI.
+ *
+ * Several sessions (e.g. of several devices) may be traced at once. Threads are
+ * assigned to the session they work for, and threads assigned to no session (like
+ * shared encoder threads) are part of every session's trace.
+ *
+ * Event names must be string literals (or otherwise outlive the recorder).
+ */
+class TraceRecorder
+{
+public:
+    static uint beginSession();
+    static void endSession(uint session);
+    static bool enabled();
+
+    static void setThreadName(const std::string &name);
+    static uint threadSession();
+    static void setThreadSession(uint session);
+
+    static void instant(const char *name, int64_t arg = -1);
+    static void complete(const char *name,
+                         const steady_hr_clock::time_point &start,
+                         const steady_hr_clock::time_point &end,
+                         int64_t arg = -1);
+
+    static bool exportChromeTrace(uint session, const std::string &fname);
+
+private:
+    TraceRecorder() = delete;
+};
+
+/**
+ * @brief Records a complete event spanning the lifetime of this object,
+ * if tracing is enabled.
+ */
+class TraceScope
+{
+public:
+    explicit TraceScope(const char *name, int64_t arg = -1);
+    ~TraceScope();
+
+    void setArg(int64_t arg);
+
+private:
+    const char *m_name;
+    int64_t m_arg;
+    bool m_active;
+    steady_hr_clock::time_point m_start;
+};
+
+#define MS_TRACE_CONCAT_(a, b) a##b
+#define MS_TRACE_CONCAT(a, b) MS_TRACE_CONCAT_(a, b)
+
+#define TRACE_SCOPE(name) TraceScope MS_TRACE_CONCAT(_traceScope_, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg) TraceScope MS_TRACE_CONCAT(_traceScope_, __LINE__)(name, arg)
+#define TRACE_INSTANT(name) do { if (TraceRecorder::enabled()) TraceRecorder::instant(name); } while (0)
+
+#endif // TRACERECORDER_H
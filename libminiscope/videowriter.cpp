@@ -24,9 +24,14 @@
 #include <atomic>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
 #include <fstream>
- #include <iomanip>
+#include <cstdio>
+#include <cerrno>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
 #include <boost/format.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 extern "C" {
@@ -39,6 +44,9 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include "tracerecorder.h"
+#include "encoderpool.h"
+
 /**
  * @brief FRAME_QUEUE_MAX_COUNT
  * The maximum number of frames we want to hold in the queue in memory
@@ -46,33 +54,120 @@ extern "C" {
  */
 static const uint FRAME_QUEUE_MAX_COUNT = 512;
 
+/**
+ * @brief IO_BUFFER_SIZE
+ * Size of the buffer FFmpeg collects muxed data in before handing it to us for writing.
+ */
+static const int IO_BUFFER_SIZE = 256 * 1024;
+
+/**
+ * @brief CLOCK_SYNC_WRITE_INTERVAL
+ * Interval (in milliseconds of frame time) in which the current clock mapping
+ * is written to the clock sync sidecar file.
+ */
+static const double CLOCK_SYNC_WRITE_INTERVAL = 1000.0;
+
+/**
+ * @brief A frame waiting to be encoded.
+ */
+struct QueuedFrame
+{
+    uint stream;
+    cv::Mat frame;
+    FrameMetadata meta;
+    steady_hr_clock::time_point queuedTime;
+};
+
+/**
+ * @brief Encoder state of a single video stream of the output file.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpadded"
+struct EncoderStream
+{
+    EncoderStream()
+        : codec(VideoCodec::FFV1),
+          width(0),
+          height(0),
+          fps({0, 1}),
+          inputPixFormat(AV_PIX_FMT_GRAY8),
+          lossless(false),
+          vcodec(nullptr),
+          cctx(nullptr),
+          vstrm(nullptr),
+          swsctx(nullptr),
+          frame(nullptr),
+          inputFrame(nullptr),
+          framePts(0),
+          framesCount(0),
+          alignedInput(nullptr)
+    {}
+
+    VideoCodec codec;
+    int width;
+    int height;
+    AVRational fps;
+    AVPixelFormat inputPixFormat;
+    bool lossless;
+
+    const AVCodec *vcodec;
+    AVCodecContext *cctx;
+    AVStream *vstrm;
+    SwsContext *swsctx;
+    AVFrame *frame;
+    AVFrame *inputFrame;
+    int64_t framePts;
+    uint64_t framesCount; // frames written to the current file
+    uchar *alignedInput;
+};
+#pragma GCC diagnostic pop
+
 #pragma GCC diagnostic ignored "-Wpadded"
 class VideoWriter::VideoWriterData
 {
 public:
     VideoWriterData()
-        : thread(nullptr)
+        : thread(nullptr),
+          queueWaitTime("queue_wait"),
+          convertTime("convert"),
+          encodeTime("encode"),
+          muxTime("mux"),
+          ioTime("io"),
+          queueDepth("encode_queue")
     {
         initialized = false;
+        encoderReady = false;
+        threadRunning = false;
+        acceptFrames = false;
         codec = VideoCodec::VP9;
         container = VideoContainer::Matroska;
         fileSliceIntervalMin = 0;  // never slice our recording by default
 
-        frame = nullptr;
-        inputFrame = nullptr;
-        alignedInput = nullptr;
-
+        streams.resize(1);
         octx = nullptr;
-        vstrm = nullptr;
-        cctx = nullptr;
-        swsctx = nullptr;
         lossless = false;
+        highBitDepth = false;
+        haveFirstHostTimestamp = false;
+        firstHostTimestamp = 0;
+
+        outFile = nullptr;
+        clockMapping = ClockMapping();
+        clockMapping.valid = false;
+        ioCallTime = std::chrono::nanoseconds(0);
+        statsEnabled = true;
+        traceSession = 0;
     }
 
     std::string lastError;
     std::thread *thread;
+    std::shared_ptr<EncoderPool> pool;
+    ThreadSchedulingOptions threadScheduling;
+    mutable std::mutex schedulingMutex;
+    std::string threadSchedulingInfo;
     std::mutex mutex;
-    std::queue<std::pair<cv::Mat, double>> frameQueue; // (frame, timestamp in milliseconds)
+    std::condition_variable queueCond;
+    bool threadRunning;
+    std::queue<QueuedFrame> frameQueue;
 
     std::string fnameBase;
     uint fileSliceIntervalMin;
@@ -81,31 +176,45 @@ public:
     VideoContainer container;
 
     bool initialized;
+    bool encoderReady;
     std::atomic_bool acceptFrames;
-    int width;
-    int height;
-    AVRational fps;
     bool lossless;
+    bool highBitDepth;
 
     bool saveTimestamps;
     std::ofstream timestampFile;
+    std::ofstream clockSyncFile;
+    bool clockSyncWritten;
+    double lastClockSyncTimestamp;
 
-    AVFrame *frame;
-    AVFrame *inputFrame;
-    int64_t framePts;
-    uchar *alignedInput;
+    std::mutex clockMutex;
+    ClockMapping clockMapping;
 
     bool isFirstFrame;
     double firstFrameTimestamp;
 
 
+    std::vector<EncoderStream> streams; // the first one is the primary stream
+    bool haveFirstHostTimestamp;
+    double firstHostTimestamp; // host time of the first frame in the current file, for multi-stream timing
     AVFormatContext *octx;
-    AVStream *vstrm;
-    AVCodecContext *cctx;
-    SwsContext *swsctx;
-    AVPixelFormat inputPixFormat;
+    FILE *outFile;
+
+    std::atomic_bool statsEnabled;
+    LatencyHistogram queueWaitTime;
+    LatencyHistogram convertTime;
+    LatencyHistogram encodeTime;
+    LatencyHistogram muxTime;
+    LatencyHistogram ioTime;
+    QueueGauge queueDepth;
+    std::chrono::nanoseconds ioCallTime; // time spent on I/O during the current muxer call
+    uint traceSession; // trace session of the thread that started encoding
 
     size_t frames_n;
+    uint64_t framesPushed;
+
+    mutable std::mutex slicesMutex;
+    std::vector<SliceSummary> slices;
 };
 #pragma GCC diagnostic pop
 
@@ -150,55 +259,100 @@ static AVFrame *vw_alloc_frame(int pix_fmt, int width, int height, bool allocate
     return aframe;
 }
 
-void VideoWriter::initializeInternal()
+/**
+ * Write callback for the FFmpeg I/O context, so we can tell how much
+ * time is spent on actually writing data to disk.
+ */
+static int vw_io_write(void *opaque, uint8_t *buf, int buf_size)
 {
-    // sanity check. 'Raw' is the only "codec" that we allow to only actually work with one
-    // container, all other codecs have to work with all containers.
-    if ((d->codec == VideoCodec::Raw) && (d->container != VideoContainer::AVI)) {
-        std::cerr << "Video codec was set to 'Raw', but container was not 'AVI'. Assuming 'AVI' as desired container format." << std::endl;
-        d->container = VideoContainer::AVI;
+    auto d = static_cast<VideoWriter::VideoWriterData*>(opaque);
+    const auto startTime = steady_hr_clock::now();
 
+    const auto written = fwrite(buf, 1, static_cast<size_t>(buf_size), d->outFile);
+
+    if (d->statsEnabled) {
+        const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(steady_hr_clock::now() - startTime);
+        d->ioTime.record(duration);
+        d->ioCallTime += duration;
     }
 
-    // if file slicing is used, give our new file the appropriate name
-    std::string fname;
-    if (d->fileSliceIntervalMin > 0)
-        fname = boost::str(boost::format("%1%_%2%") % d->fnameBase % d->currentSliceNo);
-    else
-        fname = d->fnameBase;
+    if (written != static_cast<size_t>(buf_size))
+        return AVERROR(EIO);
+    return buf_size;
+}
 
-    // prepare timestamp filename
-    auto timestampFname = fname + "_timestamps.csv";
+static int64_t vw_io_seek(void *opaque, int64_t offset, int whence)
+{
+    auto d = static_cast<VideoWriter::VideoWriterData*>(opaque);
+
+#ifdef _WIN32
+#define vw_fseek _fseeki64
+#define vw_ftell _ftelli64
+#else
+#define vw_fseek fseeko
+#define vw_ftell ftello
+#endif
+
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+        const auto pos = vw_ftell(d->outFile);
+        vw_fseek(d->outFile, 0, SEEK_END);
+        const auto size = vw_ftell(d->outFile);
+        vw_fseek(d->outFile, pos, SEEK_SET);
+        return size;
+    }
 
-    // set container format
-    switch (d->container) {
+    if (vw_fseek(d->outFile, offset, whence) != 0)
+        return AVERROR(EIO);
+    return vw_ftell(d->outFile);
+
+#undef vw_fseek
+#undef vw_ftell
+}
+
+static const char *vw_container_suffix(VideoContainer container)
+{
+    switch (container) {
     case VideoContainer::Matroska:
-        if (!boost::algorithm::ends_with(fname, ".mkv"))
-            fname = fname + ".mkv";
-        break;
+        return ".mkv";
     case VideoContainer::AVI:
-        if (!boost::algorithm::ends_with(fname, ".avi"))
-            fname = fname + ".avi";
-        break;
+        return ".avi";
     }
 
-    // open output format context
-    int ret;
-    d->octx = nullptr;
-    av_register_all();
-    ret = avformat_alloc_output_context2(&d->octx, nullptr, nullptr, fname.c_str());
-    if (ret < 0)
-        throw std::runtime_error(boost::str(boost::format("Failed to allocate output context: %1%") % ret));
+    return "";
+}
+
+static AVPixelFormat vw_input_pix_format(bool hasColor, bool highBitDepth)
+{
+    if (hasColor)
+        return AV_PIX_FMT_BGR24;
+    return highBitDepth? AV_PIX_FMT_GRAY16 : AV_PIX_FMT_GRAY8;
+}
+
+void VideoWriter::prepareEncoder()
+{
+    // sanity check. 'Raw' is the only "codec" that we allow to only actually work with one
+    // container, all other codecs have to work with all containers.
+    if ((d->codec == VideoCodec::Raw) && (d->container != VideoContainer::AVI)) {
+        std::cerr << "Video codec was set to 'Raw', but container was not 'AVI'. Assuming 'AVI' as desired container format." << std::endl;
+        d->container = VideoContainer::AVI;
 
-    // open output IO context
-    ret = avio_open2(&d->octx->pb, fname.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr);
-    if (ret < 0) {
-        finalizeInternal(false);
-        throw std::runtime_error(boost::str(boost::format("Failed to open output I/O context: %1%") % ret));
     }
 
+    d->streams[0].codec = d->codec;
+    d->streams[0].lossless = d->lossless;
+    for (auto &s : d->streams)
+        prepareStreamEncoder(s);
+
+    // some codecs are always lossless, others can not be lossless at all
+    d->lossless = d->streams[0].lossless;
+    d->encoderReady = true;
+}
+
+void VideoWriter::prepareStreamEncoder(EncoderStream &s)
+{
     auto codecId = AV_CODEC_ID_AV1;
-    switch (d->codec) {
+    switch (s.codec) {
     case VideoCodec::Raw:
         codecId = AV_CODEC_ID_RAWVIDEO;
         break;
@@ -220,41 +374,42 @@ void VideoWriter::initializeInternal()
     }
 
     // initialize codec and context
-    auto vcodec = avcodec_find_encoder(codecId);
-    d->cctx = avcodec_alloc_context3(vcodec);
-
-    // create new video stream
-    d->vstrm = avformat_new_stream(d->octx, vcodec);
-    if (!d->vstrm)
-        throw std::runtime_error("Failed to create new video stream.");
-    avcodec_parameters_to_context(d->cctx, d->vstrm->codecpar);
+    av_register_all();
+    s.vcodec = avcodec_find_encoder(codecId);
+    if (s.vcodec == nullptr)
+        throw std::runtime_error("Unable to find a suitable video encoder.");
+    s.cctx = avcodec_alloc_context3(s.vcodec);
 
     // set codec parameters
-    d->cctx->codec_id = codecId;
-    d->cctx->codec_type = AVMEDIA_TYPE_VIDEO;
-    if (vcodec->pix_fmts != nullptr)
-        d->cctx->pix_fmt = vcodec->pix_fmts[0];
-    d->cctx->time_base = av_inv_q(d->fps);
-    d->cctx->width = d->width;
-    d->cctx->height = d->height;
-    d->cctx->framerate = d->fps;
-    d->cctx->workaround_bugs = FF_BUG_AUTODETECT;
-
-    if (d->codec == VideoCodec::Raw)
-        d->cctx->pix_fmt = d->inputPixFormat == AV_PIX_FMT_GRAY8 ||
-                           d->inputPixFormat == AV_PIX_FMT_GRAY16LE ||
-                           d->inputPixFormat == AV_PIX_FMT_GRAY16BE ? d->inputPixFormat : AV_PIX_FMT_YUV420P;
+    s.cctx->codec_id = codecId;
+    s.cctx->codec_type = AVMEDIA_TYPE_VIDEO;
+    if (s.vcodec->pix_fmts != nullptr)
+        s.cctx->pix_fmt = s.vcodec->pix_fmts[0];
+    // with several streams, all of them share a millisecond timebase
+    s.cctx->time_base = (d->streams.size() > 1)? AVRational{1, 1000} : av_inv_q(s.fps);
+    s.cctx->width = s.width;
+    s.cctx->height = s.height;
+    s.cctx->framerate = s.fps;
+    s.cctx->workaround_bugs = FF_BUG_AUTODETECT;
+
+    if (s.codec == VideoCodec::Raw)
+        s.cctx->pix_fmt = s.inputPixFormat == AV_PIX_FMT_GRAY8 ||
+                          s.inputPixFormat == AV_PIX_FMT_GRAY16LE ||
+                          s.inputPixFormat == AV_PIX_FMT_GRAY16BE ? s.inputPixFormat : AV_PIX_FMT_YUV420P;
 
     // enable experimental mode to encode AV1
-    if (d->codec == VideoCodec::AV1)
-        d->cctx->strict_std_compliance = -2;
+    if (s.codec == VideoCodec::AV1)
+        s.cctx->strict_std_compliance = -2;
 
-    if (d->octx->oformat->flags & AVFMT_GLOBALHEADER)
-        d->cctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    // we open the encoder before we know the output filename, so we need to
+    // look up the muxer flags for the selected container type ourselves
+    const auto oformat = av_guess_format(nullptr, vw_container_suffix(d->container), nullptr);
+    if ((oformat != nullptr) && (oformat->flags & AVFMT_GLOBALHEADER))
+        s.cctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     AVDictionary *codecopts = nullptr;
-    if (d->lossless) {
-        switch (d->codec) {
+    if (s.lossless) {
+        switch (s.codec) {
         case VideoCodec::Raw:
             // uncompressed frames are always lossless
             break;
@@ -274,77 +429,153 @@ void VideoWriter::initializeInternal()
         case VideoCodec::MPEG4:
             // NOTE: MPEG-4 has no lossless option
             std::cerr << "The MPEG-4 codec has no lossless preset, switching to lossy compression." << std::endl;
-            d->lossless = false;
+            s.lossless = false;
             break;
         }
     }
 
-    if (d->codec == VideoCodec::VP9)
+    if (s.codec == VideoCodec::VP9)
         av_dict_set(&codecopts, "deadline", "realtime", 0);
 
-    if (d->codec == VideoCodec::FFV1) {
-        d->lossless = true; // this codec is always lossless
-        d->cctx->level = 3; // Ensure we use FFV1 v3
+    if (s.codec == VideoCodec::FFV1) {
+        s.lossless = true; // this codec is always lossless
+        s.cctx->level = 3; // Ensure we use FFV1 v3
+        if (s.inputPixFormat == AV_PIX_FMT_GRAY16)
+            s.cctx->pix_fmt = AV_PIX_FMT_GRAY16; // keep all bits of deep grayscale frames
         av_dict_set_int(&codecopts, "slicecrc", 1, 0); // Add CRC information to each slice
         // NOTE: For archival use, GOP-size should be 1, but that also increases the file size quite a bit.
         // Keeping a good balance between recording space/performance/integrity is difficult sometimes.
     }
 
     // open video encoder
-    ret = avcodec_open2(d->cctx, vcodec, &codecopts);
+    auto ret = avcodec_open2(s.cctx, s.vcodec, &codecopts);
+    av_dict_free(&codecopts);
     if (ret < 0) {
-        finalizeInternal(false);
-        av_dict_free(&codecopts);
+        finalizeInternal(false, false);
         throw std::runtime_error(boost::str(boost::format("Failed to open video encoder: %1%") % ret));
     }
 
-    // stream codec parameters must be set after opening the encoder
-    avcodec_parameters_from_context(d->vstrm->codecpar, d->cctx);
-    d->vstrm->r_frame_rate = d->vstrm->avg_frame_rate = d->fps;
-
     // initialize sample scaler
-    d->swsctx = sws_getCachedContext(nullptr,
-                                     d->width,
-                                     d->height,
-                                     d->inputPixFormat,
-                                     d->width,
-                                     d->height,
-                                     d->cctx->pix_fmt,
-                                     SWS_BICUBIC,
-                                     nullptr,
-                                     nullptr,
-                                     nullptr);
-
-    if (!d->swsctx) {
-        finalizeInternal(false);
+    s.swsctx = sws_getCachedContext(nullptr,
+                                    s.width,
+                                    s.height,
+                                    s.inputPixFormat,
+                                    s.width,
+                                    s.height,
+                                    s.cctx->pix_fmt,
+                                    SWS_BICUBIC,
+                                    nullptr,
+                                    nullptr,
+                                    nullptr);
+
+    if (!s.swsctx) {
+        finalizeInternal(false, false);
         throw std::runtime_error("Failed to initialize sample scaler.");
     }
 
     // allocate frame buffer for encoding
-    d->frame = vw_alloc_frame(d->cctx->pix_fmt, d->width, d->height, true);
+    s.frame = vw_alloc_frame(s.cctx->pix_fmt, s.width, s.height, true);
 
     // allocate input buffer for color conversion
-    d->inputFrame = vw_alloc_frame(d->cctx->pix_fmt, d->width, d->height, false);
+    s.inputFrame = vw_alloc_frame(s.cctx->pix_fmt, s.width, s.height, false);
+
+    s.framePts = 0;
+    s.framesCount = 0;
+}
+
+void VideoWriter::openOutput()
+{
+    // if file slicing is used, give our new file the appropriate name
+    std::string fname;
+    if (d->fileSliceIntervalMin > 0)
+        fname = boost::str(boost::format("%1%_%2%") % d->fnameBase % d->currentSliceNo);
+    else
+        fname = d->fnameBase;
+
+    // prepare timestamp filenames
+    auto timestampFname = fname + "_timestamps.csv";
+    auto clockSyncFname = fname + "_clocksync.csv";
+
+    // set container format
+    if (!boost::algorithm::ends_with(fname, vw_container_suffix(d->container)))
+        fname = fname + vw_container_suffix(d->container);
+
+    // open output format context
+    int ret;
+    d->octx = nullptr;
+    ret = avformat_alloc_output_context2(&d->octx, nullptr, nullptr, fname.c_str());
+    if (ret < 0)
+        throw std::runtime_error(boost::str(boost::format("Failed to allocate output context: %1%") % ret));
+
+    // open output IO context
+    // we do the actual writing ourselves, so we can measure the time spent on disk I/O
+    d->outFile = fopen(fname.c_str(), "wb");
+    if (d->outFile == nullptr) {
+        finalizeInternal(false, false);
+        throw std::runtime_error(boost::str(boost::format("Failed to open output file '%1%': %2%") % fname % strerror(errno)));
+    }
+    auto ioBuffer = static_cast<unsigned char*>(av_malloc(IO_BUFFER_SIZE));
+    d->octx->pb = avio_alloc_context(ioBuffer, IO_BUFFER_SIZE, 1, d.get(), nullptr, vw_io_write, vw_io_seek);
+    if (d->octx->pb == nullptr) {
+        av_free(ioBuffer);
+        finalizeInternal(false, false);
+        throw std::runtime_error("Failed to open output I/O context.");
+    }
+    d->octx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // create new video streams
+    for (auto &s : d->streams) {
+        s.vstrm = avformat_new_stream(d->octx, s.vcodec);
+        if (!s.vstrm) {
+            finalizeInternal(false, false);
+            throw std::runtime_error("Failed to create new video stream.");
+        }
+
+        // stream codec parameters must be set after opening the encoder
+        avcodec_parameters_from_context(s.vstrm->codecpar, s.cctx);
+        s.vstrm->time_base = s.cctx->time_base;
+        s.vstrm->r_frame_rate = s.vstrm->avg_frame_rate = s.fps;
+    }
+    d->haveFirstHostTimestamp = false;
 
     // write format header, after this we are ready to encode frames
     ret = avformat_write_header(d->octx, nullptr);
     if (ret < 0) {
-        finalizeInternal(false);
+        finalizeInternal(false, false);
         throw std::runtime_error(boost::str(boost::format("Failed to write format header: %1%") % ret));
     }
-    d->framePts = 0;
 
     if (d->saveTimestamps) {
         d->timestampFile.close(); // ensure file is closed
         d->timestampFile.clear();
         d->timestampFile.open(timestampFname);
-        d->timestampFile << "frame; timestamp" << "\n";
+        d->timestampFile << "frame; timestamp; host_timestamp; sequence; missed; flags; stream" << "\n";
         d->timestampFile.flush();
+
+        d->clockSyncFile.close();
+        d->clockSyncFile.clear();
+        d->clockSyncFile.open(clockSyncFname);
+        d->clockSyncFile << "frame; driver_ref; monotonic_ref; drift_ppm; realtime_offset; residual_rms; samples" << "\n";
+        d->clockSyncFile.flush();
+        d->clockSyncWritten = false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(d->slicesMutex);
+        d->slices.push_back({d->currentSliceNo, fname, 0, 0, 0});
     }
 
     d->initialized = true;
 }
 
+void VideoWriter::initializeInternal()
+{
+    // the encoder may have been opened in advance already
+    if (!d->encoderReady)
+        prepareEncoder();
+    openOutput();
+}
+
 void VideoWriter::finalizeInternal(bool writeTrailer, bool stopRecThread)
 {
     // stop encoding frames and write the last bits to disk.
@@ -356,8 +587,10 @@ void VideoWriter::finalizeInternal(bool writeTrailer, bool stopRecThread)
         stopEncodeThread();
 
     if (d->initialized) {
-        if (d->vstrm != nullptr)
-            avcodec_send_frame(d->cctx, nullptr);
+        for (auto &s : d->streams) {
+            if (s.vstrm != nullptr)
+                avcodec_send_frame(s.cctx, nullptr);
+        }
 
         // write trailer
         if (writeTrailer && (d->octx != nullptr))
@@ -365,62 +598,125 @@ void VideoWriter::finalizeInternal(bool writeTrailer, bool stopRecThread)
     }
 
     // ensure timestamps file is closed
-    if (d->saveTimestamps)
+    if (d->saveTimestamps) {
         d->timestampFile.close();
+        d->clockSyncFile.close();
+    }
 
     // free all FFmpeg resources
-    if (d->frame != nullptr) {
-        av_frame_free(&d->frame);
-        d->frame = nullptr;
-    }
-    if (d->inputFrame != nullptr) {
-        av_frame_free(&d->inputFrame);
-        d->inputFrame = nullptr;
-    }
+    for (auto &s : d->streams) {
+        if (s.frame != nullptr) {
+            av_frame_free(&s.frame);
+            s.frame = nullptr;
+        }
+        if (s.inputFrame != nullptr) {
+            av_frame_free(&s.inputFrame);
+            s.inputFrame = nullptr;
+        }
+
+        if (s.cctx != nullptr) {
+            avcodec_free_context(&s.cctx);
+            s.cctx = nullptr;
+        }
+        s.vstrm = nullptr;
+
+        if (s.swsctx != nullptr) {
+            sws_freeContext(s.swsctx);
+            s.swsctx = nullptr;
+        }
 
-    if (d->cctx != nullptr) {
-        avcodec_free_context(&d->cctx);
-        d->cctx = nullptr;
+        if (s.alignedInput != nullptr)
+            av_freep(&s.alignedInput);
     }
     if (d->octx != nullptr) {
-        if (d->octx->pb != nullptr)
-            avio_close(d->octx->pb);
+        if (d->octx->pb != nullptr) {
+            avio_flush(d->octx->pb);
+            av_freep(&d->octx->pb->buffer);
+            avio_context_free(&d->octx->pb);
+        }
         avformat_free_context(d->octx);
         d->octx = nullptr;
     }
+    if (d->outFile != nullptr) {
+        fclose(d->outFile);
+        d->outFile = nullptr;
+    }
 
-    if (d->alignedInput != nullptr)
-        av_freep(&d->alignedInput);
-
+    d->encoderReady = false;
     d->initialized = false;
 }
 
+void VideoWriter::setupParameters(int width, int height, int fps, bool hasColor)
+{
+    auto &s = d->streams[0];
+    s.width = width;
+    s.height = height;
+    s.fps = {fps, 1};
+
+    // select FFMpeg pixel format of OpenCV matrixes
+    s.inputPixFormat = vw_input_pix_format(hasColor, d->highBitDepth);
+}
+
+void VideoWriter::prepare(int width, int height, int fps, bool hasColor)
+{
+    if (d->initialized)
+        throw std::runtime_error("Tried to prepare an already initialized video writer.");
+
+    // drop any encoder we may have prepared previously
+    finalizeInternal(false);
+
+    setupParameters(width, height, fps, hasColor);
+    prepareEncoder();
+
+    // have the encoding thread wait for frames, so initialization
+    // later only needs to open the output file
+    startEncodeThread();
+}
+
+bool VideoWriter::prepared() const
+{
+    return d->encoderReady && !d->initialized;
+}
+
 void VideoWriter::initialize(std::string fname, int width, int height, int fps, bool hasColor, bool saveTimestamps)
 {
     if (d->initialized)
         throw std::runtime_error("Tried to initialize an already initialized video writer.");
 
-    d->width = width;
-    d->height = height;
-    d->fps = {fps, 1};
+    // we can only reuse a prepared encoder if it was set up for the same kind of input
+    if (d->encoderReady) {
+        const auto &s = d->streams[0];
+        const auto pixFormat = vw_input_pix_format(hasColor, d->highBitDepth);
+        if ((s.width != width) || (s.height != height) || (s.fps.num != fps) || (s.inputPixFormat != pixFormat))
+            finalizeInternal(false);
+    }
+    if ((d->streams.size() > 1) && (d->container != VideoContainer::Matroska))
+        throw std::runtime_error("Recording multiple streams into one file is only supported with the Matroska container.");
+    if (!d->encoderReady)
+        setupParameters(width, height, fps, hasColor);
+
     d->frames_n = 0;
+    d->framesPushed = 0;
     d->saveTimestamps = saveTimestamps;
     d->isFirstFrame = true;
     d->firstFrameTimestamp = 0.0;
     d->currentSliceNo = 1;
+    {
+        std::lock_guard<std::mutex> lock(d->slicesMutex);
+        d->slices.clear();
+    }
     if (fname.substr(fname.find_last_of(".") + 1).length() == 3)
         d->fnameBase = fname.substr(0, fname.length() - 4); // remove 3-char suffix from filename
     else
         d->fnameBase = fname;
 
-    // select FFMpeg pixel format of OpenCV matrixes
-    d->inputPixFormat = hasColor? AV_PIX_FMT_BGR24 : AV_PIX_FMT_GRAY8;
-
-    // initialize encoder
+    // initialize encoder (if necessary) and open the output file
     initializeInternal();
 
     // start encoding data
-    startEncodeThread();
+    if (!d->threadRunning)
+        startEncodeThread();
+    d->acceptFrames = true;
 }
 
 void VideoWriter::finalize()
@@ -433,7 +729,7 @@ bool VideoWriter::initialized() const
     return d->initialized;
 }
 
-bool VideoWriter::prepareFrame(const cv::Mat &image)
+bool VideoWriter::prepareFrame(EncoderStream &s, const cv::Mat &image)
 {
     const auto channels = image.channels();
 
@@ -444,11 +740,13 @@ bool VideoWriter::prepareFrame(const cv::Mat &image)
     const auto width = image.cols;
 
     // sanity checks
-    if ((static_cast<int>(height) > d->height) || (static_cast<int>(width) > d->width))
-        throw std::runtime_error(boost::str(boost::format("Received bigger frame than we expected (%1%x%2% instead %3%x%4%)") % width % height % d->width % d->height));
-    if ((d->inputPixFormat == AV_PIX_FMT_BGR24) && (channels != 3))
+    if ((static_cast<int>(height) > s.height) || (static_cast<int>(width) > s.width))
+        throw std::runtime_error(boost::str(boost::format("Received bigger frame than we expected (%1%x%2% instead %3%x%4%)") % width % height % s.width % s.height));
+    if ((s.inputPixFormat == AV_PIX_FMT_BGR24) && (channels != 3))
         return false;
-    else if ((d->inputPixFormat == AV_PIX_FMT_GRAY8) && (channels != 1))
+    else if ((s.inputPixFormat == AV_PIX_FMT_GRAY8) && (channels != 1 || image.depth() != CV_8U))
+        return false;
+    else if ((s.inputPixFormat == AV_PIX_FMT_GRAY16) && (channels != 1 || image.depth() != CV_16U))
         return false;
 
     // FFmpeg contains SIMD optimizations which can sometimes read data past
@@ -459,48 +757,66 @@ bool VideoWriter::prepareFrame(const cv::Mat &image)
     if (step % STEP_ALIGNMENT != 0) {
         auto aligned_step = (step + STEP_ALIGNMENT - 1) & -STEP_ALIGNMENT;
 
-        if (d->alignedInput == nullptr)
-            d->alignedInput = static_cast<uchar*>(av_mallocz(aligned_step * static_cast<size_t>(height)));
+        if (s.alignedInput == nullptr)
+            s.alignedInput = static_cast<uchar*>(av_mallocz(aligned_step * static_cast<size_t>(height)));
 
         for (size_t y = 0; y < static_cast<size_t>(height); y++)
-            memcpy(d->alignedInput + y*aligned_step, image.ptr() + y*step, step);
+            memcpy(s.alignedInput + y*aligned_step, image.ptr() + y*step, step);
 
-        data = d->alignedInput;
+        data = s.alignedInput;
         step = aligned_step;
     }
 
-    if (d->cctx->pix_fmt != d->inputPixFormat) {
+    if (s.cctx->pix_fmt != s.inputPixFormat) {
         // let input_picture point to the raw data buffer of 'image'
-        av_image_fill_arrays(d->inputFrame->data, d->inputFrame->linesize, static_cast<const uint8_t*>(data), d->inputPixFormat, width, height, 1);
-        d->inputFrame->linesize[0] = static_cast<int>(step);
+        av_image_fill_arrays(s.inputFrame->data, s.inputFrame->linesize, static_cast<const uint8_t*>(data), s.inputPixFormat, width, height, 1);
+        s.inputFrame->linesize[0] = static_cast<int>(step);
 
-        if (sws_scale(d->swsctx, d->inputFrame->data,
-                               d->inputFrame->linesize, 0,
-                               d->height,
-                               d->frame->data, d->frame->linesize) < 0)
+        if (sws_scale(s.swsctx, s.inputFrame->data,
+                               s.inputFrame->linesize, 0,
+                               s.height,
+                               s.frame->data, s.frame->linesize) < 0)
                     return false;
 
 
     } else {
-        av_image_fill_arrays(d->frame->data, d->frame->linesize, static_cast<const uint8_t*>(data), d->inputPixFormat, width, height, 1);
-        d->frame->linesize[0] = static_cast<int>(step);
+        av_image_fill_arrays(s.frame->data, s.frame->linesize, static_cast<const uint8_t*>(data), s.inputPixFormat, width, height, 1);
+        s.frame->linesize[0] = static_cast<int>(step);
     }
 
-    d->frame->pts = d->framePts++;
     return true;
 }
 
-bool VideoWriter::encodeFrame(const cv::Mat &frame, const double &timestamp)
+bool VideoWriter::encodeFrame(uint stream, const cv::Mat &frame, const FrameMetadata &meta)
 {
+    TRACE_SCOPE_ARG("encode_frame", static_cast<int64_t>(d->frames_n + 1));
     int ret;
+    auto &s = d->streams[stream];
+    const auto multiStream = d->streams.size() > 1;
 
-    if (!prepareFrame(frame)) {
+    StageTimer convertTimer(d->convertTime, d->statsEnabled);
+    if (!prepareFrame(s, frame)) {
         std::cerr << "Unable to prepare frame. N: " << d->frames_n + 1 << std::endl;
         return false;
     }
+    convertTimer.stop();
+
+    // a single stream simply counts frames, while multiple streams are placed
+    // on a common timeline by the host time their frames were acquired at
+    auto pts = s.framePts;
+    if (multiStream) {
+        if (!d->haveFirstHostTimestamp) {
+            d->firstHostTimestamp = meta.hostTimestamp;
+            d->haveFirstHostTimestamp = true;
+        }
+        pts = std::max(s.framePts, static_cast<int64_t>(std::llround(meta.hostTimestamp - d->firstHostTimestamp)));
+    }
+    s.frame->pts = pts;
+    s.framePts = pts + 1;
 
     // encode video frame
-    ret = avcodec_send_frame(d->cctx, d->frame);
+    StageTimer encodeTimer(d->encodeTime, d->statsEnabled);
+    ret = avcodec_send_frame(s.cctx, s.frame);
     if (ret < 0) {
         std::cerr << "Unable to send frame to encoder. N:" << d->frames_n + 1 << std::endl;
         return false;
@@ -510,32 +826,85 @@ bool VideoWriter::encodeFrame(const cv::Mat &frame, const double &timestamp)
     pkt.data = nullptr;
     pkt.size = 0;
     av_init_packet(&pkt);
-    ret = avcodec_receive_packet(d->cctx, &pkt);
+    ret = avcodec_receive_packet(s.cctx, &pkt);
     if (ret != 0)
         return false;
+    encodeTimer.stop();
 
     // rescale packet timestamp
-    pkt.duration = 1;
-    av_packet_rescale_ts(&pkt, d->cctx->time_base, d->vstrm->time_base);
+    pkt.stream_index = s.vstrm->index;
+    pkt.duration = multiStream? std::max<int64_t>(1, std::llround(1000.0 * s.fps.den / std::max(1, s.fps.num))) : 1;
+    av_packet_rescale_ts(&pkt, s.cctx->time_base, s.vstrm->time_base);
 
     // write packet
-    av_write_frame(d->octx, &pkt);
+    // the time spent in the muxer is recorded without the time we needed to write data to disk
+    const auto muxStartTime = steady_hr_clock::now();
+    d->ioCallTime = std::chrono::nanoseconds(0);
+    if (multiStream)
+        av_interleaved_write_frame(d->octx, &pkt);
+    else
+        av_write_frame(d->octx, &pkt);
+    if (d->statsEnabled)
+        d->muxTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(steady_hr_clock::now() - muxStartTime) - d->ioCallTime);
     d->frames_n++;
+    s.framesCount++;
     av_packet_unref(&pkt);
 
+    // store timestamp (if necessary)
+    if (d->saveTimestamps)
+        d->timestampFile << s.framesCount << "; "
+                         << std::fixed << std::setprecision(4) << meta.timestamp << "; "
+                         << meta.hostTimestamp << "; "
+                         << meta.sequence << "; "
+                         << meta.missedFrames << "; "
+                         << meta.flags << "; "
+                         << stream << "\n";
+
+    // everything else is tracked for the primary stream only
+    if (stream != 0)
+        return true;
+
     // log first timestamp to keep track of frame times
     if (d->isFirstFrame) {
-        d->firstFrameTimestamp = timestamp;
+        d->firstFrameTimestamp = meta.timestamp;
         d->isFirstFrame = false;
     }
 
-    // store timestamp (if necessary)
-    if (d->saveTimestamps)
-        d->timestampFile << d->framePts << "; " << std::fixed << std::setprecision(4) << timestamp << "\n";
+    // store the current driver clock mapping every now and then
+    if (d->saveTimestamps && (!d->clockSyncWritten || (meta.timestamp - d->lastClockSyncTimestamp >= CLOCK_SYNC_WRITE_INTERVAL))) {
+        ClockMapping clock;
+        {
+            std::lock_guard<std::mutex> lock(d->clockMutex);
+            clock = d->clockMapping;
+        }
+        if (clock.valid) {
+            d->clockSyncFile << s.framesCount << "; "
+                             << std::fixed << std::setprecision(4) << clock.driverRef << "; "
+                             << clock.monotonicRef << "; "
+                             << clock.drift * 1e6 << "; "
+                             << clock.realtimeOffset << "; "
+                             << clock.residualRms << "; "
+                             << clock.samplesCount << "\n";
+            d->clockSyncWritten = true;
+            d->lastClockSyncTimestamp = meta.timestamp;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(d->slicesMutex);
+        if (!d->slices.empty()) {
+            auto &slice = d->slices.back();
+            slice.framesCount++;
+            if (meta.flags & (FRAME_FLAG_AFTER_GAP | FRAME_FLAG_DRIVER_GAP))
+                slice.gapsCount++;
+            slice.missedFramesCount += meta.missedFrames;
+        }
+    }
 
     if (d->fileSliceIntervalMin != 0) {
-        const auto tsMin = (timestamp - d->firstFrameTimestamp) / 1000.0 / 60.0;
+        const auto tsMin = (meta.timestamp - d->firstFrameTimestamp) / 1000.0 / 60.0;
         if (tsMin > (d->fileSliceIntervalMin * d->currentSliceNo)) {
+            TRACE_SCOPE_ARG("slice_switch", d->currentSliceNo + 1);
             try {
                 // we need to start a new file now since the maximum time for this file has elapsed,
                 // so finalize this one without suspending the thread we are currently in
@@ -557,24 +926,40 @@ bool VideoWriter::encodeFrame(const cv::Mat &frame, const double &timestamp)
 
 void VideoWriter::startEncodeThread()
 {
-    assert(d->initialized);
+    assert(d->encoderReady);
 
     // clear last error message
     d->lastError.clear();
     stopEncodeThread();
     while (!d->frameQueue.empty())
         d->frameQueue.pop();
-    d->acceptFrames = true;
-    d->thread = new std::thread(encodeThread, this);
+    d->threadRunning = true;
+    d->traceSession = TraceRecorder::threadSession();
+
+    // a shared encoder pool will encode our frames, if we have one
+    if (!d->pool)
+        d->thread = new std::thread(encodeThread, this);
 }
 
 void VideoWriter::stopEncodeThread()
 {
-    if (d->thread == nullptr)
+    if (!d->threadRunning)
         return;
-    assert(d->initialized);
 
-    d->acceptFrames = false;
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        d->acceptFrames = false;
+        d->threadRunning = false;
+    }
+
+    if (d->thread == nullptr) {
+        // wait for the pool to encode all frames we have queued already
+        if (d->pool)
+            d->pool->drain(this);
+        return;
+    }
+
+    d->queueCond.notify_all();
     d->thread->join();
     delete d->thread;
     d->thread = nullptr;
@@ -582,15 +967,49 @@ void VideoWriter::stopEncodeThread()
 
 bool VideoWriter::pushFrame(const cv::Mat &frame, const double &timestamp)
 {
-    std::lock_guard<std::mutex> lock(d->mutex);
-    if (!d->acceptFrames)
-        return false;
-    if (d->frameQueue.size() > FRAME_QUEUE_MAX_COUNT) {
-        d->lastError = "Frame encoding buffer was full and new frame could not be added. Maybe encoding or storage is too slow.";
+    FrameMetadata meta;
+    meta.sequence = d->framesPushed;
+    meta.timestamp = timestamp;
+    meta.hostTimestamp = std::chrono::duration<double, std::milli>(steady_hr_clock::now().time_since_epoch()).count();
+    meta.missedFrames = 0;
+    meta.flags = FRAME_FLAG_NONE;
+    return pushFrame(frame, meta);
+}
+
+bool VideoWriter::pushFrame(const cv::Mat &frame, const FrameMetadata &meta)
+{
+    return pushFrame(0, frame, meta);
+}
+
+/**
+ * Queue a frame of the given stream for encoding. Frames of additional streams
+ * are not counted for the file slicing interval or the clock sync sidecar.
+ */
+bool VideoWriter::pushFrame(uint stream, const cv::Mat &frame, const FrameMetadata &meta)
+{
+    if (stream >= d->streams.size()) {
+        d->lastError = boost::str(boost::format("Tried to add frame to nonexistent stream %1%.") % stream);
         return false;
     }
 
-    d->frameQueue.push(std::make_pair(frame, timestamp));
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        if (!d->acceptFrames)
+            return false;
+        if (d->frameQueue.size() > FRAME_QUEUE_MAX_COUNT) {
+            d->lastError = "Frame encoding buffer was full and new frame could not be added. Maybe encoding or storage is too slow.";
+            return false;
+        }
+
+        d->frameQueue.push({stream, frame, meta, steady_hr_clock::now()});
+        d->framesPushed++;
+        d->queueDepth.set(d->frameQueue.size());
+    }
+    if (d->pool)
+        d->pool->schedule(this);
+    else
+        d->queueCond.notify_one();
+
     return true;
 }
 
@@ -611,17 +1030,56 @@ VideoContainer VideoWriter::container() const
 
 int VideoWriter::width() const
 {
-    return d->width;
+    return d->streams[0].width;
 }
 
 int VideoWriter::height() const
 {
-    return d->height;
+    return d->streams[0].height;
 }
 
 int VideoWriter::fps() const
 {
-    return d->fps.num;
+    return d->streams[0].fps.num;
+}
+
+/**
+ * Add another video stream to be muxed into the same file as the primary one,
+ * e.g. from a behavior camera. The stream may have a different geometry, codec
+ * and framerate than the primary stream. All streams share a millisecond timebase
+ * derived from the host timestamps of their frames, and their packets are interleaved.
+ *
+ * Must be called before the writer is initialized, and requires the Matroska container.
+ *
+ * @return The index of the new stream, to be passed to pushFrame()
+ */
+uint VideoWriter::addStream(int width, int height, int fps, bool hasColor, VideoCodec codec, bool lossless)
+{
+    if (d->initialized)
+        throw std::runtime_error("Can not add a stream to an already initialized video writer.");
+    if (codec == VideoCodec::Raw)
+        throw std::runtime_error("Additional streams can not use the 'Raw' codec, as it requires the AVI container.");
+
+    // all streams need to switch to a common timebase now, so we can't use an encoder
+    // that was prepared in advance
+    if (d->encoderReady)
+        finalizeInternal(false);
+
+    EncoderStream s;
+    s.codec = codec;
+    s.width = width;
+    s.height = height;
+    s.fps = {fps, 1};
+    s.inputPixFormat = vw_input_pix_format(hasColor, d->highBitDepth);
+    s.lossless = lossless;
+    d->streams.push_back(s);
+
+    return static_cast<uint>(d->streams.size() - 1);
+}
+
+uint VideoWriter::streamsCount() const
+{
+    return static_cast<uint>(d->streams.size());
 }
 
 bool VideoWriter::lossless() const
@@ -634,6 +1092,20 @@ void VideoWriter::setLossless(bool enabled)
     d->lossless = enabled;
 }
 
+bool VideoWriter::highBitDepth() const
+{
+    return d->highBitDepth;
+}
+
+/**
+ * Expect grayscale frames with 16 bits per pixel (CV_16UC1) instead of 8 bits.
+ * Only the FFV1 and Raw codecs store all of their bits.
+ */
+void VideoWriter::setHighBitDepth(bool enabled)
+{
+    d->highBitDepth = enabled;
+}
+
 uint VideoWriter::fileSliceInterval() const
 {
     return d->fileSliceIntervalMin;
@@ -649,6 +1121,80 @@ std::string VideoWriter::lastError() const
     return d->lastError;
 }
 
+/**
+ * Have frames encoded by a shared pool of encoder threads, instead of
+ * a thread owned by this writer. Must be set before the writer is prepared or initialized.
+ */
+void VideoWriter::setEncoderPool(std::shared_ptr<EncoderPool> pool)
+{
+    if (d->threadRunning)
+        throw std::runtime_error("Can not change the encoder pool of an active video writer.");
+    d->pool = pool;
+}
+
+ThreadSchedulingOptions VideoWriter::threadScheduling() const
+{
+    return d->threadScheduling;
+}
+
+/**
+ * Set CPU affinity, scheduling policy and I/O priority of the encoding thread.
+ * Takes effect the next time the thread is started, and has no effect if a
+ * shared encoder pool is used.
+ */
+void VideoWriter::setThreadScheduling(const ThreadSchedulingOptions &options)
+{
+    d->threadScheduling = options;
+}
+
+bool VideoWriter::statsEnabled() const
+{
+    return d->statsEnabled;
+}
+
+void VideoWriter::setStatsEnabled(bool enabled)
+{
+    d->statsEnabled = enabled;
+}
+
+PipelineStats VideoWriter::stats() const
+{
+    PipelineStats stats;
+    stats.histograms.push_back(d->queueWaitTime.summary());
+    stats.histograms.push_back(d->convertTime.summary());
+    stats.histograms.push_back(d->encodeTime.summary());
+    stats.histograms.push_back(d->muxTime.summary());
+    stats.histograms.push_back(d->ioTime.summary());
+    stats.gauges.push_back(d->queueDepth.summary());
+    if (d->pool) {
+        stats.threads.push_back({"encoder_pool", d->pool->threadSchedulingInfo()});
+    } else {
+        std::lock_guard<std::mutex> lock(d->schedulingMutex);
+        stats.threads.push_back({"encoder", d->threadSchedulingInfo});
+    }
+    return stats;
+}
+
+/**
+ * Set the mapping of driver timestamps to host clock times, which
+ * is periodically stored next to the frame timestamps.
+ */
+void VideoWriter::setClockMapping(const ClockMapping &mapping)
+{
+    std::lock_guard<std::mutex> lock(d->clockMutex);
+    d->clockMapping = mapping;
+}
+
+/**
+ * Get the number of frames and detected gaps of every file slice
+ * of the current (or last) recording.
+ */
+std::vector<SliceSummary> VideoWriter::sliceSummaries() const
+{
+    std::lock_guard<std::mutex> lock(d->slicesMutex);
+    return d->slices;
+}
+
 void VideoWriter::setContainer(VideoContainer container)
 {
     d->container = container;
@@ -658,24 +1204,81 @@ void VideoWriter::encodeThread(void *vwPtr)
 {
     VideoWriter *self = static_cast<VideoWriter*> (vwPtr);
 
-    while (self->d->acceptFrames) {
+    TraceRecorder::setThreadSession(self->d->traceSession);
+    TraceRecorder::setThreadName("encoder");
+    {
+        const auto info = applyThreadScheduling(self->d->threadScheduling);
+        std::lock_guard<std::mutex> lock(self->d->schedulingMutex);
+        self->d->threadSchedulingInfo = info;
+    }
+
+    while (true) {
+        uint stream;
         cv::Mat frame;
-        double timestamp;
-        while (self->getNextFrameFromQueue(&frame, &timestamp)) {
-            self->encodeFrame(frame, timestamp);
-        }
+        FrameMetadata meta;
+        if (!self->waitForNextFrame(&stream, &frame, &meta))
+            break;
+
+        // we may not be able to encode anything anymore, if starting a new file slice failed
+        if (self->d->initialized)
+            self->encodeFrame(stream, frame, meta);
     }
 }
 
-bool VideoWriter::getNextFrameFromQueue(cv::Mat *frame, double *timestamp)
+bool VideoWriter::waitForNextFrame(uint *stream, cv::Mat *frame, FrameMetadata *meta)
 {
-    std::lock_guard<std::mutex> lock(d->mutex);
+    std::unique_lock<std::mutex> lock(d->mutex);
+    d->queueCond.wait(lock, [&] { return !d->frameQueue.empty() || !d->threadRunning; });
+
+    // we only stop once all pending frames have been encoded
     if (d->frameQueue.empty())
         return false;
 
-    auto pair = d->frameQueue.front();
-    *frame = pair.first;
-    *timestamp = pair.second;
+    takeQueuedFrame(stream, frame, meta);
+    return true;
+}
+
+/**
+ * Remove the oldest frame from the queue, which must not be empty.
+ * The queue mutex must be held by the caller.
+ */
+void VideoWriter::takeQueuedFrame(uint *stream, cv::Mat *frame, FrameMetadata *meta)
+{
+    const auto &qf = d->frameQueue.front();
+    *stream = qf.stream;
+    *frame = qf.frame;
+    *meta = qf.meta;
+    if (d->statsEnabled)
+        d->queueWaitTime.recordSince(qf.queuedTime);
     d->frameQueue.pop();
+    d->queueDepth.set(d->frameQueue.size());
+}
+
+/**
+ * Encode the oldest queued frame, if there is one.
+ * Called by the encoder pool, which ensures only one thread at a time encodes
+ * frames of this writer.
+ */
+bool VideoWriter::encodeQueuedFrame()
+{
+    uint stream;
+    cv::Mat frame;
+    FrameMetadata meta;
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        if (d->frameQueue.empty())
+            return false;
+        takeQueuedFrame(&stream, &frame, &meta);
+    }
+
+    // we may not be able to encode anything anymore, if starting a new file slice failed
+    if (d->initialized)
+        encodeFrame(stream, frame, meta);
     return true;
 }
+
+bool VideoWriter::hasQueuedFrames()
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    return !d->frameQueue.empty();
+}
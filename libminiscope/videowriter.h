@@ -22,8 +22,18 @@
 
 #include <memory>
 #include <chrono>
+#include <string>
+#include <vector>
 #include <opencv2/core.hpp>
 
+#include "msexport.h"
+#include "pipelinestats.h"
+#include "clocksync.h"
+#include "threadscheduling.h"
+
+class EncoderPool;
+struct EncoderStream;
+
 /**
  * @brief The VideoContainer enum
  *
@@ -55,6 +65,42 @@ enum class VideoCodec {
     MPEG4
 };
 
+/**
+ * @brief The FrameFlag enum
+ *
+ * Flags describing the circumstances a recorded frame was acquired in.
+ * They are stored with the frame timestamps, and can be combined.
+ */
+enum FrameFlag : uint {
+    FRAME_FLAG_NONE       = 0,
+    FRAME_FLAG_AFTER_GAP  = 1 << 0, /// acquisition was interrupted before this frame
+    FRAME_FLAG_DRIVER_GAP = 1 << 1  /// frames were lost silently before this frame
+};
+
+/**
+ * @brief Metadata of a single acquired frame.
+ */
+struct FrameMetadata
+{
+    uint64_t sequence;     // number of the frame since acquisition was started
+    double timestamp;      // driver timestamp, in milliseconds
+    double hostTimestamp;  // host monotonic clock at the time the frame was grabbed, in milliseconds
+    uint missedFrames;     // estimated number of frames lost right before this one
+    uint flags;            // FrameFlag bits
+};
+
+/**
+ * @brief Frame and gap counts of a single file slice of a recording.
+ */
+struct SliceSummary
+{
+    uint sliceNo;
+    std::string fname;
+    uint64_t framesCount;
+    uint64_t gapsCount;
+    uint64_t missedFramesCount;
+};
+
 /**
  * @brief The VideoWriter class
  *
@@ -63,17 +109,22 @@ enum class VideoCodec {
  * issues hidden away.
  * This class intentionally supports only few container/codec formats and options.
  */
-class VideoWriter
+class MS_LIB_EXPORT VideoWriter
 {
 public:
     VideoWriter();
     ~VideoWriter();
 
+    void prepare(int width, int height, int fps, bool hasColor);
+    bool prepared() const;
+
     void initialize(std::string fname, int width, int height, int fps, bool hasColor, bool saveTimestamps = true);
     void finalize();
     bool initialized() const;
 
     bool pushFrame(const cv::Mat& frame, const double &timestamp);
+    bool pushFrame(const cv::Mat& frame, const FrameMetadata &meta);
+    bool pushFrame(uint stream, const cv::Mat& frame, const FrameMetadata &meta);
 
     VideoCodec codec() const;
     void setCodec(VideoCodec codec);
@@ -85,24 +136,52 @@ public:
     int height() const;
     int fps() const;
 
+    uint addStream(int width, int height, int fps, bool hasColor,
+                   VideoCodec codec = VideoCodec::FFV1, bool lossless = false);
+    uint streamsCount() const;
+
     bool lossless() const;
     void setLossless(bool enabled);
 
+    bool highBitDepth() const;
+    void setHighBitDepth(bool enabled);
+
     uint fileSliceInterval() const;
     void setFileSliceInterval(uint minutes);
 
     std::string lastError() const;
 
-private:
+    void setEncoderPool(std::shared_ptr<EncoderPool> pool);
+
+    ThreadSchedulingOptions threadScheduling() const;
+    void setThreadScheduling(const ThreadSchedulingOptions &options);
+
+    bool statsEnabled() const;
+    void setStatsEnabled(bool enabled);
+    PipelineStats stats() const;
+    std::vector<SliceSummary> sliceSummaries() const;
+
+    void setClockMapping(const ClockMapping &mapping);
+
     class VideoWriterData;
+
+private:
+    friend class EncoderPool;
     std::unique_ptr<VideoWriterData> d;
 
+    void setupParameters(int width, int height, int fps, bool hasColor);
+    void prepareEncoder();
+    void prepareStreamEncoder(EncoderStream &s);
+    void openOutput();
     void initializeInternal();
     void finalizeInternal(bool writeTrailer, bool stopRecThread = true);
     static void encodeThread(void* vwPtr);
-    bool getNextFrameFromQueue(cv::Mat *frame, double *timestamp);
-    bool prepareFrame(const cv::Mat &image);
-    bool encodeFrame(const cv::Mat& frame, const double& timestamp);
+    bool waitForNextFrame(uint *stream, cv::Mat *frame, FrameMetadata *meta);
+    void takeQueuedFrame(uint *stream, cv::Mat *frame, FrameMetadata *meta);
+    bool encodeQueuedFrame();
+    bool hasQueuedFrames();
+    bool prepareFrame(EncoderStream &s, const cv::Mat &image);
+    bool encodeFrame(uint stream, const cv::Mat& frame, const FrameMetadata &meta);
     void startEncodeThread();
     void stopEncodeThread();
 };
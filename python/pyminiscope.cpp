@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+#include <stdexcept>
+#include <pybind11/pybind11.h>
+#include <pybind11/functional.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include "miniscope.h"
+
+namespace py = pybind11;
+
+/**
+ * Expose a matrix as NumPy array without copying it. The array keeps
+ * a reference to the matrix data for as long as it is alive.
+ * The array is read-only, as the data may be shared with the capture thread;
+ * it has to be copied (e.g. with `frame.copy()`) before it can be modified.
+ */
+static py::array matToArray(const cv::Mat &mat)
+{
+    if (mat.empty())
+        return py::array();
+
+    py::dtype dtype;
+    switch (mat.depth()) {
+    case CV_8U:
+        dtype = py::dtype::of<uint8_t>();
+        break;
+    case CV_16U:
+        dtype = py::dtype::of<uint16_t>();
+        break;
+    case CV_32F:
+        dtype = py::dtype::of<float>();
+        break;
+    case CV_64F:
+        dtype = py::dtype::of<double>();
+        break;
+    default:
+        throw std::runtime_error("Frames of this pixel type can not be converted to an array.");
+    }
+
+    std::vector<ssize_t> shape = {mat.rows, mat.cols};
+    std::vector<ssize_t> strides = {static_cast<ssize_t>(mat.step[0]), static_cast<ssize_t>(mat.elemSize())};
+    if (mat.channels() > 1) {
+        shape.push_back(mat.channels());
+        strides.push_back(static_cast<ssize_t>(mat.elemSize1()));
+    }
+
+    auto owner = new cv::Mat(mat);
+    py::capsule base(owner, [](void *m) { delete static_cast<cv::Mat*>(m); });
+    py::array arr(dtype, shape, strides, owner->data, base);
+    py::detail::array_proxy(arr.ptr())->flags &= ~py::detail::npy_api::NPY_ARRAY_WRITEABLE_;
+    return arr;
+}
+
+/**
+ * Wrap a C-contiguous 8-bit NumPy array of shape (rows, cols) or (rows, cols, 3)
+ * in a matrix header, without copying its data.
+ */
+static cv::Mat arrayToMat(const py::array_t<uint8_t, py::array::c_style | py::array::forcecast> &array)
+{
+    const auto info = array.request();
+    if (info.ndim == 2)
+        return cv::Mat(static_cast<int>(info.shape[0]), static_cast<int>(info.shape[1]), CV_8UC1, info.ptr);
+    if (info.ndim == 3 && info.shape[2] == 3)
+        return cv::Mat(static_cast<int>(info.shape[0]), static_cast<int>(info.shape[1]), CV_8UC3, info.ptr);
+    throw std::invalid_argument("Frames must be arrays of shape (height, width) or (height, width, 3).");
+}
+
+/**
+ * Holds a Python callable that is invoked from one of our own threads.
+ * The GIL is taken for each call, and for dropping the last reference.
+ */
+class PyCallback
+{
+public:
+    explicit PyCallback(py::function fn)
+        : m_fn(std::move(fn))
+    {}
+
+    ~PyCallback()
+    {
+        py::gil_scoped_acquire gil;
+        m_fn = py::function();
+    }
+
+    template<typename... Args>
+    void operator()(Args&&... args)
+    {
+        py::gil_scoped_acquire gil;
+        try {
+            m_fn(std::forward<Args>(args)...);
+        } catch (py::error_already_set &e) {
+            // there is nobody we could pass the exception on to on this thread
+            e.restore();
+            PyErr_Print();
+        }
+    }
+
+private:
+    py::function m_fn;
+};
+
+/**
+ * Deletes a MiniScope without holding the GIL, as stopping its capture thread
+ * may have to wait for a callback into Python to finish.
+ */
+struct GilReleasingDeleter
+{
+    void operator()(MiniScope *scope) const
+    {
+        py::gil_scoped_release release;
+        delete scope;
+    }
+};
+
+PYBIND11_MODULE(miniscope, m)
+{
+    m.doc() = "Record and process frames from UCLA Miniscopes";
+
+    py::enum_<VideoCodec>(m, "VideoCodec")
+        .value("Raw", VideoCodec::Raw)
+        .value("FFV1", VideoCodec::FFV1)
+        .value("AV1", VideoCodec::AV1)
+        .value("VP9", VideoCodec::VP9)
+        .value("H265", VideoCodec::H265)
+        .value("MPEG4", VideoCodec::MPEG4);
+
+    py::enum_<VideoContainer>(m, "VideoContainer")
+        .value("Matroska", VideoContainer::Matroska)
+        .value("AVI", VideoContainer::AVI);
+
+    py::enum_<BackgroundDiffMethod>(m, "BackgroundDiffMethod")
+        .value("NONE", BackgroundDiffMethod::NONE)
+        .value("SUBTRACTION", BackgroundDiffMethod::SUBTRACTION)
+        .value("DIVISION", BackgroundDiffMethod::DIVISION)
+        .value("PERCENTILE", BackgroundDiffMethod::PERCENTILE);
+
+    py::enum_<BinningMode>(m, "BinningMode")
+        .value("Mean", BinningMode::Mean)
+        .value("Sum", BinningMode::Sum);
+
+    py::enum_<CameraControl>(m, "CameraControl")
+        .value("Exposure", CameraControl::Exposure)
+        .value("Gain", CameraControl::Gain)
+        .value("Excitation", CameraControl::Excitation);
+
+    py::class_<FrameMetadata>(m, "FrameMetadata")
+        .def_readonly("sequence", &FrameMetadata::sequence)
+        .def_readonly("timestamp", &FrameMetadata::timestamp)
+        .def_readonly("host_timestamp", &FrameMetadata::hostTimestamp)
+        .def_readonly("missed_frames", &FrameMetadata::missedFrames)
+        .def_readonly("flags", &FrameMetadata::flags);
+
+    py::class_<SliceSummary>(m, "SliceSummary")
+        .def_readonly("slice_no", &SliceSummary::sliceNo)
+        .def_readonly("fname", &SliceSummary::fname)
+        .def_readonly("frames_count", &SliceSummary::framesCount)
+        .def_readonly("gaps_count", &SliceSummary::gapsCount)
+        .def_readonly("missed_frames_count", &SliceSummary::missedFramesCount);
+
+    py::class_<HistogramSummary>(m, "HistogramSummary")
+        .def_readonly("name", &HistogramSummary::name)
+        .def_readonly("count", &HistogramSummary::count)
+        .def_readonly("min", &HistogramSummary::min)
+        .def_readonly("max", &HistogramSummary::max)
+        .def_readonly("mean", &HistogramSummary::mean)
+        .def_readonly("p50", &HistogramSummary::p50)
+        .def_readonly("p90", &HistogramSummary::p90)
+        .def_readonly("p99", &HistogramSummary::p99)
+        .def_readonly("p999", &HistogramSummary::p999);
+
+    py::class_<GaugeSummary>(m, "GaugeSummary")
+        .def_readonly("name", &GaugeSummary::name)
+        .def_readonly("current", &GaugeSummary::current)
+        .def_readonly("max", &GaugeSummary::max);
+
+    py::class_<ThreadSummary>(m, "ThreadSummary")
+        .def_readonly("name", &ThreadSummary::name)
+        .def_readonly("scheduling", &ThreadSummary::scheduling);
+
+    py::class_<PipelineStats>(m, "PipelineStats")
+        .def_readonly("histograms", &PipelineStats::histograms)
+        .def_readonly("gauges", &PipelineStats::gauges)
+        .def_readonly("threads", &PipelineStats::threads)
+        .def("histogram", [](const PipelineStats &stats, const std::string &name) -> py::object {
+            const auto hist = stats.histogram(name);
+            return hist? py::cast(*hist) : py::none();
+        })
+        .def("gauge", [](const PipelineStats &stats, const std::string &name) -> py::object {
+            const auto gauge = stats.gauge(name);
+            return gauge? py::cast(*gauge) : py::none();
+        });
+
+    py::class_<RoiTraces>(m, "RoiTraces")
+        .def_readonly("meta", &RoiTraces::meta)
+        .def_readonly("fluorescence", &RoiTraces::fluorescence)
+        .def_readonly("dff", &RoiTraces::dff);
+
+    py::class_<MotionShift>(m, "MotionShift")
+        .def_readonly("sequence", &MotionShift::sequence)
+        .def_readonly("dx", &MotionShift::dx)
+        .def_readonly("dy", &MotionShift::dy)
+        .def_readonly("peak", &MotionShift::peak)
+        .def_readonly("valid", &MotionShift::valid);
+
+    py::class_<FrameReduction>(m, "FrameReduction")
+        .def(py::init<>())
+        .def_property("crop",
+                      [](const FrameReduction &r) { return py::make_tuple(r.crop.x, r.crop.y, r.crop.width, r.crop.height); },
+                      [](FrameReduction &r, std::tuple<int, int, int, int> rect) {
+                          r.crop = cv::Rect(std::get<0>(rect), std::get<1>(rect), std::get<2>(rect), std::get<3>(rect));
+                      })
+        .def_readwrite("binning", &FrameReduction::binning)
+        .def_readwrite("temporal_binning", &FrameReduction::temporalBinning)
+        .def_readwrite("binning_mode", &FrameReduction::binningMode)
+        .def_readwrite("deep_pixels", &FrameReduction::deepPixels);
+
+    py::class_<SummaryImages>(m, "SummaryImages")
+        .def_readonly("frames_count", &SummaryImages::framesCount)
+        .def_property_readonly("mean", [](const SummaryImages &si) { return matToArray(si.mean); })
+        .def_property_readonly("max", [](const SummaryImages &si) { return matToArray(si.max); })
+        .def_property_readonly("stddev", [](const SummaryImages &si) { return matToArray(si.stddev); })
+        .def_property_readonly("correlation", [](const SummaryImages &si) { return matToArray(si.correlation); });
+
+    py::class_<MiniScope, std::unique_ptr<MiniScope, GilReleasingDeleter>>(m, "MiniScope")
+        .def(py::init<>())
+        .def("set_scope_cam_id", &MiniScope::setScopeCamId)
+        .def("connect", &MiniScope::connect, py::call_guard<py::gil_scoped_release>())
+        .def("disconnect", &MiniScope::disconnect, py::call_guard<py::gil_scoped_release>())
+        .def("run", &MiniScope::run, py::call_guard<py::gil_scoped_release>())
+        .def("stop", &MiniScope::stop, py::call_guard<py::gil_scoped_release>())
+        .def("start_recording", [](MiniScope &scope, const std::string &fname) {
+            return scope.startRecording(fname);
+        }, py::arg("fname") = "", py::call_guard<py::gil_scoped_release>())
+        .def("stop_recording", [](MiniScope &scope) {
+            scope.stopRecording();
+        }, py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("running", &MiniScope::running)
+        .def_property_readonly("recording", &MiniScope::recording)
+        .def_property_readonly("last_error", &MiniScope::lastError)
+
+        .def("set_on_message", [](MiniScope &scope, py::function fn) {
+            auto cb = std::make_shared<PyCallback>(std::move(fn));
+            scope.setOnMessage([cb](const std::string &msg) { (*cb)(msg); });
+        })
+        .def("set_on_control_applied", [](MiniScope &scope, py::function fn) {
+            auto cb = std::make_shared<PyCallback>(std::move(fn));
+            scope.setOnControlApplied([cb](CameraControl control, double value, size_t frameNo) {
+                (*cb)(control, value, frameNo);
+            });
+        })
+        .def("set_on_frame", [](MiniScope &scope, py::function fn) {
+            // the frame is handed over without copying, the capture thread only
+            // waits while the GIL is taken and the callback runs
+            auto cb = std::make_shared<PyCallback>(std::move(fn));
+            scope.setOnFrame([cb](const cv::Mat &frame, const FrameMetadata &meta) {
+                py::gil_scoped_acquire gil;
+                (*cb)(matToArray(frame), meta);
+            });
+        }, "Call a function with every raw frame (as read-only NumPy array) and its metadata, "
+           "from the capture thread. Copy the frame before modifying it.")
+        .def("clear_on_frame", [](MiniScope &scope) {
+            py::gil_scoped_release release;
+            scope.setOnFrame(nullptr);
+        })
+
+        .def("set_rois", [](MiniScope &scope, const std::vector<py::array_t<float, py::array::c_style | py::array::forcecast>> &footprints) {
+            std::vector<cv::Mat> mats;
+            for (const auto &fp : footprints) {
+                const auto info = fp.request();
+                if (info.ndim != 2)
+                    throw std::invalid_argument("ROI footprints must be arrays of shape (height, width).");
+                // footprints are compiled right away, so referencing the array data is sufficient
+                mats.push_back(cv::Mat(static_cast<int>(info.shape[0]), static_cast<int>(info.shape[1]), CV_32FC1, info.ptr));
+            }
+            if (!scope.setRois(mats))
+                throw std::invalid_argument(scope.lastError());
+        }, "Set the footprints (weight maps of the frame size) of the ROIs to extract traces for.")
+        .def("clear_rois", &MiniScope::clearRois)
+        .def_property_readonly("rois_count", &MiniScope::roisCount)
+        .def_property("roi_baseline_window", &MiniScope::roiBaselineWindow, &MiniScope::setRoiBaselineWindow)
+        .def_property("roi_trace_file", &MiniScope::roiTraceFile, &MiniScope::setRoiTraceFile)
+        .def("set_on_roi_traces", [](MiniScope &scope, py::function fn) {
+            auto cb = std::make_shared<PyCallback>(std::move(fn));
+            scope.setOnRoiTraces([cb](const RoiTraces &traces) { (*cb)(traces); });
+        })
+
+        .def_property("motion_correction", &MiniScope::motionCorrection, &MiniScope::setMotionCorrection)
+        .def_property("motion_correct_recording", &MiniScope::motionCorrectRecording, &MiniScope::setMotionCorrectRecording)
+        .def_property("motion_log_file", &MiniScope::motionLogFile, &MiniScope::setMotionLogFile)
+        .def_property_readonly("motion_shift", &MiniScope::motionShift)
+        .def_property("summary_images_enabled", &MiniScope::summaryImagesEnabled, &MiniScope::setSummaryImagesEnabled)
+        .def_property("summary_frame_stride", &MiniScope::summaryFrameStride, &MiniScope::setSummaryFrameStride)
+        .def("summary_images", &MiniScope::summaryImages, py::call_guard<py::gil_scoped_release>())
+        .def_property("recording_reduction", &MiniScope::recordingReduction, &MiniScope::setRecordingReduction)
+        .def_property("display_reduction", &MiniScope::displayReduction, &MiniScope::setDisplayReduction)
+        .def_property("processing_threads", &MiniScope::processingThreads, &MiniScope::setProcessingThreads)
+
+        .def("current_frame", [](MiniScope &scope) {
+            cv::Mat frame;
+            {
+                py::gil_scoped_release release;
+                frame = scope.currentFrame();
+            }
+            return matToArray(frame);
+        })
+
+        .def_property("exposure", &MiniScope::exposure, &MiniScope::setExposure)
+        .def_property("gain", &MiniScope::gain, &MiniScope::setGain)
+        .def_property("excitation", &MiniScope::excitation, &MiniScope::setExcitation)
+        .def_property("fps", &MiniScope::fps, &MiniScope::setFps)
+        .def_property("use_color", &MiniScope::useColor, &MiniScope::setUseColor)
+        .def_property("display_enabled", &MiniScope::displayEnabled, &MiniScope::setDisplayEnabled)
+        .def_property("external_record_trigger", &MiniScope::externalRecordTrigger, &MiniScope::setExternalRecordTrigger)
+        .def_property("pre_trigger_buffer_time", &MiniScope::preTriggerBufferTime, &MiniScope::setPreTriggerBufferTime)
+        .def_property("video_filename", &MiniScope::videoFilename, &MiniScope::setVideoFilename)
+        .def_property("video_codec", &MiniScope::videoCodec, &MiniScope::setVideoCodec)
+        .def_property("video_container", &MiniScope::videoContainer, &MiniScope::setVideoContainer)
+        .def_property("record_lossless", &MiniScope::recordLossless, &MiniScope::setRecordLossless)
+        .def_property("recording_slice_interval", &MiniScope::recordingSliceInterval, &MiniScope::setRecordingSliceInterval)
+        .def_property("min_fluor_display", &MiniScope::minFluorDisplay, &MiniScope::setMinFluorDisplay)
+        .def_property("max_fluor_display", &MiniScope::maxFluorDisplay, &MiniScope::setMaxFluorDisplay)
+        .def_property("display_bg_diff_method", &MiniScope::displayBgDiffMethod, &MiniScope::setDisplayBgDiffMethod)
+        .def_property("bg_accumulate_alpha", &MiniScope::bgAccumulateAlpha, &MiniScope::setBgAccumulateAlpha)
+        .def_property("bg_percentile", &MiniScope::bgPercentile, &MiniScope::setBgPercentile)
+        .def_property("bg_percentile_window", &MiniScope::bgPercentileWindow, &MiniScope::setBgPercentileWindow)
+        .def_property("trace_file", &MiniScope::traceFile, &MiniScope::setTraceFile)
+        .def_property("shared_frame_ring_name", &MiniScope::sharedFrameRingName, &MiniScope::setSharedFrameRingName)
+        .def_property("shared_frame_ring_slots", &MiniScope::sharedFrameRingSlots, &MiniScope::setSharedFrameRingSlots)
+        .def_property("stats_enabled", &MiniScope::statsEnabled, &MiniScope::setStatsEnabled)
+
+        .def_property_readonly("current_fps", &MiniScope::currentFPS)
+        .def_property_readonly("measured_fps", &MiniScope::measuredFps)
+        .def_property_readonly("dropped_frames_count", &MiniScope::droppedFramesCount)
+        .def_property_readonly("frame_gaps_count", &MiniScope::frameGapsCount)
+        .def_property_readonly("missed_frames_count", &MiniScope::missedFramesCount)
+        .def_property_readonly("last_recorded_frame_time", &MiniScope::lastRecordedFrameTime)
+        .def_property_readonly("record_start_latency", &MiniScope::recordStartLatency)
+        .def("recording_slices", &MiniScope::recordingSlices)
+        .def("stats", &MiniScope::stats)
+        .def("reset_stats", &MiniScope::resetStats);
+
+    py::class_<VideoWriter>(m, "VideoWriter")
+        .def(py::init<>())
+        .def("initialize", &VideoWriter::initialize,
+             py::arg("fname"), py::arg("width"), py::arg("height"), py::arg("fps"),
+             py::arg("has_color"), py::arg("save_timestamps") = true,
+             py::call_guard<py::gil_scoped_release>())
+        .def("finalize", &VideoWriter::finalize, py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("initialized", &VideoWriter::initialized)
+        .def("push_frame", [](VideoWriter &writer, py::array_t<uint8_t, py::array::c_style | py::array::forcecast> frame, double timestamp) {
+            // the encoder keeps the frame queued after we return, so it needs its own copy
+            const auto mat = arrayToMat(frame).clone();
+            py::gil_scoped_release release;
+            return writer.pushFrame(mat, timestamp);
+        }, py::arg("frame"), py::arg("timestamp"))
+        .def_property("codec", &VideoWriter::codec, &VideoWriter::setCodec)
+        .def_property("container", &VideoWriter::container, &VideoWriter::setContainer)
+        .def_property("lossless", &VideoWriter::lossless, &VideoWriter::setLossless)
+        .def_property("file_slice_interval", &VideoWriter::fileSliceInterval, &VideoWriter::setFileSliceInterval)
+        .def_property("stats_enabled", &VideoWriter::statsEnabled, &VideoWriter::setStatsEnabled)
+        .def_property_readonly("width", &VideoWriter::width)
+        .def_property_readonly("height", &VideoWriter::height)
+        .def_property_readonly("fps", &VideoWriter::fps)
+        .def_property_readonly("last_error", &VideoWriter::lastError)
+        .def("stats", &VideoWriter::stats)
+        .def("slice_summaries", &VideoWriter::sliceSummaries);
+}
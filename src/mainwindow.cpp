@@ -72,6 +72,7 @@ MainWindow::MainWindow(QWidget *parent) :
     this->on_containerComboBox_currentIndexChanged(ui->containerComboBox->currentText());
     ui->losslessCheckBox->setChecked(true);
     on_sliceIntervalSpinBox_valueChanged(ui->sliceIntervalSpinBox->value());
+    on_preTriggerSpinBox_valueChanged(ui->preTriggerSpinBox->value());
 
     // set export directory, default to /tmp
     setDataExportDir(QStandardPaths::writableLocation(QStandardPaths::StandardLocation::TempLocation));
@@ -176,7 +177,12 @@ void MainWindow::on_btnStartStop_clicked()
             m_scopeView->showImage(frame);
 
             ui->labelCurrentFPS->setText(QString::number(m_mscope->currentFPS()));
-            ui->labelDroppedFrames->setText(QString::number(m_mscope->droppedFramesCount()));
+            if (m_mscope->missedFramesCount() > 0)
+                ui->labelDroppedFrames->setText(QStringLiteral("%1 (%2 missed)")
+                                                .arg(m_mscope->droppedFramesCount())
+                                                .arg(m_mscope->missedFramesCount()));
+            else
+                ui->labelDroppedFrames->setText(QString::number(m_mscope->droppedFramesCount()));
 
             ui->labelScopeMin->setText(QString::number(m_mscope->minFluor()).rightJustified(3, '0'));
             ui->labelScopeMax->setText(QString::number(m_mscope->maxFluor()).rightJustified(3, '0'));
@@ -416,6 +422,7 @@ void MainWindow::on_bgSubstCheckBox_toggled(bool checked)
 {
     if (checked) {
         ui->bgDivCheckBox->setChecked(false);
+        ui->bgPercentileCheckBox->setChecked(false);
         m_mscope->setDisplayBgDiffMethod(BackgroundDiffMethod::SUBTRACTION);
     } else {
         m_mscope->setDisplayBgDiffMethod(BackgroundDiffMethod::NONE);
@@ -426,17 +433,34 @@ void MainWindow::on_bgDivCheckBox_toggled(bool checked)
 {
     if (checked) {
         ui->bgSubstCheckBox->setChecked(false);
+        ui->bgPercentileCheckBox->setChecked(false);
         m_mscope->setDisplayBgDiffMethod(BackgroundDiffMethod::DIVISION);
     } else {
         m_mscope->setDisplayBgDiffMethod(BackgroundDiffMethod::NONE);
     }
 }
 
+void MainWindow::on_bgPercentileCheckBox_toggled(bool checked)
+{
+    if (checked) {
+        ui->bgSubstCheckBox->setChecked(false);
+        ui->bgDivCheckBox->setChecked(false);
+        m_mscope->setDisplayBgDiffMethod(BackgroundDiffMethod::PERCENTILE);
+    } else {
+        m_mscope->setDisplayBgDiffMethod(BackgroundDiffMethod::NONE);
+    }
+}
+
 void MainWindow::on_sliceIntervalSpinBox_valueChanged(int arg1)
 {
     m_mscope->setRecordingSliceInterval(static_cast<uint>(arg1));
 }
 
+void MainWindow::on_preTriggerSpinBox_valueChanged(double arg1)
+{
+    m_mscope->setPreTriggerBufferTime(arg1);
+}
+
 void MainWindow::on_accAlphaSpinBox_valueChanged(double arg1)
 {
     m_mscope->setBgAccumulateAlpha(arg1);
@@ -54,6 +54,7 @@ private slots:
     void on_sbDisplayMin_valueChanged(int arg1);
     void on_fpsSpinBox_valueChanged(int arg1);
     void on_sliceIntervalSpinBox_valueChanged(int arg1);
+    void on_preTriggerSpinBox_valueChanged(double arg1);
 
     void on_actionAbout_triggered();
     void on_actionAbout_Video_Formats_triggered();
@@ -62,6 +63,7 @@ private slots:
     void on_btnOpenSaveDir_clicked();
 
     void on_bgDivCheckBox_toggled(bool checked);
+    void on_bgPercentileCheckBox_toggled(bool checked);
     void on_bgSubstCheckBox_toggled(bool checked);
     void on_accAlphaSpinBox_valueChanged(double arg1);
 
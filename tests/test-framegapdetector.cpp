@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <iostream>
+
+#include "framegapdetector.h"
+
+static int failures = 0;
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #expr << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * Feed frames with a constant interval, starting at the given driver timestamp.
+ * Returns the timestamp of the last frame.
+ */
+static double feedFrames(FrameGapDetector &detector, double start, double interval, int count, unsigned int *missed)
+{
+    double ts = start;
+    for (int i = 0; i < count; i++) {
+        ts += interval;
+        *missed += detector.check(ts, ts);
+    }
+    return ts;
+}
+
+/**
+ * A camera that runs well below the requested rate from the start has no gaps.
+ */
+static void testSlowFromStart()
+{
+    FrameGapDetector detector;
+    detector.setThreshold(1.5);
+    detector.setExpectedInterval(1000.0 / 30);
+
+    unsigned int missed = 0;
+    feedFrames(detector, 0, 1000.0 / 10, 100, &missed);
+    CHECK(detector.gapCount() == 0);
+    CHECK(detector.missedFramesCount() == 0);
+}
+
+/**
+ * A camera that slows down for good has no gaps after the switch,
+ * while single lost frames are still detected at the new rate.
+ */
+static void testSlowDown()
+{
+    FrameGapDetector detector;
+    detector.setThreshold(1.5);
+    detector.setExpectedInterval(50);
+
+    unsigned int missed = 0;
+    auto ts = feedFrames(detector, 0, 50, 100, &missed);
+    ts = feedFrames(detector, ts, 120, 100, &missed);
+    CHECK(detector.gapCount() == 0);
+    CHECK(detector.missedFramesCount() == 0);
+
+    // one frame lost at the new rate
+    ts = feedFrames(detector, ts, 240, 1, &missed);
+    feedFrames(detector, ts, 120, 10, &missed);
+    CHECK(detector.gapCount() == 1);
+    CHECK(detector.missedFramesCount() == 1);
+}
+
+/**
+ * Lost frames at the expected rate are counted.
+ */
+static void testGaps()
+{
+    FrameGapDetector detector;
+    detector.setThreshold(1.5);
+    detector.setExpectedInterval(50);
+
+    unsigned int missed = 0;
+    auto ts = feedFrames(detector, 0, 50, 20, &missed);
+    ts = feedFrames(detector, ts, 150, 1, &missed);
+    ts = feedFrames(detector, ts, 50, 20, &missed);
+    ts = feedFrames(detector, ts, 100, 1, &missed);
+    feedFrames(detector, ts, 50, 20, &missed);
+    CHECK(detector.gapCount() == 2);
+    CHECK(detector.missedFramesCount() == 3);
+    CHECK(missed == 3);
+}
+
+int main()
+{
+    testSlowFromStart();
+    testSlowDown();
+    testGaps();
+
+    return failures == 0? 0 : 1;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "miniscopemanager.h"
+#include "framesource.h"
+
+static int failures = 0;
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #expr << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * Record from two synthetic devices at once. Both recordings start and stop
+ * at the same frame time, so they hold about the same number of frames.
+ */
+static void testSyntheticRecording()
+{
+    MiniScopeManager manager(2);
+    for (int i = 0; i < 2; i++) {
+        auto scope = manager.addScope(std::make_shared<SyntheticFrameSource>(160, 120, 20));
+        scope->setDisplayEnabled(false);
+        scope->setFps(20);
+        scope->setVideoCodec(VideoCodec::FFV1);
+        scope->setVideoContainer(VideoContainer::Matroska);
+    }
+    CHECK(manager.scopesCount() == 2);
+
+    CHECK(manager.connect());
+    CHECK(manager.run());
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    CHECK(manager.startRecording("test-manager-recording"));
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    manager.stopRecording();
+    // the recordings are finalized with the first frame after the stop time
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    CHECK(!manager.recording());
+
+    const auto scopes = manager.scopes();
+    for (const auto &scope : scopes)
+        CHECK(scope->running());
+    manager.stop();
+    manager.disconnect();
+
+    uint64_t framesCount[2] = {0, 0};
+    for (size_t i = 0; i < scopes.size(); i++) {
+        CHECK(scopes[i]->lastError().empty());
+        CHECK(scopes[i]->droppedFramesCount() == 0);
+        for (const auto &slice : scopes[i]->recordingSlices())
+            framesCount[i] += slice.framesCount;
+    }
+
+    // 2 seconds at 20 fps, with some room for a slow machine
+    CHECK(framesCount[0] >= 30 && framesCount[0] <= 41);
+    CHECK(framesCount[1] >= framesCount[0] - 1 && framesCount[1] <= framesCount[0] + 1);
+}
+
+int main()
+{
+    testSyntheticRecording();
+
+    return failures == 0? 0 : 1;
+}
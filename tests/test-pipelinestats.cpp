@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2019 Matthias Klumpp <matthias@tenstral.net>
+ *
+ * Licensed under the GNU Lesser General Public License Version 3
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the license, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this software.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+
+#include "pipelinestats.h"
+
+static int failures = 0;
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #expr << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * Values beyond the largest recordable one are clamped into the last bucket.
+ */
+static void testHugeValues()
+{
+    const double maxUsec = static_cast<double>((static_cast<uint64_t>(1) << 40) - 1) / 1000.0;
+
+    LatencyHistogram hist("huge");
+    hist.record(std::chrono::nanoseconds::max());
+    auto s = hist.summary();
+    CHECK(s.count == 1);
+    CHECK(s.max == maxUsec);
+    CHECK(s.p50 == maxUsec);
+
+    // every power of two, up to far beyond the clamp limit
+    hist.reset();
+    for (int bits = 0; bits < 63; bits++)
+        hist.record(std::chrono::nanoseconds(static_cast<int64_t>(1) << bits));
+    s = hist.summary();
+    CHECK(s.count == 63);
+    CHECK(s.min == 0.001);
+    CHECK(s.max == maxUsec);
+    CHECK(s.p999 > maxUsec * 0.97 && s.p999 <= maxUsec);
+}
+
+static void testPrecision()
+{
+    LatencyHistogram hist("precision");
+    for (int i = 1; i <= 1000; i++)
+        hist.record(std::chrono::microseconds(i));
+
+    const auto s = hist.summary();
+    CHECK(s.count == 1000);
+    CHECK(s.min == 1.0);
+    CHECK(s.max == 1000.0);
+    CHECK(s.p50 > 500.0 * 0.97 && s.p50 < 500.0 * 1.03);
+    CHECK(s.p99 > 990.0 * 0.97 && s.p99 < 990.0 * 1.03);
+}
+
+int main()
+{
+    testHugeValues();
+    testPrecision();
+
+    return failures == 0? 0 : 1;
+}